@@ -25,16 +25,22 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <syslog.h>
+#include <errno.h>
 
 #ifdef _THREAD_SAFE
 #include <pthread.h>
-#define A_LOCK(num, hash) do { pthread_mutex_lock (&(hash)->locks[(num)]); } while (0)
+#define A_LOCK(num, hash) do { awl_lock ((hash), (num)); } while (0)
 #define A_UNLOCK(num, hash) do { pthread_mutex_unlock (&(hash)->locks[(num)]); } while (0)
 #else
 #define A_LOCK(num, hash) do {} while (0)
@@ -44,20 +50,15 @@
 #include "awl.h"
 #include "rmilter.h"
 
-static void *
-awl_pool_alloc (int nest, size_t offset, awl_hash_t *hash)
-{
-	if (nest < 0 || nest > NEST_NUMBER - 1) {
-		return NULL;
-	}
-	/* Handle nest overflow */
-	if (hash->free[nest] < offset + sizeof (awl_item_t )) {
-		return NULL;
-	}
-	
-	hash->free[nest] -= sizeof (awl_item_t);
-	return hash->pool + nest * (hash->poolsize / NEST_NUMBER) + offset;
-}
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+/* Items are aligned after header */
+#define AWL_HEADER_SIZE ((sizeof (awl_header_t) + 63) & ~63)
+/* How long to wait for other process initializing shared awl, in 10ms ticks */
+#define AWL_SHM_WAIT 100
+#define AWL_ITEM(hash, nest, i) ((awl_item_t *)((hash)->pool + (nest) * (hash)->nest_items * sizeof (awl_item_t)) + (i))
 
 static uint32_t
 awl_get_hash (uint32_t a)
@@ -72,11 +73,295 @@ awl_get_hash (uint32_t a)
 	return a % NEST_NUMBER;
 }
 
+static uint32_t
+awl_key_hash (const awl_key_t *key)
+{
+	uint64_t a = key->hi ^ key->lo;
+
+	return awl_get_hash ((uint32_t)(a ^ (a >> 32)));
+}
+
+/* Make key from ipv4 or ipv6 address, returns 0 for unsupported families */
+static int
+awl_make_key (const struct sockaddr *addr, awl_hash_t *hash, awl_key_t *key)
+{
+	const struct sockaddr_in *sa4;
+	const struct sockaddr_in6 *sa6;
+	u_char buf[16];
+	int i, bits;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		sa4 = (const struct sockaddr_in *)addr;
+		key->hi = 0;
+		key->lo = 0x0000ffff00000000ULL | ntohl (sa4->sin_addr.s_addr);
+		return 1;
+	case AF_INET6:
+		sa6 = (const struct sockaddr_in6 *)addr;
+		memcpy (buf, &sa6->sin6_addr, sizeof (buf));
+		if (!IN6_IS_ADDR_V4MAPPED (&sa6->sin6_addr)) {
+			/* Aggregate address to prefix */
+			for (i = 0, bits = hash->ipv6_prefix; i < 16; i++, bits -= 8) {
+				if (bits <= 0) {
+					buf[i] = 0;
+				}
+				else if (bits < 8) {
+					buf[i] &= 0xff << (8 - bits);
+				}
+			}
+		}
+		key->hi = 0;
+		key->lo = 0;
+		for (i = 0; i < 8; i++) {
+			key->hi = (key->hi << 8) | buf[i];
+			key->lo = (key->lo << 8) | buf[i + 8];
+		}
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static const char *
+awl_key_to_string (const awl_key_t *key, awl_hash_t *hash, char *buf, size_t len)
+{
+	u_char addr[16];
+	struct in_addr in;
+	size_t r;
+	int i;
+
+	if (key->hi == 0 && (key->lo >> 32) == 0x0000ffffULL) {
+		in.s_addr = htonl ((uint32_t)key->lo);
+		return inet_ntop (AF_INET, &in, buf, len);
+	}
+
+	for (i = 0; i < 8; i++) {
+		addr[i] = key->hi >> (56 - i * 8);
+		addr[i + 8] = key->lo >> (56 - i * 8);
+	}
+	if (inet_ntop (AF_INET6, addr, buf, len) == NULL) {
+		return NULL;
+	}
+	r = strlen (buf);
+	if (hash->ipv6_prefix < 128) {
+		snprintf (buf + r, len - r, "/%d", hash->ipv6_prefix);
+	}
+
+	return buf;
+}
+
+#ifdef _THREAD_SAFE
+static void
+awl_lock (awl_hash_t *hash, uint32_t nest)
+{
+	int r;
+
+	r = pthread_mutex_lock (&hash->locks[nest]);
+#ifdef EOWNERDEAD
+	if (r == EOWNERDEAD) {
+		/* Process that held this lock died, items are updated in place so nest is still usable */
+		msg_warn ("awl_lock: owner of nest %u lock died, recovering", nest);
+		pthread_mutex_consistent (&hash->locks[nest]);
+	}
+#endif
+}
+#endif
+
+static void
+awl_init_header (awl_header_t *header, size_t poolsize, int ipv6_prefix)
+{
+	bzero (header, sizeof (awl_header_t));
+	memcpy (header->magic, AWL_MAGIC, sizeof (AWL_MAGIC));
+	header->version = AWL_VERSION;
+	header->nests = NEST_NUMBER;
+	header->item_size = sizeof (awl_item_t);
+	header->header_size = sizeof (awl_header_t);
+	header->poolsize = poolsize;
+	header->ipv6_prefix = ipv6_prefix;
+}
+
+#ifdef _THREAD_SAFE
+/* Locks are process shared if awl is in shared segment */
+static void
+awl_init_locks (pthread_mutex_t *locks, int shared)
+{
+	pthread_mutexattr_t mattr;
+	int i;
+
+	pthread_mutexattr_init (&mattr);
+	if (shared) {
+		pthread_mutexattr_setpshared (&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef EOWNERDEAD
+		pthread_mutexattr_setrobust (&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+	}
+	for (i = 0; i < NEST_NUMBER; i++) {
+		pthread_mutex_init (&locks[i], &mattr);
+	}
+	pthread_mutexattr_destroy (&mattr);
+}
+#endif
+
+/* Check whether mapped snapshot has layout we expect */
+static int
+awl_check_header (awl_header_t *header, size_t poolsize, size_t nest_items, int ipv6_prefix)
+{
+	int i;
+
+	if (memcmp (header->magic, AWL_MAGIC, sizeof (AWL_MAGIC)) != 0 ||
+			header->version != AWL_VERSION ||
+			header->nests != NEST_NUMBER ||
+			header->item_size != sizeof (awl_item_t) ||
+			header->header_size != sizeof (awl_header_t) ||
+			header->poolsize != poolsize ||
+			header->ipv6_prefix != (uint32_t)ipv6_prefix) {
+		return 0;
+	}
+	for (i = 0; i < NEST_NUMBER; i++) {
+		if (header->used[i] > nest_items) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Map snapshot file, returns -1 if file cannot be used */
+static int
+awl_map_file (awl_hash_t *hash, const char *file)
+{
+	struct stat st;
+	int fd, valid = 0;
+
+	if ((fd = open (file, O_RDWR | O_CREAT, 0600)) == -1) {
+		msg_warn ("awl_map_file: cannot open %s: %m", file);
+		return -1;
+	}
+	if (fstat (fd, &st) == -1) {
+		msg_warn ("awl_map_file: cannot stat %s: %m", file);
+		close (fd);
+		return -1;
+	}
+
+	if ((size_t)st.st_size != hash->maplen) {
+		/* Drop snapshot of different size */
+		if (ftruncate (fd, 0) == -1 || ftruncate (fd, hash->maplen) == -1) {
+			msg_warn ("awl_map_file: cannot truncate %s: %m", file);
+			close (fd);
+			return -1;
+		}
+	}
+
+	hash->map = mmap (NULL, hash->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hash->map == MAP_FAILED) {
+		msg_warn ("awl_map_file: cannot mmap %s: %m", file);
+		close (fd);
+		return -1;
+	}
+	hash->header = hash->map;
+
+	if ((size_t)st.st_size == hash->maplen) {
+		valid = awl_check_header (hash->header, hash->poolsize, hash->nest_items, hash->ipv6_prefix);
+		if (!valid) {
+			msg_warn ("awl_map_file: %s has incompatible format or ipv6 prefix, reinitializing", file);
+		}
+	}
+	if (!valid) {
+		bzero ((u_char *)hash->map + AWL_HEADER_SIZE, hash->poolsize);
+		awl_init_header (hash->header, hash->poolsize, hash->ipv6_prefix);
+	}
+	else {
+		msg_info ("awl_map_file: loaded awl snapshot from %s", file);
+	}
+	hash->fd = fd;
+
+	return 0;
+}
+
+/*
+ * Map named shared memory segment, the first process creates and inits it,
+ * others wait for it to be ready. Returns -1 if segment cannot be used
+ */
+static int
+awl_map_shm (awl_hash_t *hash, const char *name)
+{
+	struct stat st;
+	int fd, creator = 1, i;
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd == -1 && errno == EEXIST) {
+		creator = 0;
+		fd = shm_open (name, O_RDWR, 0600);
+	}
+	if (fd == -1) {
+		msg_warn ("awl_map_shm: cannot open shared segment %s: %m", name);
+		return -1;
+	}
+
+	if (creator) {
+		if (ftruncate (fd, hash->maplen) == -1) {
+			msg_warn ("awl_map_shm: cannot truncate shared segment %s: %m", name);
+			close (fd);
+			shm_unlink (name);
+			return -1;
+		}
+	}
+	else {
+		/* Segment may be still truncated by its creator */
+		for (i = 0; i < AWL_SHM_WAIT; i++) {
+			if (fstat (fd, &st) == -1 || st.st_size != 0) {
+				break;
+			}
+			usleep (10000);
+		}
+		if (fstat (fd, &st) == -1 || (size_t)st.st_size != hash->maplen) {
+			msg_warn ("awl_map_shm: shared segment %s has different size, check awl_pool of other processes", name);
+			close (fd);
+			return -1;
+		}
+	}
+
+	hash->map = mmap (NULL, hash->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (hash->map == MAP_FAILED) {
+		msg_warn ("awl_map_shm: cannot mmap shared segment %s: %m", name);
+		return -1;
+	}
+	hash->header = hash->map;
+
+	if (creator) {
+		awl_init_header (hash->header, hash->poolsize, hash->ipv6_prefix);
+#ifdef _THREAD_SAFE
+		awl_init_locks (hash->header->locks, 1);
+#endif
+		__sync_synchronize ();
+		hash->header->ready = 1;
+		msg_info ("awl_map_shm: created shared awl segment %s", name);
+	}
+	else {
+		for (i = 0; i < AWL_SHM_WAIT && !hash->header->ready; i++) {
+			usleep (10000);
+		}
+		__sync_synchronize ();
+		if (!hash->header->ready ||
+				!awl_check_header (hash->header, hash->poolsize, hash->nest_items, hash->ipv6_prefix)) {
+			msg_warn ("awl_map_shm: shared segment %s is not usable, remove it or check awl_pool and awl_ipv6_prefix of other processes", name);
+			munmap (hash->map, hash->maplen);
+			return -1;
+		}
+		msg_info ("awl_map_shm: attached to shared awl segment %s", name);
+	}
+	hash->shared = 1;
+
+	return 0;
+}
+
 awl_hash_t *
-awl_init (size_t poolsize, int hits, int ttl)
+awl_init (size_t poolsize, int hits, int ttl, int ipv6_prefix,
+		const char *file, const char *shm_name)
 {
 	awl_hash_t *result;
-	int i;
+	int r = -1;
 
 	/* Check whether we have enough pool for operations */
 	if (poolsize < sizeof (awl_item_t) * NEST_NUMBER) {
@@ -90,21 +375,47 @@ awl_init (size_t poolsize, int hits, int ttl)
 	}
 	bzero (result, sizeof (awl_hash_t));
 
-	madvise (result->pool, poolsize, MADV_SEQUENTIAL);
-	result->pool = malloc (poolsize);
-	if (result->pool == NULL) {
-		free (result);
-		return NULL;
-	}
-	bzero (result->pool, poolsize);
 	result->poolsize = poolsize;
-	
-	for (i = 0; i < NEST_NUMBER; i++) {
-		result->free[i] = poolsize / NEST_NUMBER;
+	result->nest_items = poolsize / NEST_NUMBER / sizeof (awl_item_t);
+	result->maplen = AWL_HEADER_SIZE + poolsize;
+	result->fd = -1;
+	if (ipv6_prefix <= 0 || ipv6_prefix > 128) {
+		ipv6_prefix = 128;
+	}
+	result->ipv6_prefix = ipv6_prefix;
+
+	if (shm_name != NULL) {
+		if (file != NULL) {
+			msg_warn ("awl_init: awl is shared, ignoring awl file %s", file);
+		}
+		r = awl_map_shm (result, shm_name);
+	}
+	else if (file != NULL) {
+		r = awl_map_file (result, file);
+	}
+	if (r == -1) {
+		result->map = mmap (NULL, result->maplen, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+		if (result->map == MAP_FAILED) {
+			free (result);
+			return NULL;
+		}
+		result->header = result->map;
+		awl_init_header (result->header, poolsize, result->ipv6_prefix);
+	}
 #ifdef _THREAD_SAFE
-		/* result->locks[i] = PTHREAD_MUTEX_INITIALIZER; */
-#endif
+	/*
+	 * Snapshot file may be mapped by old config during reload too, so locks
+	 * are kept out of it
+	 */
+	if (result->shared) {
+		result->locks = result->header->locks;
 	}
+	else {
+		awl_init_locks (result->own_locks, 0);
+		result->locks = result->own_locks;
+	}
+#endif
+	result->pool = (u_char *)result->map + AWL_HEADER_SIZE;
 	result->white_hits = hits;
 	result->ttl = ttl;
 
@@ -112,35 +423,45 @@ awl_init (size_t poolsize, int hits, int ttl)
 }
 
 int
-awl_check (uint32_t ip, awl_hash_t *hash, time_t tm)
+awl_check (const struct sockaddr *addr, awl_hash_t *hash, time_t tm)
 {
-	uint32_t nest;
+	uint32_t nest, i;
 	awl_item_t *cur;
-	struct in_addr in = {.s_addr = ip};
+	awl_key_t key;
+	char ipbuf[INET6_ADDRSTRLEN + 5];
 
-	nest = awl_get_hash (ip);
-	
-	cur = hash->nests[nest];
+	if (!awl_make_key (addr, hash, &key)) {
+		return 0;
+	}
+	nest = awl_key_hash (&key);
 	
 	A_LOCK (nest, hash);
-	while (cur) {
+	for (i = 0; i < hash->header->used[nest]; i++) {
+		cur = AWL_ITEM (hash, nest, i);
 		/* Found record */
-		if (cur->ip == ip) {
+		if (cur->key.lo == key.lo && cur->key.hi == key.hi) {
+			if (tm - cur->last > hash->ttl) {
+				/* Record is expired, it may be left from previous run */
+				cur->hits = 0;
+				A_UNLOCK (nest, hash);
+				return 0;
+			}
 			cur->last = tm;
-			msg_debug ("awl_check: ip %s in awl, hits %d", inet_ntoa (in), cur->hits);
-			A_UNLOCK (nest, hash);
+			msg_debug ("awl_check: ip %s in awl, hits %d",
+					awl_key_to_string (&key, hash, ipbuf, sizeof (ipbuf)), cur->hits);
 			if (cur->hits >= hash->white_hits) {
+				A_UNLOCK (nest, hash);
 				/* Address whitelisted */
-				msg_info ("awl_check: ip %s is whitelisted, hits %d", inet_ntoa (in), cur->hits);
+				msg_info ("awl_check: ip %s is whitelisted, hits %d",
+						awl_key_to_string (&key, hash, ipbuf, sizeof (ipbuf)), cur->hits);
 				return 1;
 			}
 			else {
 				cur->hits ++;
+				A_UNLOCK (nest, hash);
 				return 0;
 			}
 		}
-
-		cur = cur->next;
 	}
 	A_UNLOCK (nest, hash);
 
@@ -148,31 +469,23 @@ awl_check (uint32_t ip, awl_hash_t *hash, time_t tm)
 }
 
 void
-awl_add (uint32_t ip, awl_hash_t *hash, time_t tm)
+awl_add (const struct sockaddr *addr, awl_hash_t *hash, time_t tm)
 {
-	uint32_t nest;
+	uint32_t nest, i, used;
 	awl_item_t *cur, *expired = NULL, *eldest = NULL, *new;
-	int live_time = 0;
-	struct in_addr in = {.s_addr = ip};
-
-	nest = awl_get_hash (ip);
-	/* Find free nest */
-	if (hash->nests[nest] == NULL) {
-		cur = awl_pool_alloc (nest, 0, hash);
-		msg_info ("awl_add: insert ip %s in cache, insert first item", inet_ntoa (in));
-		cur->ip = ip;
-		cur->hits = 1;
-		cur->last = tm;
-		cur->prev = NULL;
-		cur->next = NULL;
-		hash->nests[nest] = cur;
+	int live_time = -1;
+	awl_key_t key;
+	char ipbuf[INET6_ADDRSTRLEN + 5];
+
+	if (!awl_make_key (addr, hash, &key)) {
 		return;
 	}
-
-	cur = hash->nests[nest];
+	nest = awl_key_hash (&key);
 
 	A_LOCK (nest, hash);
-	while (cur) {
+	used = hash->header->used[nest];
+	for (i = 0; i < used; i++) {
+		cur = AWL_ITEM (hash, nest, i);
 		/* Find eldest item */
 		if (tm - cur->last > live_time) {
 			live_time = tm - cur->last;
@@ -183,50 +496,76 @@ awl_add (uint32_t ip, awl_hash_t *hash, time_t tm)
 			cur->hits = 0;
 			expired = cur;
 		}
-		if (cur->ip == ip) {
-			/* Increase hits for specified item */
-			A_UNLOCK (nest, hash);
+		if (cur->key.lo == key.lo && cur->key.hi == key.hi) {
+			/* Update access time for specified item */
 			cur->last = tm;
+			A_UNLOCK (nest, hash);
 			return;
 		}
-		cur = cur->next;
 	}
 
-
+	awl_key_to_string (&key, hash, ipbuf, sizeof (ipbuf));
 	/* Record not found */
 	if (expired != NULL) {
 		/* Insert in place of expired item */
-		msg_info ("awl_add: insert ip %s in cache, replace expired item", inet_ntoa (in));
-		expired->ip = ip;
-		expired->hits = 1;
-		expired->last = tm;
+		msg_info ("awl_add: insert ip %s in cache, replace expired item", ipbuf);
+		new = expired;
 	}
-	if (hash->free[nest] >= sizeof (awl_item_t)) {
+	else if (used < hash->nest_items) {
 		/* We have enough free space in pool */
-		msg_info ("awl_add: insert ip %s in cache, normal insert", inet_ntoa (in));
-		new = awl_pool_alloc (nest, cur - hash->nests[nest] + sizeof (awl_item_t), hash);
-		if (new == NULL) {
-			A_UNLOCK (nest, hash);
-			return;
-		}
-		new->prev = cur;
-		cur->next = new;
-		new->next = NULL;
-		new->ip = ip;
-		new->hits = 1;
-		new->last = tm;
+		msg_info ("awl_add: insert ip %s in cache, normal insert", ipbuf);
+		new = AWL_ITEM (hash, nest, used);
+		hash->header->used[nest] ++;
 	}
 	else {
 		/* Not enough space in pool, replace latest used item */
-		msg_info ("awl_add: insert ip %s in cache, replace eldest item", inet_ntoa (in));
-		eldest->ip = ip;
-		eldest->hits = 1;
-		eldest->last = tm;
+		msg_info ("awl_add: insert ip %s in cache, replace eldest item", ipbuf);
+		new = eldest;
 	}
+	new->key = key;
+	new->hits = 1;
+	new->last = tm;
 
 	A_UNLOCK (nest, hash);
 }
 
+/*
+ * Flush awl to snapshot file, if wait is non-zero wait for the end of writing
+ */
+int
+awl_sync (awl_hash_t *hash, int wait)
+{
+	if (hash->fd == -1) {
+		return 0;
+	}
+	if (msync (hash->map, hash->maplen, wait ? MS_SYNC : MS_ASYNC) == -1) {
+		msg_warn ("awl_sync: msync failed: %m");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+awl_destroy (awl_hash_t *hash)
+{
+#ifdef _THREAD_SAFE
+	int i;
+
+	/* Locks of shared segment are left for other processes */
+	if (!hash->shared) {
+		for (i = 0; i < NEST_NUMBER; i++) {
+			pthread_mutex_destroy (&hash->own_locks[i]);
+		}
+	}
+#endif
+	munmap (hash->map, hash->maplen);
+	if (hash->fd != -1) {
+		close (hash->fd);
+	}
+	free (hash);
+}
+
 /*
  * vi:ts=4
  */
@@ -28,6 +28,7 @@
 #define AWL_H
 
 #include <sys/types.h>
+#include <sys/socket.h>
 
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -42,31 +43,78 @@
 
 #define NEST_NUMBER 2048 / sizeof (uintptr_t)
 
+#define AWL_MAGIC "rmawl"
+#define AWL_VERSION 4
+
+#define DEFAULT_AWL_IPV6_PREFIX 64
+
+/*
+ * Address key, ipv4 addresses are stored as ipv4 mapped ipv6 ones,
+ * ipv6 addresses are masked to the configured prefix
+ */
+typedef struct awl_key_s {
+	uint64_t hi;
+	uint64_t lo;
+} awl_key_t;
+
 typedef struct awl_item_s {
-	uint32_t ip;
+	awl_key_t key;
 	time_t last;
 	uint16_t hits;
-	struct awl_item_s *prev;
-	struct awl_item_s *next;
 } awl_item_t;
 
+/* Stored at the beginning of awl map, items follow it */
+typedef struct awl_header_s {
+	char magic[8];
+	uint32_t version;
+	uint32_t nests;
+	uint32_t item_size;
+	uint32_t header_size;
+	/* Set when shared segment is initialized */
+	volatile uint32_t ready;
+	uint64_t poolsize;
+	/* Keys of ipv6 addresses are made with this prefix */
+	uint32_t ipv6_prefix;
+	/* Number of used items in each nest */
+	uint32_t used[NEST_NUMBER];
+#ifdef _THREAD_SAFE
+	/* Locks of shared segment, they are not used in snapshot file */
+	pthread_mutex_t locks[NEST_NUMBER];
+#endif
+} awl_header_t;
+
 typedef struct awl_hash_s {
-	awl_item_t * nests[NEST_NUMBER];
+	awl_header_t *header;
 	u_char *pool;
 	size_t poolsize;
-	size_t free[NEST_NUMBER];
+	/* Number of items that fit in one nest */
+	size_t nest_items;
+	/* Whole mapped region */
+	void *map;
+	size_t maplen;
+	/* Descriptor of snapshot file or -1 */
+	int fd;
 	/* Number of hits to whitelist */
 	int white_hits;
 	/* Live time of record */
 	int ttl;
+	/* Prefix length that is used for ipv6 addresses */
+	int ipv6_prefix;
+	/* Map is a shared memory segment used by other processes */
+	int shared;
 #ifdef _THREAD_SAFE
-	pthread_mutex_t locks[NEST_NUMBER];
+	/* Locks of nests, in header of shared segment or own ones */
+	pthread_mutex_t *locks;
+	pthread_mutex_t own_locks[NEST_NUMBER];
 #endif
 } awl_hash_t;
 
-awl_hash_t * awl_init (size_t poolsize, int hits, int ttl);
-int awl_check (uint32_t ip, awl_hash_t *hash, time_t tm);
-void awl_add (uint32_t ip, awl_hash_t *hash, time_t tm);
+awl_hash_t * awl_init (size_t poolsize, int hits, int ttl, int ipv6_prefix,
+						const char *file, const char *shm_name);
+int awl_check (const struct sockaddr *addr, awl_hash_t *hash, time_t tm);
+void awl_add (const struct sockaddr *addr, awl_hash_t *hash, time_t tm);
+int awl_sync (awl_hash_t *hash, int wait);
+void awl_destroy (awl_hash_t *hash);
 
 #endif
 /*
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <libmilter/mfapi.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -44,6 +45,7 @@
 #include "cfg_file.h"
 #include "spf.h"
 #include "rmilter.h"
+#include "regexp.h"
 
 extern int yylineno;
 extern char *yytext;
@@ -340,6 +342,10 @@ add_spamd_server (struct config_file *cf, char *str, int is_extra)
 		srv->type = SPAMD_RSPAMD;
 		str += 2;
 	}
+	else if (*str == 'h' && *(str + 1) == ':') {
+		srv->type = SPAMD_RSPAMD_HTTP;
+		str += 2;
+	}
 	else {
 		srv->type = SPAMD_SPAMASSASSIN;
 	}
@@ -508,6 +514,9 @@ create_cond (enum condition_type type, const char *arg1, const char *arg2)
 	bzero (new, sizeof (struct condition));
 	
 	if (new == NULL) return NULL;
+	new->line = yylineno;
+	new->args[0].literal = -1;
+	new->args[1].literal = -1;
 
 	if (arg1 == NULL || *arg1 == '\0') {
 		new->args[0].empty = 1;
@@ -521,6 +530,9 @@ create_cond (enum condition_type type, const char *arg1, const char *arg2)
 			if (new->args[0].re == NULL) {
 				new->args[0].empty = 1;
 			}
+			else {
+				new->args[0].extra = regexp_study (new->args[0].re, type == COND_BODY);
+			}
 		}
 	}
 	if (arg2 == NULL || *arg2 == '\0') {
@@ -535,6 +547,9 @@ create_cond (enum condition_type type, const char *arg1, const char *arg2)
 			if (new->args[1].re == NULL) {
 				new->args[1].empty = 1;
 			}
+			else {
+				new->args[1].extra = regexp_study (new->args[1].re, 0);
+			}
 		}
 	}
 
@@ -559,44 +574,150 @@ add_spf_domain (struct config_file *cfg, char *domain)
 }
 
 int
-add_ip_radix (radix_tree_t *tree, char *ipnet)
+add_ip_radix (struct config_file *cfg, char *ipnet, unsigned char ip_class)
 {
-	uint32_t mask = 0xFFFFFFFF;
-	uint32_t ip;
 	char *token;
 	struct in_addr ina;
-	int k;
+	struct in6_addr ina6;
+	char ipbuf[INET6_ADDRSTRLEN];
+	int k, masklen, maxlen = 32, is_ipv6 = 0;
 
 	token = strsep (&ipnet, "/");
 
-	if (ipnet != NULL) {
-		k = atoi (ipnet);
-		if (k > 32 || k < 0) {
-			yywarn ("add_ip_radix: invalid netmask value: %d", k);
-			k = 32;
+	if (strchr (token, ':') != NULL) {
+		if (inet_pton (AF_INET6, token, &ina6) != 1) {
+			yyerror ("add_ip_radix: invalid ipv6 address: %s", token);
+			return 0;
 		}
-		k = 32 - k;
-		mask = mask << k;
+		is_ipv6 = 1;
+		maxlen = 128;
 	}
-
-	if (inet_aton (token, &ina) == 0) {
+	else if (inet_aton (token, &ina) == 0) {
 		yyerror ("add_ip_radix: invalid ip address: %s", token);
 		return 0;
 	}
 
-	ip = ntohl((uint32_t)ina.s_addr);
-	k = radix32tree_insert (tree, ip, mask, 1);
+	masklen = maxlen;
+	if (ipnet != NULL) {
+		masklen = atoi (ipnet);
+		if (masklen > maxlen || masklen < 0) {
+			yywarn ("add_ip_radix: invalid netmask value: %d", masklen);
+			masklen = maxlen;
+		}
+	}
+
+	/* Keys are in network order */
+	if (is_ipv6) {
+		k = radix_mb_add_mask (cfg->ip_classes6, ina6.s6_addr, masklen, ip_class);
+		inet_ntop (AF_INET6, &ina6, ipbuf, sizeof (ipbuf));
+	}
+	else {
+		k = radix_mb_add_mask (cfg->ip_classes, (const u_char *)&ina.s_addr, masklen, ip_class);
+		inet_ntop (AF_INET, &ina, ipbuf, sizeof (ipbuf));
+	}
 	if (k == -1) {
-		yyerror ("add_ip_radix: cannot insert ip to tree: %s, mask %X", inet_ntoa (ina), mask);
+		yyerror ("add_ip_radix: cannot insert ip to tree: %s/%d", ipbuf, masklen);
 		return 0;
 	}
 	else if (k == 1) {
-		yywarn ("add_ip_radix: ip %s, mask %X, value already exists", inet_ntoa (ina), mask);
+		yywarn ("add_ip_radix: ip %s/%d, value already exists", ipbuf, masklen);
 	}
 
 	return 1;
 }
 
+void
+add_ip_list (struct config_file *cfg, char *path, unsigned char ip_class)
+{
+	struct ip_list_file *new;
+
+	new = malloc (sizeof (struct ip_list_file));
+	if (new == NULL) {
+		yyerror ("add_ip_list: malloc failed");
+		return;
+	}
+	new->path = path;
+	new->ip_class = ip_class;
+	new->list = NULL;
+	LIST_INSERT_HEAD (&cfg->ip_lists, new, next);
+}
+
+/*
+ * Load lists of networks, lists that are not changed since previous config
+ * are taken from it without loading, as well as lists that cannot be loaded
+ */
+void
+load_ip_lists (struct config_file *cfg, struct config_file *old)
+{
+	struct ip_list_file *cur, *old_cur;
+	char err[BUFSIZ];
+
+	LIST_FOREACH (cur, &cfg->ip_lists, next) {
+		if (old != NULL) {
+			LIST_FOREACH (old_cur, &old->ip_lists, next) {
+				if (old_cur->list != NULL && strcmp (old_cur->path, cur->path) == 0 &&
+						!ip_list_changed (old_cur->list, cur->path)) {
+					cur->list = old_cur->list;
+					old_cur->list = NULL;
+					break;
+				}
+			}
+		}
+		if (cur->list == NULL) {
+			cur->list = ip_list_open (cur->path, err, sizeof (err));
+			if (cur->list == NULL) {
+				msg_err ("load_ip_lists: %s", err);
+				if (old == NULL) {
+					continue;
+				}
+				LIST_FOREACH (old_cur, &old->ip_lists, next) {
+					if (old_cur->list != NULL && strcmp (old_cur->path, cur->path) == 0) {
+						msg_warn ("load_ip_lists: keep previous version of %s", cur->path);
+						cur->list = old_cur->list;
+						old_cur->list = NULL;
+						break;
+					}
+				}
+			}
+			else {
+				msg_info ("load_ip_lists: loaded %u ranges from %s", cur->list->count, cur->path);
+			}
+		}
+	}
+}
+
+/* Get IP_CLASS_* flags for ipv4 address in host order */
+unsigned char
+get_ip_class (struct config_file *cfg, uint32_t ip)
+{
+	struct ip_list_file *cur;
+	unsigned char ip_class;
+
+	ip_class = radix32_mb_find_mask (cfg->ip_classes, ip);
+	LIST_FOREACH (cur, &cfg->ip_lists, next) {
+		if (cur->list != NULL && (ip_class & cur->ip_class) == 0 &&
+				ip_list_find (cur->list, ip)) {
+			ip_class |= cur->ip_class;
+		}
+	}
+
+	return ip_class;
+}
+
+/* Get IP_CLASS_* flags for ipv6 address, lists of files contain only ipv4 ranges */
+unsigned char
+get_ip_class6 (struct config_file *cfg, const struct in6_addr *ip6)
+{
+	uint32_t ip;
+
+	if (IN6_IS_ADDR_V4MAPPED (ip6)) {
+		memcpy (&ip, &ip6->s6_addr[12], sizeof (ip));
+		return get_ip_class (cfg, ntohl (ip));
+	}
+
+	return radix_mb_find_mask (cfg->ip_classes6, ip6->s6_addr);
+}
+
 static void
 add_hashed_header (const char *name, struct dkim_hash_entry **hash)
 {
@@ -614,14 +735,23 @@ init_defaults (struct config_file *cfg)
 	cfg->wlist_rcpt_global = NULL;
 	cfg->wlist_rcpt_limit = NULL;
 	LIST_INIT (&cfg->bounce_addrs);
+	LIST_INIT (&cfg->ip_lists);
 
 	cfg->clamav_connect_timeout = DEFAULT_CLAMAV_CONNECT_TIMEOUT;
 	cfg->clamav_port_timeout = DEFAULT_CLAMAV_PORT_TIMEOUT;
 	cfg->clamav_results_timeout = DEFAULT_CLAMAV_RESULTS_TIMEOUT;
+	cfg->clamav_retry_budget = DEFAULT_UPSTREAM_RETRY_BUDGET;
+	cfg->clamav_queue_timeout = DEFAULT_SCAN_QUEUE_TIMEOUT;
 	cfg->memcached_connect_timeout = DEFAULT_MEMCACHED_CONNECT_TIMEOUT;
 	cfg->beanstalk_connect_timeout = DEFAULT_MEMCACHED_CONNECT_TIMEOUT;
 	cfg->spamd_connect_timeout = DEFAULT_SPAMD_CONNECT_TIMEOUT;
 	cfg->spamd_results_timeout = DEFAULT_SPAMD_RESULTS_TIMEOUT;
+	cfg->spamd_retry_budget = DEFAULT_UPSTREAM_RETRY_BUDGET;
+	cfg->spamd_queue_timeout = DEFAULT_SCAN_QUEUE_TIMEOUT;
+	cfg->spamd_hedge_budget = DEFAULT_SPAMD_HEDGE_BUDGET;
+	cfg->verdict_cache_ttl = DEFAULT_VERDICT_TTL;
+	cfg->spamd_compress_level = DEFAULT_COMPRESS_LEVEL;
+	cfg->verdict_cache_key = DEFAULT_VERDICT_KEY;
 
 	cfg->clamav_error_time = DEFAULT_UPSTREAM_ERROR_TIME;
 	cfg->clamav_dead_time = DEFAULT_UPSTREAM_DEAD_TIME;
@@ -647,13 +777,14 @@ init_defaults (struct config_file *cfg)
 	cfg->copy_server = NULL;
 	cfg->spam_server = NULL;
 	
-	cfg->grey_whitelist_tree = radix_tree_create ();
-	cfg->limit_whitelist_tree = radix_tree_create ();
-	cfg->spamd_whitelist = radix_tree_create ();
+	cfg->ip_classes = radix_mb_tree_create (32);
+	cfg->ip_classes6 = radix_mb_tree_create (128);
 	cfg->greylisted_message = strdup (DEFAULT_GREYLISTED_MESSAGE);
 
 	cfg->spf_domains = (char **) calloc (MAX_SPF_DOMAINS, sizeof (char *));
 	cfg->awl_enable = 0;
+	cfg->awl_sync_interval = DEFAULT_AWL_SYNC_INTERVAL;
+	cfg->awl_ipv6_prefix = DEFAULT_AWL_IPV6_PREFIX;
 	cfg->beanstalk_copy_prob = 100.0;
 
 #if 0
@@ -705,7 +836,12 @@ free_config (struct config_file *cfg)
 	struct condition *cond, *tmp_cond;
 	struct addr_list_entry *addr_cur, *addr_tmp;
 	struct whitelisted_rcpt_entry *rcpt_cur, *rcpt_tmp;
+	struct ip_list_file *ip_list_cur;
+	struct header_bucket *hb_cur, *hb_tmp;
 
+	if (cfg->rules_profile_file) {
+		free (cfg->rules_profile_file);
+	}
 	if (cfg->pid_file) {
 		free (cfg->pid_file);
 	}
@@ -724,6 +860,7 @@ free_config (struct config_file *cfg)
 	}
 
 	if (cfg->special_mid_re) {
+		regexp_free_study (cfg->special_mid_extra);
 		pcre_free (cfg->special_mid_re);
 	}
 	
@@ -732,25 +869,41 @@ free_config (struct config_file *cfg)
 	}
 	for (i = 0; i < cfg->spamd_servers_num; i++) {
 		free (cfg->spamd_servers[i].name);
+		while (cfg->spamd_servers[i].idle_num > 0) {
+			close (cfg->spamd_servers[i].idle[--cfg->spamd_servers[i].idle_num]);
+		}
+	}
+	for (i = 0; i < cfg->extra_spamd_servers_num; i++) {
+		while (cfg->extra_spamd_servers[i].idle_num > 0) {
+			close (cfg->extra_spamd_servers[i].idle[--cfg->extra_spamd_servers[i].idle_num]);
+		}
 	}
 	/* Free rules list */
 	LIST_FOREACH_SAFE (cur, &cfg->rules, next, tmp_rule) {
 		LIST_FOREACH_SAFE (cond, cur->conditions, next, tmp_cond) {
 			if (!cond->args[0].empty) {
 				if (cond->args[0].re != NULL) {
+					regexp_free_study (cond->args[0].extra);
 					pcre_free (cond->args[0].re);
 				}
 				if (cond->args[0].src != NULL) {
 					free (cond->args[0].src);
 				}
+				if (cond->args[0].exact != NULL) {
+					free (cond->args[0].exact);
+				}
 			}
 			if (!cond->args[1].empty) {
 				if (cond->args[1].re != NULL) {
+					regexp_free_study (cond->args[1].extra);
 					pcre_free (cond->args[1].re);
 				}
 				if (cond->args[1].src != NULL) {
 					free (cond->args[1].src);
 				}
+				if (cond->args[1].exact != NULL) {
+					free (cond->args[1].exact);
+				}
 			}
 			LIST_REMOVE (cond, next);
 			free (cond);
@@ -781,14 +934,42 @@ free_config (struct config_file *cfg)
 		free (addr_cur);
 	}
 
-	radix_tree_free (cfg->grey_whitelist_tree);
-	free (cfg->grey_whitelist_tree);
-	
-	radix_tree_free (cfg->spamd_whitelist);
-	free (cfg->spamd_whitelist);
-
-	radix_tree_free (cfg->limit_whitelist_tree);
-	free (cfg->limit_whitelist_tree);
+	radix_mb_tree_free (cfg->ip_classes);
+	radix_mb_tree_free (cfg->ip_classes6);
+	HASH_ITER (hh, cfg->header_buckets, hb_cur, hb_tmp) {
+		HASH_DEL (cfg->header_buckets, hb_cur);
+		for (i = 0; i < hb_cur->len; i++) {
+			if (hb_cur->refs[i].exact) {
+				free (hb_cur->refs[i].exact);
+			}
+		}
+		free (hb_cur->refs);
+		free (hb_cur->name);
+		free (hb_cur);
+	}
+	if (cfg->header_generic) {
+		free (cfg->header_generic);
+	}
+	for (i = 0; i < COND_MAX; i++) {
+		if (cfg->rule_plan[i] != NULL) {
+			free (cfg->rule_plan[i]);
+		}
+		if (cfg->prefilters[i][0] != NULL) {
+			prefilter_free (cfg->prefilters[i][0]);
+		}
+		if (cfg->prefilters[i][1] != NULL) {
+			prefilter_free (cfg->prefilters[i][1]);
+		}
+	}
+	while (!LIST_EMPTY (&cfg->ip_lists)) {
+		ip_list_cur = LIST_FIRST (&cfg->ip_lists);
+		LIST_REMOVE (ip_list_cur, next);
+		if (ip_list_cur->list != NULL) {
+			ip_list_close (ip_list_cur->list);
+		}
+		free (ip_list_cur->path);
+		free (ip_list_cur);
+	}
 	
 	if (cfg->spamd_reject_message) {
 		free (cfg->spamd_reject_message);
@@ -819,8 +1000,22 @@ free_config (struct config_file *cfg)
 	}
 
 	if (cfg->awl_enable && cfg->awl_hash != NULL) {
-		free (cfg->awl_hash->pool);
-		free (cfg->awl_hash);
+		awl_destroy (cfg->awl_hash);
+	}
+	if (cfg->awl_file) {
+		free (cfg->awl_file);
+	}
+	if (cfg->awl_shm) {
+		free (cfg->awl_shm);
+	}
+	if (cfg->verdict_cache != NULL) {
+		verdict_destroy (cfg->verdict_cache);
+	}
+	if (cfg->clamav_sched != NULL) {
+		scan_sched_destroy (cfg->clamav_sched);
+	}
+	if (cfg->spamd_sched != NULL) {
+		scan_sched_destroy (cfg->spamd_sched);
 	}
 
 
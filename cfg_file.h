@@ -55,7 +55,12 @@
 #include "memcached.h"
 #include "beanstalk.h"
 #include "radix.h"
+#include "iplist.h"
 #include "awl.h"
+#include "verdict.h"
+#include "scheduler.h"
+#include "compress.h"
+#include "prefilter.h"
 
 #include "uthash/uthash.h"
 
@@ -69,6 +74,8 @@
 #define MAX_SPF_DOMAINS 1024
 #define MAX_CLAMAV_SERVERS 48
 #define MAX_SPAMD_SERVERS 48
+/* Idle keep-alive connections kept per rspamd HTTP server */
+#define MAX_SPAMD_IDLE 16
 #define MAX_MEMCACHED_SERVERS 48
 #define MAX_BEANSTALK_SERVERS 48
 #define DEFAULT_MEMCACHED_PORT 11211
@@ -83,6 +90,8 @@
 /* Spamd timeouts */
 #define DEFAULT_SPAMD_CONNECT_TIMEOUT 1000
 #define DEFAULT_SPAMD_RESULTS_TIMEOUT 20000
+/* Hedged spamd requests per second */
+#define DEFAULT_SPAMD_HEDGE_BUDGET 10
 #define DEFAULT_RSPAMD_METRIC "default"
 /* Memcached timeouts */
 #define DEFAULT_MEMCACHED_CONNECT_TIMEOUT 1000
@@ -90,6 +99,8 @@
 #define DEFAULT_UPSTREAM_ERROR_TIME 10
 #define DEFAULT_UPSTREAM_DEAD_TIME 300
 #define DEFAULT_UPSTREAM_MAXERRORS 10
+/* Time for all attempts to scan one message */
+#define DEFAULT_UPSTREAM_RETRY_BUDGET 30000
 
 #define MEMCACHED_SERVER_LIMITS 0
 #define MEMCACHED_SERVER_GREY 1
@@ -99,6 +110,13 @@
 #define DEFAUL_SPAMD_REJECT "Spam message rejected; If this is not spam contact abuse at rambler-co.ru"
 #define DEFAULT_GREYLISTED_MESSAGE "Try again later"
 #define DEFAULT_SPAM_HEADER "X-Spam"
+#define DEFAULT_AWL_SYNC_INTERVAL 60
+#define DEFAULT_RULES_PROFILE_FILE "/tmp/rmilter-rules.stat"
+
+/* Lists that client address may belong to */
+#define IP_CLASS_GREY_WHITELIST 0x1
+#define IP_CLASS_LIMIT_WHITELIST 0x2
+#define IP_CLASS_SPAMD_WHITELIST 0x4
 
 #define yyerror parse_err
 #define yywarn parse_warn
@@ -129,7 +147,8 @@ enum action_type {
 
 enum spamd_type {
 	SPAMD_SPAMASSASSIN = 0,
-	SPAMD_RSPAMD
+	SPAMD_RSPAMD,
+	SPAMD_RSPAMD_HTTP
 };
 
 typedef struct bucket_s {
@@ -148,8 +167,24 @@ struct condition {
     	int  empty;
     	int  not;
 	    pcre  *re;
+	    pcre_extra *extra;
+	    int literal;
+	    /* Pattern is ^literal$, compared without pcre */
+	    char *exact;
+	    size_t exact_len;
+	    int caseless;
+	    struct cond_stat {
+			uint64_t evals;
+			uint64_t matches;
+			uint64_t ticks;
+	    } stat;
     }	args[2];
 	enum condition_type type;
+	int line;
+	/* Argument checked first */
+	int first;
+	/* Body condition is checked against decoded text parts */
+	int decoded;
 	LIST_ENTRY (condition) next;
 };
 
@@ -160,6 +195,24 @@ struct rule {
 	LIST_ENTRY (rule) next;
 };
 
+/* Condition of rule, arrays of them are checked at each stage */
+struct rule_cond {
+	struct rule *rule;
+	struct condition *cond;
+};
+
+/* Header conditions with literal name pattern, keyed by lowercased name */
+struct header_bucket {
+	char *name;
+	struct header_ref {
+		unsigned int idx;				/* in rule_plan[COND_HEADER] */
+		char *exact;					/* name for case sensitive patterns */
+	} *refs;
+	unsigned int len;
+	unsigned int allocated;
+	UT_hash_handle hh;
+};
+
 struct clamav_server {
 	struct upstream up;
 	int sock_type;
@@ -190,6 +243,11 @@ struct spamd_server {
 	} sock;
 
 	char *name;
+	/* Keep-alive connections to rspamd HTTP server */
+	int idle[MAX_SPAMD_IDLE];
+	int idle_num;
+	/* Time when local rspamd could not read file passed by path */
+	time_t file_failed;
 };
 
 struct memcached_server {
@@ -246,6 +304,14 @@ struct whitelisted_rcpt_entry {
 	UT_hash_handle hh;
 };
 
+/* External list of networks for one of whitelists */
+struct ip_list_file {
+	char *path;
+	unsigned char ip_class;
+	struct ip_list *list;
+	LIST_ENTRY (ip_list_file) next;
+};
+
 struct config_file {
 	char *cfg_name;
 	char *pid_file;
@@ -262,6 +328,11 @@ struct config_file {
 	unsigned int clamav_connect_timeout;
 	unsigned int clamav_port_timeout;
 	unsigned int clamav_results_timeout;
+	unsigned int clamav_retry_budget;
+	/* Limit of scans in flight, 0 means no limit */
+	unsigned int clamav_max_scans;
+	unsigned int clamav_queue_timeout;
+	scan_sched_t *clamav_sched;
 
 	struct spamd_server spamd_servers[MAX_SPAMD_SERVERS];
 	size_t spamd_servers_num;
@@ -272,7 +343,28 @@ struct config_file {
 	unsigned int spamd_maxerrors;
 	unsigned int spamd_connect_timeout;
 	unsigned int spamd_results_timeout;
-	radix_tree_t *spamd_whitelist;
+	unsigned int spamd_retry_budget;
+	/* Limit of scans in flight, 0 means no limit */
+	unsigned int spamd_max_scans;
+	unsigned int spamd_queue_timeout;
+	scan_sched_t *spamd_sched;
+	/* Percentile of scan times after which hedged request is sent, 0 disables */
+	unsigned int spamd_hedge_percentile;
+	unsigned int spamd_hedge_budget;
+	/* Cache of scan results for duplicate messages, size 0 disables */
+	size_t verdict_cache_size;
+	unsigned int verdict_cache_ttl;
+	int verdict_cache_key;
+	verdict_cache_t *verdict_cache;
+	/* Share of messages scanned by extra servers in background, 0 means synchronous scan */
+	double spamd_shadow_ratio;
+	/* Messages larger than threshold are compressed for remote servers, 0 disables */
+	size_t spamd_compress_threshold;
+	int spamd_compress_level;
+	/* Only beginning of larger messages is sent to spamd, 0 disables */
+	size_t spamd_partial_size;
+	/* Path of file is passed to local rspamd instead of its content */
+	u_char spamd_pass_file;
 	char *spamd_reject_message;
 	char *rspamd_metric;
 	char *diff_dir;
@@ -286,6 +378,16 @@ struct config_file {
 	u_char extended_spam_headers;
 
 	pcre* special_mid_re;
+	pcre_extra* special_mid_extra;
+	struct rule_cond *rule_plan[COND_MAX];
+	unsigned int rule_plan_len[COND_MAX];
+	struct header_bucket *header_buckets;
+	/* Header conditions which name pattern is a real regexp */
+	unsigned int *header_generic;
+	unsigned int header_generic_len;
+	unsigned int body_decoded_num;
+	/* Literal scanners for each condition type and argument */
+	struct prefilter *prefilters[COND_MAX][2];
 
 	struct memcached_server memcached_servers_limits[MAX_MEMCACHED_SERVERS];
 	size_t memcached_servers_limits_num;
@@ -324,6 +426,11 @@ struct config_file {
 	size_t spf_domains_num;
 
 	char use_dcc;
+	/* Count time spent in each rule regexp, dumped on SIGUSR2 */
+	char rules_profile;
+	char *rules_profile_file;
+	/* Order arguments of conditions by counted cost and matches */
+	char rules_reorder;
 	char strict_auth;
 	char weighted_clamav;
 
@@ -345,14 +452,20 @@ struct config_file {
 	char *grey_prefix;
 	char *white_prefix;
 	char *greylisted_message;
-	radix_tree_t *grey_whitelist_tree;
-	radix_tree_t *limit_whitelist_tree;
+	/* Greylisting, limits and spamd whitelists of client addresses */
+	radix_mb_tree_t *ip_classes;
+	radix_mb_tree_t *ip_classes6;
+	LIST_HEAD (iplistset, ip_list_file) ip_lists;
 	/* Autowhitelist section */
 	u_char awl_enable;
 	awl_hash_t *awl_hash;
 	uint16_t awl_max_hits;
 	unsigned int awl_ttl;
 	size_t awl_pool_size;
+	char *awl_file;
+	char *awl_shm;
+	unsigned int awl_sync_interval;
+	int awl_ipv6_prefix;
 
 	/* DKIM section */
 	struct dkim_domain_entry *dkim_domains;
@@ -377,7 +490,11 @@ struct condition * create_cond (enum condition_type type, const char *arg1, cons
 int add_spf_domain (struct config_file *cfg, char *domain);
 void init_defaults (struct config_file *cfg);
 void free_config (struct config_file *cfg);
-int add_ip_radix (radix_tree_t *tree, char *ipnet);
+int add_ip_radix (struct config_file *cfg, char *ipnet, unsigned char ip_class);
+void add_ip_list (struct config_file *cfg, char *path, unsigned char ip_class);
+void load_ip_lists (struct config_file *cfg, struct config_file *old);
+unsigned char get_ip_class (struct config_file *cfg, uint32_t ip);
+unsigned char get_ip_class6 (struct config_file *cfg, const struct in6_addr *ip6);
 void add_rcpt_whitelist (struct config_file *cfg, const char *rcpt, int is_global);
 int is_whitelisted_rcpt (struct config_file *cfg, const char *str, int is_global);
 
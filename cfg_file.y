@@ -44,6 +44,7 @@
 
 #include "pcre.h"
 #include "cfg_file.h"
+#include "regexp.h"
 
 #define YYDEBUG 0
 
@@ -71,17 +72,19 @@ uint8_t cur_flags = 0;
 
 %token	ERROR STRING QUOTEDSTRING FLAG FLOAT
 %token	ACCEPT REJECTL TEMPFAIL DISCARD QUARANTINE
-%token	CONNECT HELO ENVFROM ENVRCPT HEADER MACRO BODY
+%token	CONNECT HELO ENVFROM ENVRCPT HEADER MACRO BODY BODY_DECODED RULES_PROFILE RULES_PROFILE_FILE RULES_REORDER
 %token	AND OR NOT
 %token  TEMPDIR LOGFILE PIDFILE RULE CLAMAV SERVERS ERROR_TIME DEAD_TIME MAXERRORS CONNECT_TIMEOUT PORT_TIMEOUT RESULTS_TIMEOUT SPF DCC
 %token  FILENAME REGEXP QUOTE SEMICOLON OBRACE EBRACE COMMA EQSIGN
 %token  BINDSOCK SOCKCRED DOMAIN IPADDR IPNETWORK HOSTPORT NUMBER GREYLISTING WHITELIST TIMEOUT EXPIRE EXPIRE_WHITE
-%token  MAXSIZE SIZELIMIT SECONDS BUCKET USEDCC MEMCACHED PROTOCOL AWL_ENABLE AWL_POOL AWL_TTL AWL_HITS SERVERS_WHITE SERVERS_LIMITS SERVERS_GREY
+%token  MAXSIZE SIZELIMIT SECONDS BUCKET USEDCC MEMCACHED PROTOCOL AWL_ENABLE AWL_POOL AWL_TTL AWL_HITS AWL_FILE AWL_SYNC_INTERVAL AWL_IPV6_PREFIX AWL_SHM WHITELIST_FILE LIMIT_WHITELIST_FILE SERVERS_WHITE SERVERS_LIMITS SERVERS_GREY
 %token  LIMITS LIMIT_TO LIMIT_TO_IP LIMIT_TO_IP_FROM LIMIT_WHITELIST LIMIT_WHITELIST_RCPT LIMIT_BOUNCE_ADDRS LIMIT_BOUNCE_TO LIMIT_BOUNCE_TO_IP
 %token  SPAMD REJECT_MESSAGE SERVERS_ID ID_PREFIX GREY_PREFIX WHITE_PREFIX RSPAMD_METRIC ALSO_CHECK DIFF_DIR CHECK_SYMBOLS SYMBOLS_DIR
 %token  BEANSTALK ID_REGEXP LIFETIME COPY_SERVER GREYLISTED_MESSAGE SPAMD_SOFT_FAIL
 %token  SEND_BEANSTALK_COPY SEND_BEANSTALK_HEADERS SEND_BEANSTALK_SPAM SPAM_SERVER STRICT_AUTH
 %token	TRACE_SYMBOL TRACE_ADDR WHITELIST_FROM SPAM_HEADER SPAMD_GREYLIST EXTENDED_SPAM_HEADERS
+%token	HEDGE_PERCENTILE HEDGE_BUDGET RETRY_BUDGET VERDICT_CACHE_SIZE VERDICT_CACHE_TTL VERDICT_CACHE_KEY SHADOW_RATIO
+%token	COMPRESS_THRESHOLD COMPRESS_LEVEL PARTIAL_SIZE PASS_FILE MAX_SCANS QUEUE_TIMEOUT
 %token  DKIM_SECTION DKIM_KEY DKIM_DOMAIN DKIM_SELECTOR DKIM_HEADER_CANON DKIM_BODY_CANON
 %token  DKIM_SIGN_ALG DKIM_RELAXED DKIM_SIMPLE DKIM_SHA1 DKIM_SHA256 COPY_PROBABILITY
 
@@ -119,6 +122,9 @@ command	:
 	| bindsock
 	| maxsize
 	| usedcc
+	| rulesprofile
+	| rulesprofilefile
+	| rulesreorder
 	| memcached
 	| beanstalk
 	| limits
@@ -315,6 +321,16 @@ term	:
 		cur_flags |= COND_BODY_FLAG;
 		free($2);
 	}
+	| BODY_DECODED REGEXP	{
+		$$ = create_cond(COND_BODY, $2, NULL);
+		if ($$ == NULL) {
+			yyerror ("yyparse: malloc: %s", strerror(errno));
+			YYERROR;
+		}
+		$$->decoded = 1;
+		cur_flags |= COND_BODY_FLAG;
+		free($2);
+	}
 	;
 
 clamav:
@@ -331,6 +347,9 @@ clamavcmd:
 	| clamav_connect_timeout
 	| clamav_port_timeout
 	| clamav_results_timeout
+	| clamav_retry_budget
+	| clamav_max_scans
+	| clamav_queue_timeout
 	| clamav_error_time
 	| clamav_dead_time
 	| clamav_maxerrors
@@ -401,6 +420,21 @@ clamav_results_timeout:
 		cfg->clamav_results_timeout = $3;
 	}
 	;
+clamav_retry_budget:
+	RETRY_BUDGET EQSIGN SECONDS {
+		cfg->clamav_retry_budget = $3;
+	}
+	;
+clamav_max_scans:
+	MAX_SCANS EQSIGN NUMBER {
+		cfg->clamav_max_scans = $3;
+	}
+	;
+clamav_queue_timeout:
+	QUEUE_TIMEOUT EQSIGN SECONDS {
+		cfg->clamav_queue_timeout = $3;
+	}
+	;
 
 spamd:
 	SPAMD OBRACE spamdbody EBRACE
@@ -415,11 +449,15 @@ spamdcmd:
 	spamd_servers
 	| spamd_connect_timeout
 	| spamd_results_timeout
+	| spamd_retry_budget
+	| spamd_max_scans
+	| spamd_queue_timeout
 	| spamd_error_time
 	| spamd_dead_time
 	| spamd_maxerrors
 	| spamd_reject_message
 	| spamd_whitelist
+	| spamd_whitelist_file
 	| extra_spamd_servers
 	| spamd_rspamd_metric
 	| diff_dir
@@ -431,6 +469,16 @@ spamdcmd:
 	| spamd_spam_header
 	| spamd_greylist
 	| extended_spam_headers
+	| spamd_hedge_percentile
+	| spamd_hedge_budget
+	| verdict_cache_size
+	| verdict_cache_ttl
+	| verdict_cache_key
+	| spamd_shadow_ratio
+	| spamd_compress_threshold
+	| spamd_compress_level
+	| spamd_partial_size
+	| spamd_pass_file
 	;
 
 diff_dir :
@@ -575,6 +623,21 @@ spamd_results_timeout:
 		cfg->spamd_results_timeout = $3;
 	}
 	;
+spamd_retry_budget:
+	RETRY_BUDGET EQSIGN SECONDS {
+		cfg->spamd_retry_budget = $3;
+	}
+	;
+spamd_max_scans:
+	MAX_SCANS EQSIGN NUMBER {
+		cfg->spamd_max_scans = $3;
+	}
+	;
+spamd_queue_timeout:
+	QUEUE_TIMEOUT EQSIGN SECONDS {
+		cfg->spamd_queue_timeout = $3;
+	}
+	;
 spamd_reject_message:
 	REJECT_MESSAGE EQSIGN QUOTEDSTRING {
 		size_t len = strlen ($3);
@@ -613,12 +676,18 @@ spamd_ip_list:
 
 spamd_ip:
 	ip_net {
-		if (add_ip_radix (cfg->spamd_whitelist, $1) == 0) {
+		if (add_ip_radix (cfg, $1, IP_CLASS_SPAMD_WHITELIST) == 0) {
 			YYERROR;
 		}
 	}
 	;
 
+spamd_whitelist_file:
+	WHITELIST_FILE EQSIGN FILENAME {
+		add_ip_list (cfg, $3, IP_CLASS_SPAMD_WHITELIST);
+	}
+	;
+
 spamd_rspamd_metric:
 	RSPAMD_METRIC EQSIGN QUOTEDSTRING {
 		size_t len = strlen ($3);
@@ -671,6 +740,113 @@ spamd_greylist:
 	}
 	;
 
+spamd_hedge_percentile:
+	HEDGE_PERCENTILE EQSIGN NUMBER {
+		if ($3 > 100) {
+			yyerror ("yyparse: hedge_percentile must be from 0 to 100");
+			YYERROR;
+		}
+		cfg->spamd_hedge_percentile = $3;
+	}
+	;
+
+spamd_hedge_budget:
+	HEDGE_BUDGET EQSIGN NUMBER {
+		cfg->spamd_hedge_budget = $3;
+	}
+	;
+
+spamd_shadow_ratio:
+	SHADOW_RATIO EQSIGN NUMBER {
+		if ($3 > 1) {
+			yyerror ("yyparse: shadow_ratio must be from 0 to 1");
+			YYERROR;
+		}
+		cfg->spamd_shadow_ratio = $3;
+	}
+	| SHADOW_RATIO EQSIGN FLOAT {
+		if ($3 > 1.0) {
+			yyerror ("yyparse: shadow_ratio must be from 0 to 1");
+			YYERROR;
+		}
+		cfg->spamd_shadow_ratio = $3;
+	}
+	;
+
+spamd_compress_threshold:
+	COMPRESS_THRESHOLD EQSIGN SIZELIMIT {
+		cfg->spamd_compress_threshold = $3;
+	}
+	| COMPRESS_THRESHOLD EQSIGN NUMBER {
+		cfg->spamd_compress_threshold = $3;
+	}
+	;
+
+spamd_compress_level:
+	COMPRESS_LEVEL EQSIGN NUMBER {
+		cfg->spamd_compress_level = $3;
+	}
+	;
+
+spamd_partial_size:
+	PARTIAL_SIZE EQSIGN SIZELIMIT {
+		cfg->spamd_partial_size = $3;
+	}
+	| PARTIAL_SIZE EQSIGN NUMBER {
+		cfg->spamd_partial_size = $3;
+	}
+	;
+
+spamd_pass_file:
+	PASS_FILE EQSIGN FLAG {
+		if ($3) {
+			cfg->spamd_pass_file = 1;
+		}
+	}
+	;
+
+verdict_cache_size:
+	VERDICT_CACHE_SIZE EQSIGN SIZELIMIT {
+		cfg->verdict_cache_size = $3;
+	}
+	| VERDICT_CACHE_SIZE EQSIGN NUMBER {
+		cfg->verdict_cache_size = $3;
+	}
+	;
+
+verdict_cache_ttl:
+	VERDICT_CACHE_TTL EQSIGN SECONDS {
+		/* Time is in seconds */
+		cfg->verdict_cache_ttl = $3 / 1000;
+	}
+	;
+
+verdict_cache_key:
+	VERDICT_CACHE_KEY EQSIGN QUOTEDSTRING {
+		size_t len = strlen ($3);
+		char *c = $3;
+		int flags;
+
+		/* Trim quotes */
+		if (*c == '"') {
+			c++;
+			len--;
+		}
+		if (c[len - 1] == '"') {
+			c[len - 1] = '\0';
+		}
+
+		if ((flags = verdict_parse_key (c)) == -1) {
+			yyerror ("yyparse: invalid verdict_cache_key: %s", c);
+			free ($3);
+			YYERROR;
+		}
+		cfg->verdict_cache_key = flags;
+
+		free ($3);
+	}
+	;
+
 spamd_spam_header:
 	SPAM_HEADER EQSIGN QUOTEDSTRING {
 		if ($3) {
@@ -807,6 +983,35 @@ usedcc:
 	}
 	;
 
+rulesprofile:
+	RULES_PROFILE EQSIGN FLAG {
+		if ($3 == -1) {
+			yyerror ("yyparse: parse flag");
+			YYERROR;
+		}
+		cfg->rules_profile = $3;
+	}
+	;
+
+rulesprofilefile:
+	RULES_PROFILE_FILE EQSIGN FILENAME {
+		if (cfg->rules_profile_file) {
+			free (cfg->rules_profile_file);
+		}
+		cfg->rules_profile_file = $3;
+	}
+	;
+
+rulesreorder:
+	RULES_REORDER EQSIGN FLAG {
+		if ($3 == -1) {
+			yyerror ("yyparse: parse flag");
+			YYERROR;
+		}
+		cfg->rules_reorder = $3;
+	}
+	;
+
 greylisting:
 	GREYLISTING OBRACE greylistingbody EBRACE
 	;
@@ -818,6 +1023,7 @@ greylistingbody:
 
 greylistingcmd:
 	greylisting_whitelist
+	| greylisting_whitelist_file
 	| greylisting_timeout
 	| greylisting_expire
 	| greylisting_whitelist_expire
@@ -826,6 +1032,10 @@ greylistingcmd:
 	| awl_hits
 	| awl_pool
 	| awl_ttl
+	| awl_file
+	| awl_sync_interval
+	| awl_ipv6_prefix
+	| awl_shm
 	;
 
 greylisting_timeout:
@@ -853,6 +1063,12 @@ greylisting_whitelist:
 	WHITELIST EQSIGN greylisting_ip_list
 	;
 
+greylisting_whitelist_file:
+	WHITELIST_FILE EQSIGN FILENAME {
+		add_ip_list (cfg, $3, IP_CLASS_GREY_WHITELIST);
+	}
+	;
+
 greylisting_ip_list:
 	greylisting_ip
 	| greylisting_ip_list COMMA greylisting_ip
@@ -860,7 +1076,7 @@ greylisting_ip_list:
 
 greylisting_ip:
 	ip_net {
-		if (add_ip_radix (cfg->grey_whitelist_tree, $1) == 0) {
+		if (add_ip_radix (cfg, $1, IP_CLASS_GREY_WHITELIST) == 0) {
 			YYERROR;
 		}
 	}
@@ -894,6 +1110,39 @@ awl_ttl:
 	}
 	;
 
+awl_file:
+	AWL_FILE EQSIGN FILENAME {
+		cfg->awl_file = $3;
+	}
+	;
+
+awl_shm:
+	AWL_SHM EQSIGN FILENAME {
+		if (*$3 != '/') {
+			yyerror ("yyparse: shared memory name must start with '/': %s", $3);
+			YYERROR;
+		}
+		cfg->awl_shm = $3;
+	}
+	;
+
+awl_sync_interval:
+	AWL_SYNC_INTERVAL EQSIGN SECONDS {
+		/* Time is in seconds */
+		cfg->awl_sync_interval = $3 / 1000;
+	}
+	;
+
+awl_ipv6_prefix:
+	AWL_IPV6_PREFIX EQSIGN NUMBER {
+		if ($3 <= 0 || $3 > 128) {
+			yyerror ("yyparse: invalid ipv6 prefix length %d", (int)$3);
+			YYERROR;
+		}
+		cfg->awl_ipv6_prefix = $3;
+	}
+	;
+
 greylisted_message:
 	GREYLISTED_MESSAGE EQSIGN QUOTEDSTRING {
 		size_t len = strlen ($3);
@@ -1300,6 +1549,7 @@ beanstalk_id_regexp:
 		}
 		
 		if (cfg->special_mid_re) {
+			regexp_free_study (cfg->special_mid_extra);
 			pcre_free (cfg->special_mid_re);
 		}
 		cfg->special_mid_re = pcre_compile (c, 0, &read_err, &offset, NULL);
@@ -1307,6 +1557,7 @@ beanstalk_id_regexp:
 			yyerror ("yyparse: pcre_compile failed: %s", read_err);
 			YYERROR;
 		}
+		cfg->special_mid_extra = regexp_study (cfg->special_mid_re, 0);
 
 		free ($3);
 	}
@@ -1370,6 +1621,7 @@ limitcmd:
 	| limit_to_ip
 	| limit_to_ip_from
 	| limit_whitelist
+	| limit_whitelist_file
 	| limit_whitelist_rcpt
 	| limit_bounce_addrs
 	| limit_bounce_to
@@ -1397,14 +1649,19 @@ limit_to_ip_from:
 limit_whitelist:
 	LIMIT_WHITELIST EQSIGN whitelist_ip_list
 	;
+limit_whitelist_file:
+	LIMIT_WHITELIST_FILE EQSIGN FILENAME {
+		add_ip_list (cfg, $3, IP_CLASS_LIMIT_WHITELIST);
+	}
+	;
 whitelist_ip_list:
 	ip_net {
-		if (add_ip_radix (cfg->limit_whitelist_tree, $1) == 0) {
+		if (add_ip_radix (cfg, $1, IP_CLASS_LIMIT_WHITELIST) == 0) {
 			YYERROR;
 		}
 	}
 	| whitelist_ip_list COMMA ip_net {
-		if (add_ip_radix (cfg->limit_whitelist_tree, $3) == 0) {
+		if (add_ip_radix (cfg, $3, IP_CLASS_LIMIT_WHITELIST) == 0) {
 			YYERROR;
 		}
 	}
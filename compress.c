@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+#include "rmilter.h"
+
+/* Size of chunks read from file */
+#define COMPRESS_CHUNK 65536
+/* Statistic is logged after this number of compressed messages */
+#define COMPRESS_STAT_EVERY 1000
+
+/* Statistic of all compressed messages */
+static unsigned long compress_count = 0;
+static unsigned long long compress_in = 0;
+static unsigned long long compress_out = 0;
+static unsigned long long compress_cpu = 0;
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static ssize_t
+compress_read (int fd, char *buf, size_t *total)
+{
+	ssize_t r;
+
+	while ((r = read (fd, buf, COMPRESS_CHUNK)) == -1 && errno == EINTR);
+	if (r > 0) {
+		*total += r;
+	}
+
+	return r;
+}
+#endif
+
+static long
+compress_cpu_time (void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+	}
+#endif
+	return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Stream in zlib format, that is expected by spamd for Compress: zlib */
+static int
+compress_zlib (int fd, int level, compress_out_t out, void *arg, char *buf, char *obuf,
+		struct compress_stat *st)
+{
+	z_stream zs;
+	ssize_t r;
+	size_t n;
+	int flush, ret;
+
+	bzero (&zs, sizeof (zs));
+	if (deflateInit (&zs, level) != Z_OK) {
+		return -1;
+	}
+	do {
+		if ((r = compress_read (fd, buf, &st->in)) == -1) {
+			deflateEnd (&zs);
+			return -1;
+		}
+		flush = r == 0 ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_in = (Bytef *)buf;
+		zs.avail_in = r;
+		do {
+			zs.next_out = (Bytef *)obuf;
+			zs.avail_out = COMPRESS_CHUNK;
+			ret = deflate (&zs, flush);
+			n = COMPRESS_CHUNK - zs.avail_out;
+			if (n > 0 && out (arg, obuf, n) == -1) {
+				deflateEnd (&zs);
+				return -1;
+			}
+			st->out += n;
+		} while (zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+	} while (flush != Z_FINISH);
+	deflateEnd (&zs);
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static int
+compress_zstd (int fd, int level, compress_out_t out, void *arg, char *buf, char *obuf,
+		struct compress_stat *st)
+{
+	ZSTD_CCtx *cctx;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer ob;
+	ZSTD_EndDirective mode;
+	size_t rem;
+	ssize_t r;
+
+	if ((cctx = ZSTD_createCCtx ()) == NULL) {
+		return -1;
+	}
+	ZSTD_CCtx_setParameter (cctx, ZSTD_c_compressionLevel, level);
+	do {
+		if ((r = compress_read (fd, buf, &st->in)) == -1) {
+			ZSTD_freeCCtx (cctx);
+			return -1;
+		}
+		mode = r == 0 ? ZSTD_e_end : ZSTD_e_continue;
+		in.src = buf;
+		in.size = r;
+		in.pos = 0;
+		do {
+			ob.dst = obuf;
+			ob.size = COMPRESS_CHUNK;
+			ob.pos = 0;
+			rem = ZSTD_compressStream2 (cctx, &ob, &in, mode);
+			if (ZSTD_isError (rem)) {
+				msg_warn ("compress_zstd: %s", ZSTD_getErrorName (rem));
+				ZSTD_freeCCtx (cctx);
+				return -1;
+			}
+			if (ob.pos > 0 && out (arg, obuf, ob.pos) == -1) {
+				ZSTD_freeCCtx (cctx);
+				return -1;
+			}
+			st->out += ob.pos;
+		} while (mode == ZSTD_e_end ? rem != 0 : in.pos < in.size);
+	} while (mode != ZSTD_e_end);
+	ZSTD_freeCCtx (cctx);
+
+	return 0;
+}
+#endif
+
+/* Returns 1 if rmilter is built with support of this compression */
+int
+compress_supported (enum compress_type type)
+{
+	switch (type) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Compress file from current position to its end by chunks, every chunk of
+ * compressed data is passed to out as soon as it is ready,
+ * returns -1 on error, if out fails or if compression is not supported
+ */
+int
+compress_stream (int fd, enum compress_type type, int level, compress_out_t out, void *arg,
+		struct compress_stat *st)
+{
+	char *buf;
+	long start;
+	unsigned long count;
+	int r = -1;
+
+	bzero (st, sizeof (struct compress_stat));
+	if (!compress_supported (type)) {
+		return -1;
+	}
+	/* Input and output chunks */
+	if ((buf = malloc (COMPRESS_CHUNK * 2)) == NULL) {
+		return -1;
+	}
+
+	start = compress_cpu_time ();
+	switch (type) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_ZLIB:
+		r = compress_zlib (fd, level, out, arg, buf, buf + COMPRESS_CHUNK, st);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		r = compress_zstd (fd, level, out, arg, buf, buf + COMPRESS_CHUNK, st);
+		break;
+#endif
+	default:
+		break;
+	}
+	st->cpu_us = compress_cpu_time () - start;
+	free (buf);
+	if (r == -1) {
+		return -1;
+	}
+
+	/* Log cpu time against bytes saved from time to time */
+	__sync_fetch_and_add (&compress_in, st->in);
+	__sync_fetch_and_add (&compress_out, st->out);
+	__sync_fetch_and_add (&compress_cpu, st->cpu_us);
+	count = __sync_add_and_fetch (&compress_count, 1);
+	if (count % COMPRESS_STAT_EVERY == 0) {
+		msg_info ("compress_stream: %lu messages, %llu bytes compressed to %llu bytes, %llu ms of cpu",
+				count, compress_in, compress_out, compress_cpu / 1000);
+	}
+
+	return 0;
+}
+
+/* Append compressed chunk to copy in memory, that cannot grow over its limit */
+static int
+compressed_append (void *arg, const char *data, size_t len)
+{
+	struct compressed *out = arg;
+	char *new;
+	size_t size;
+
+	if (len > out->limit - out->len) {
+		return -1;
+	}
+	if (out->size - out->len < len) {
+		size = out->size != 0 ? out->size * 2 : COMPRESS_CHUNK;
+		while (size - out->len < len) {
+			size *= 2;
+		}
+		if (size > out->limit) {
+			size = out->limit;
+		}
+		if ((new = realloc (out->data, size)) == NULL) {
+			return -1;
+		}
+		out->data = new;
+		out->size = size;
+	}
+	memcpy (out->data + out->len, data, len);
+	out->len += len;
+
+	return 0;
+}
+
+/*
+ * Compress file from current position to its end into memory,
+ * returns -1 on error or if compressed copy is larger than limit
+ */
+int
+compress_file (int fd, enum compress_type type, int level, size_t limit, struct compressed *out)
+{
+	bzero (out, sizeof (struct compressed));
+	out->limit = limit;
+	if (compress_stream (fd, type, level, compressed_append, out, &out->stat) == -1) {
+		compressed_free (out);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+compressed_free (struct compressed *out)
+{
+	if (out->data != NULL) {
+		free (out->data);
+	}
+	bzero (out, sizeof (struct compressed));
+}
+
+/*
+ * vi:ts=4
+ */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#define DEFAULT_COMPRESS_LEVEL 1
+/* Compressed copy that is kept in memory is not larger than this */
+#define COMPRESS_MAX_BUFFER (8 * 1024 * 1024)
+
+enum compress_type {
+	COMPRESS_ZLIB = 0,
+	COMPRESS_ZSTD
+};
+
+/* Sizes of data and cost of compression */
+struct compress_stat {
+	size_t in;
+	size_t out;
+	/* Cpu time used in microseconds */
+	long cpu_us;
+};
+
+/* Compressed copy of message for protocols that need its size before data */
+struct compressed {
+	char *data;
+	size_t len;
+	size_t size;
+	size_t limit;
+	struct compress_stat stat;
+};
+
+/* Consumer of compressed data, returns -1 to stop compression */
+typedef int (*compress_out_t) (void *arg, const char *data, size_t len);
+
+int compress_supported (enum compress_type type);
+int compress_stream (int fd, enum compress_type type, int level, compress_out_t out, void *arg,
+		struct compress_stat *st);
+int compress_file (int fd, enum compress_type type, int level, size_t limit, struct compressed *out);
+void compressed_free (struct compressed *out);
+
+#endif
+/*
+ * vi:ts=4
+ */
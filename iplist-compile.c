@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compile text list of networks to image that rmilter maps without parsing:
+ * rmilter-iplist <list> <image>
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "iplist.h"
+
+int 
+main (int argc, char **argv)
+{
+	struct ip_list *list;
+	char err[BUFSIZ];
+
+	if (argc != 3) {
+		printf ("Usage: rmilter-iplist <list> <image>\n");
+		return 1;
+	}
+
+	list = ip_list_open (argv[1], err, sizeof (err));
+	if (list == NULL) {
+		fprintf (stderr, "%s\n", err);
+		return 1;
+	}
+
+	if (ip_list_write_image (list, argv[2], err, sizeof (err)) == -1) {
+		fprintf (stderr, "%s\n", err);
+		ip_list_close (list);
+		return 1;
+	}
+
+	printf ("%s: %u ranges written to %s\n", argv[1], list->count, argv[2]);
+	ip_list_close (list);
+
+	return 0;
+}
+
+/* 
+ * vi:ts=4 
+ */
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iplist.h"
+
+static int
+ip_range_cmp (const void *a, const void *b)
+{
+	const struct ip_range *r1 = a, *r2 = b;
+
+	if (ntohl (r1->start) < ntohl (r2->start)) {
+		return -1;
+	}
+	else if (ntohl (r1->start) > ntohl (r2->start)) {
+		return 1;
+	}
+	return 0;
+}
+
+/* Sort ranges and merge overlapping and adjacent ones */
+static uint32_t
+ip_list_compact (struct ip_range *ranges, uint32_t count)
+{
+	uint32_t i, j = 0;
+
+	if (count == 0) {
+		return 0;
+	}
+	qsort (ranges, count, sizeof (struct ip_range), ip_range_cmp);
+
+	for (i = 1; i < count; i++) {
+		if (ntohl (ranges[j].end) == 0xffffffff ||
+				ntohl (ranges[i].start) <= ntohl (ranges[j].end) + 1) {
+			if (ntohl (ranges[i].end) > ntohl (ranges[j].end)) {
+				ranges[j].end = ranges[i].end;
+			}
+		}
+		else {
+			ranges[++j] = ranges[i];
+		}
+	}
+
+	return j + 1;
+}
+
+static int
+ip_list_parse_line (char *line, struct ip_range *range)
+{
+	char *p, *mask;
+	struct in_addr ina;
+	uint32_t ip, m = 0xffffffff;
+	int masklen;
+
+	/* Strip comments and spaces */
+	if ((p = strchr (line, '#')) != NULL) {
+		*p = '\0';
+	}
+	while (isspace ((u_char)*line)) {
+		line ++;
+	}
+	p = line + strlen (line);
+	while (p > line && isspace ((u_char)*(p - 1))) {
+		*--p = '\0';
+	}
+	if (*line == '\0') {
+		return 0;
+	}
+
+	if ((mask = strchr (line, '/')) != NULL) {
+		*mask++ = '\0';
+		masklen = strtol (mask, &p, 10);
+		if (*p != '\0' || masklen < 0 || masklen > 32) {
+			return -1;
+		}
+		m = masklen == 0 ? 0 : 0xffffffff << (32 - masklen);
+	}
+	if (inet_aton (line, &ina) == 0) {
+		return -1;
+	}
+
+	ip = ntohl (ina.s_addr) & m;
+	range->start = htonl (ip);
+	range->end = htonl (ip | ~m);
+
+	return 1;
+}
+
+static struct ip_list *
+ip_list_load_text (int fd, const char *path, char *err, size_t errlen)
+{
+	struct ip_list *list;
+	struct ip_range *new;
+	uint32_t allocated = 1024, lineno = 0;
+	char buf[BUFSIZ];
+	FILE *f;
+	int r;
+
+	if ((f = fdopen (dup (fd), "r")) == NULL) {
+		snprintf (err, errlen, "cannot open %s: %s", path, strerror (errno));
+		return NULL;
+	}
+	list = calloc (1, sizeof (struct ip_list));
+	if (list == NULL || (list->ranges = malloc (allocated * sizeof (struct ip_range))) == NULL) {
+		snprintf (err, errlen, "cannot allocate memory for %s", path);
+		free (list);
+		fclose (f);
+		return NULL;
+	}
+
+	while (fgets (buf, sizeof (buf), f) != NULL) {
+		lineno ++;
+		if (list->count == allocated) {
+			new = realloc (list->ranges, allocated * 2 * sizeof (struct ip_range));
+			if (new == NULL) {
+				snprintf (err, errlen, "cannot allocate memory for %s", path);
+				ip_list_close (list);
+				fclose (f);
+				return NULL;
+			}
+			list->ranges = new;
+			allocated *= 2;
+		}
+		r = ip_list_parse_line (buf, &list->ranges[list->count]);
+		if (r == -1) {
+			snprintf (err, errlen, "%s:%u: invalid network", path, lineno);
+			ip_list_close (list);
+			fclose (f);
+			return NULL;
+		}
+		list->count += r;
+	}
+	fclose (f);
+
+	list->count = ip_list_compact (list->ranges, list->count);
+
+	return list;
+}
+
+static struct ip_list *
+ip_list_load_image (int fd, const char *path, size_t len, char *err, size_t errlen)
+{
+	struct ip_list *list;
+	struct ip_list_header *header;
+	void *map;
+
+	map = mmap (NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		snprintf (err, errlen, "cannot mmap %s: %s", path, strerror (errno));
+		return NULL;
+	}
+	header = map;
+	if (header->version != IP_LIST_VERSION ||
+			len != sizeof (struct ip_list_header) + (size_t)header->count * sizeof (struct ip_range)) {
+		snprintf (err, errlen, "%s is broken or made by other version of rmilter-iplist", path);
+		munmap (map, len);
+		return NULL;
+	}
+	list = calloc (1, sizeof (struct ip_list));
+	if (list == NULL) {
+		snprintf (err, errlen, "cannot allocate memory for %s", path);
+		munmap (map, len);
+		return NULL;
+	}
+	list->map = map;
+	list->maplen = len;
+	list->ranges = (struct ip_range *)(header + 1);
+	list->count = header->count;
+
+	return list;
+}
+
+/* Load text list or map image, returns NULL and fills err on error */
+struct ip_list *
+ip_list_open (const char *path, char *err, size_t errlen)
+{
+	struct ip_list *list;
+	struct ip_list_header header;
+	struct stat st;
+	int fd;
+
+	if ((fd = open (path, O_RDONLY)) == -1 || fstat (fd, &st) == -1) {
+		snprintf (err, errlen, "cannot open %s: %s", path, strerror (errno));
+		if (fd != -1) {
+			close (fd);
+		}
+		return NULL;
+	}
+
+	if ((size_t)st.st_size >= sizeof (header) &&
+			read (fd, &header, sizeof (header)) == sizeof (header) &&
+			memcmp (header.magic, IP_LIST_MAGIC, sizeof (IP_LIST_MAGIC)) == 0) {
+		list = ip_list_load_image (fd, path, st.st_size, err, errlen);
+	}
+	else {
+		lseek (fd, 0, SEEK_SET);
+		list = ip_list_load_text (fd, path, err, errlen);
+	}
+	close (fd);
+
+	if (list != NULL) {
+		list->dev = st.st_dev;
+		list->ino = st.st_ino;
+		list->mtime = st.st_mtime;
+		list->size = st.st_size;
+	}
+
+	return list;
+}
+
+int
+ip_list_changed (struct ip_list *list, const char *path)
+{
+	struct stat st;
+
+	if (stat (path, &st) == -1) {
+		return 1;
+	}
+
+	return st.st_dev != list->dev || st.st_ino != list->ino ||
+			st.st_mtime != list->mtime || st.st_size != list->size;
+}
+
+/* Ip is in host order */
+int
+ip_list_find (struct ip_list *list, uint32_t ip)
+{
+	uint32_t lo = 0, hi = list->count, mid;
+
+	/* Find the last range that starts not after ip */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ntohl (list->ranges[mid].start) <= ip) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return lo > 0 && ip <= ntohl (list->ranges[lo - 1].end);
+}
+
+/* Write image to temporary file and rename it, so processes that map old image are not affected */
+int
+ip_list_write_image (struct ip_list *list, const char *path, char *err, size_t errlen)
+{
+	struct ip_list_header header;
+	char tmp[MAXPATHLEN];
+	FILE *f;
+	int fd;
+
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp (tmp)) == -1 || (f = fdopen (fd, "w")) == NULL) {
+		snprintf (err, errlen, "cannot create %s: %s", tmp, strerror (errno));
+		if (fd != -1) {
+			close (fd);
+			unlink (tmp);
+		}
+		return -1;
+	}
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, IP_LIST_MAGIC, sizeof (IP_LIST_MAGIC));
+	header.version = IP_LIST_VERSION;
+	header.count = list->count;
+
+	if (fwrite (&header, sizeof (header), 1, f) != 1 ||
+			fwrite (list->ranges, sizeof (struct ip_range), list->count, f) != list->count ||
+			fchmod (fd, 0644) == -1 || fclose (f) != 0) {
+		snprintf (err, errlen, "cannot write %s: %s", tmp, strerror (errno));
+		unlink (tmp);
+		return -1;
+	}
+	if (rename (tmp, path) == -1) {
+		snprintf (err, errlen, "cannot rename %s to %s: %s", tmp, path, strerror (errno));
+		unlink (tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+ip_list_close (struct ip_list *list)
+{
+	if (list->map != NULL) {
+		munmap (list->map, list->maplen);
+	}
+	else {
+		free (list->ranges);
+	}
+	free (list);
+}
+
+/* 
+ * vi:ts=4 
+ */
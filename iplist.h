@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef IPLIST_H
+#define IPLIST_H
+
+#include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+/*
+ * Lists of ipv4 networks loaded from files. A file is either a text list
+ * (one address or network per line, '#' starts comment) or an image made
+ * by rmilter-iplist: header followed by sorted non overlapping ranges in
+ * network byte order, that is mapped as is.
+ */
+#define IP_LIST_MAGIC "rmiplst"
+#define IP_LIST_VERSION 1
+
+struct ip_range {
+	uint32_t start;
+	uint32_t end;
+};
+
+struct ip_list_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct ip_list {
+	struct ip_range *ranges;
+	uint32_t count;
+	/* Mapped image or NULL if ranges are malloc'ed */
+	void *map;
+	size_t maplen;
+	/* To find out whether file is changed */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+};
+
+struct ip_list *ip_list_open (const char *path, char *err, size_t errlen);
+int ip_list_changed (struct ip_list *list, const char *path);
+int ip_list_find (struct ip_list *list, uint32_t ip);
+int ip_list_write_image (struct ip_list *list, const char *path, char *err, size_t errlen);
+void ip_list_close (struct ip_list *list);
+
+#endif
+/* 
+ * vi:ts=4 
+ */
@@ -411,11 +411,12 @@ clamscan_socket(const char *file, const struct clamav_server *srv, char *strres,
 int 
 clamscan(const char *file, struct config_file *cfg, char *strres, size_t strres_len)
 {
-    int retry = 5, r = -2;
+    int r = -2;
     /* struct stat sb; */
     struct timeval t;
     double ts, tf;
-    struct clamav_server *selected = NULL;
+    struct clamav_server *selected = NULL, *next;
+    struct upstream_retry rt;
 
     *strres = '\0';
     /*
@@ -428,6 +429,7 @@ clamscan(const char *file, struct config_file *cfg, char *strres, size_t strres_
      */
     gettimeofday(&t, NULL);
     ts = t.tv_sec + t.tv_usec / 1000000.0;
+    upstream_retry_init (&rt, cfg->clamav_retry_budget);
 
     /* try to scan with available servers */
     while (1) {
@@ -447,6 +449,19 @@ clamscan(const char *file, struct config_file *cfg, char *strres, size_t strres_
 			msg_err ("clamscan: upstream get error, %s", file);
 			return -1;
 		}
+		/* Fail over to server that was not tried yet */
+		next = (struct clamav_server *) upstream_retry_select (&rt, &selected->up, (void *)cfg->clamav_servers,
+				cfg->clamav_servers_num, sizeof (struct clamav_server));
+		if (next == NULL) {
+			if (upstream_retry_backoff (&rt) == -1) {
+				msg_warn("clamscan: retry budget exceeded after %u attempts, %u of %u ms, %s",
+						rt.attempts, upstream_retry_elapsed (&rt), rt.budget, file);
+				break;
+			}
+			gettimeofday(&t, NULL);
+			continue;
+		}
+		selected = next;
 
 		r = clamscan_socket (file, selected, strres, strres_len, cfg);
 		if (r == 0) {
@@ -458,12 +473,12 @@ clamscan(const char *file, struct config_file *cfg, char *strres, size_t strres_
 	    	msg_warn("clamscan: unexpected problem, %s, %s", selected->name, file);
 	    	break;
 		}
-		if (--retry < 1) {
-	    	msg_warn("clamscan: retry limit exceeded, %s, %s", selected->name, file);
+		if (upstream_retry_elapsed (&rt) >= rt.budget) {
+	    	msg_warn("clamscan: retry budget exceeded after %u attempts, %u of %u ms, %s, %s",
+	    			rt.attempts, upstream_retry_elapsed (&rt), rt.budget, selected->name, file);
 	    	break;
 		}
 		msg_warn("clamscan: failed to scan, retry, %s, %s", selected->name, file);
-		sleep(1);
     }
 
     /*
@@ -472,6 +487,10 @@ clamscan(const char *file, struct config_file *cfg, char *strres, size_t strres_
     gettimeofday(&t, NULL);
     tf = t.tv_sec + t.tv_usec / 1000000.0;
 
+    if (rt.attempts > 1 && r == 0) {
+		msg_info("clamscan: %u attempts used %u of %u ms retry budget, %s",
+				rt.attempts, upstream_retry_elapsed (&rt), rt.budget, file);
+	}
     if (*strres) {
 		msg_info("clamscan: scan %f, %s, found %s, %s", tf - ts,
 					selected->name, 
@@ -39,6 +39,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <ctype.h>
 #include <sysexits.h>
 #include <unistd.h>
@@ -60,6 +61,7 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "libspamd.h"
+#include "compress.h"
 
 /* Maximum time in seconds during which spamd server is marked inactive after scan error */
 #define INACTIVE_INTERVAL 60.0
@@ -67,12 +69,25 @@
 #define MAX_FAILED 5
 /* Maximum inactive timeout (20 min) */
 #define MAX_TIMEOUT 1200.0
+/* Histogram of scan times used for hedged requests */
+#define HEDGE_BUCKET_MS 5
+#define HEDGE_BUCKETS 2048
+/* Minimum number of scans before hedging starts */
+#define HEDGE_MIN_SCANS 100
+/* Histogram is halved after this number of scans */
+#define HEDGE_WINDOW 10000
+/* Maximum size of headers of message that is scanned partially */
+#define SPAMD_PARTIAL_HEADERS 65536
+/* Seconds during which content is sent to local rspamd that failed to read file */
+#define SPAMD_FILE_RETRY 300
 
 
 /* Global mutexes */
 
 #ifdef _THREAD_SAFE
 pthread_mutex_t mx_spamd_write = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mx_spamd_idle = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t mx_spamd_hedge = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 
@@ -142,6 +157,70 @@ connect_t(int s, const struct sockaddr *name, socklen_t namelen, int timeout)
 	return r;
 }
 
+/*
+ * Connection of a scan that may be cancelled by another thread: socket is
+ * registered while it is open, so canceller can shut it down without
+ * touching descriptor that is already closed and probably reused
+ */
+
+struct spamd_conn {
+	pthread_mutex_t *mtx;
+	int sock;
+	int cancelled;
+};
+
+/*
+ * spamd_conn_set() - register opened socket, returns -1 if scan is cancelled
+ */
+
+static int
+spamd_conn_set(struct spamd_conn *conn, int s)
+{
+	int r = 0;
+
+	if (conn == NULL)
+		return 0;
+
+	pthread_mutex_lock(conn->mtx);
+	if (conn->cancelled) {
+		r = -1;
+	}
+	else {
+		conn->sock = s;
+	}
+	pthread_mutex_unlock(conn->mtx);
+
+	return r;
+}
+
+/*
+ * spamd_close() - unregister and close socket
+ */
+
+static void
+spamd_close(struct spamd_conn *conn, int s)
+{
+	if (conn != NULL) {
+		pthread_mutex_lock(conn->mtx);
+		conn->sock = -1;
+		pthread_mutex_unlock(conn->mtx);
+	}
+	close(s);
+}
+
+/*
+ * spamd_conn_cancel() - abort scan, called with conn mutex locked
+ */
+
+static void
+spamd_conn_cancel(struct spamd_conn *conn)
+{
+	conn->cancelled = 1;
+	if (conn->sock != -1) {
+		shutdown(conn->sock, SHUT_RDWR);
+	}
+}
+
 /*
  * rspamdscan_socket() - send file to specified host. See spamdscan() for
  * load-balanced wrapper.
@@ -152,19 +231,15 @@ connect_t(int s, const struct sockaddr *name, socklen_t namelen, int timeout)
  */
 
 static int 
-rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_server *srv,
-		struct config_file *cfg, rspamd_result_t *res, char **mid)
+rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const char *file, const struct spamd_server *srv,
+		struct config_file *cfg, struct rspamd_reply *reply, struct spamd_conn *conn, int by_file)
 {
 	char buf[16384];
-	char *c, *p, *err_str;
 	struct sockaddr_un server_un;
 	struct sockaddr_in server_in;
-	int s, r, fd, ofl, size = 0, to_write, written, state, next_state, toklen;
-	int remain;
+	int s, r, fd, ofl, to_write, written;
 	struct stat sb;
-	struct rspamd_metric_result *cur = NULL;
 	struct rcpt *rcpt;
-	struct rspamd_symbol *cur_symbol;
 
 	/* somebody doesn't need reply... */
 	if (!srv)
@@ -203,17 +278,21 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 			return -1;
 		}
 	}
+	if (spamd_conn_set(conn, s) == -1) {
+		close(s);
+		return -1;
+	}
 	/* Get file size */
-	fd = open(priv->file, O_RDONLY);
+	fd = open(file, O_RDONLY);
 	if (fstat (fd, &sb) == -1) {
 		msg_warn ("rspamd: stat failed: %m");
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	
 	if (poll_fd(s, cfg->spamd_connect_timeout, POLLOUT) < 1) {
 		msg_warn ("rspamd: timeout waiting writing, %s", srv->name);
-		close (s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	/* Set blocking again */
@@ -222,11 +301,17 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 	
 	r = 0;
 	to_write = sizeof (buf) - r;
-	written = snprintf (buf + r, to_write, "SYMBOLS RSPAMC/1.2\r\nContent-length: %ld\r\n", (long int)sb.st_size);
+	if (by_file) {
+		/* Local rspamd reads file itself */
+		written = snprintf (buf + r, to_write, "SYMBOLS RSPAMC/1.2\r\nContent-length: 0\r\nFile: %s\r\n", file);
+	}
+	else {
+		written = snprintf (buf + r, to_write, "SYMBOLS RSPAMC/1.2\r\nContent-length: %ld\r\n", (long int)sb.st_size);
+	}
 	if (written > to_write) {
 		msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 		close(fd);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	r += written;
@@ -237,7 +322,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 		if (written > to_write) {
 			msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 			close(fd);
-			close(s);
+			spamd_close(conn, s);
 			return -1;
 		}
 		r += written;
@@ -249,7 +334,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 		if (written > to_write) {
 			msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 			close(fd);
-			close(s);
+			spamd_close(conn, s);
 			return -1;
 		}
 		r += written;
@@ -260,7 +345,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 		if (written > to_write) {
 			msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 			close(fd);
-			close(s);
+			spamd_close(conn, s);
 			return -1;
 		}
 		r += written;
@@ -271,7 +356,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 		if (written > to_write) {
 			msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 			close(fd);
-			close(s);
+			spamd_close(conn, s);
 			return -1;
 		}
 		r += written;
@@ -282,7 +367,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 		if (written > to_write) {
 			msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 			close(fd);
-			close(s);
+			spamd_close(conn, s);
 			return -1;
 		}
 		r += written;
@@ -292,7 +377,7 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 	if (written > to_write) {
 		msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
 		close(fd);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	r += written;
@@ -302,30 +387,32 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 	if (write (s, buf, r) == -1) {
 		msg_warn("rspamd: write (%s), %d: %m", srv->name, errno);
 		close(fd);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 
+	if (!by_file) {
 #if defined(FREEBSD) || defined(HAVE_SENDFILE)
-	if (sendfile(fd, s, 0, 0, 0, 0, 0) != 0) {
-		msg_warn("rspamd: sendfile (%s), %d: %m", srv->name, errno);
-		close(fd);
-		close(s);
-		return -1;
-	}
+		if (sendfile(fd, s, 0, 0, 0, 0, 0) != 0) {
+			msg_warn("rspamd: sendfile (%s), %d: %m", srv->name, errno);
+			close(fd);
+			spamd_close(conn, s);
+			return -1;
+		}
 #elif defined(LINUX)
-	off_t off = 0;
-	if (sendfile(s, fd, &off, sb.st_size) == -1) {
-		msg_warn("rspamd: sendfile (%s), %d: %m", srv->name, errno);
-		close(fd);
-		close(s);
-		return -1;		
-	}
+		off_t off = 0;
+		if (sendfile(s, fd, &off, sb.st_size) == -1) {
+			msg_warn("rspamd: sendfile (%s), %d: %m", srv->name, errno);
+			close(fd);
+			spamd_close(conn, s);
+			return -1;		
+		}
 #else 
-	while ((r = read (fd, buf, sizeof (buf))) > 0) {
-		write (s, buf, r);
-	}
+		while ((r = read (fd, buf, sizeof (buf))) > 0) {
+			write (s, buf, r);
+		}
 #endif
+	}
 
 	fcntl(s, F_SETFL, ofl);
 	close(fd);
@@ -334,306 +421,444 @@ rspamdscan_socket(SMFICTX *ctx, struct mlfi_priv *priv, const struct spamd_serve
 
 	if (poll_fd(s, cfg->spamd_results_timeout, POLLIN) < 1) {
 		msg_warn("rspamd: timeout waiting results %s", srv->name);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	
 	/*
-	 * read results
+	 * read results, reply is parsed as it arrives
 	 */
 
-	buf[0] = 0;
-	size = 0;
-	
-	/* XXX: in fact here should be some FSM to parse reply and this one just skip long replies */
-	while ((r = read(s, buf + size, sizeof (buf) - size - 1)) > 0 && size < sizeof (buf) - 1) {
-		size += r;
+	while ((r = read(s, buf, sizeof (buf))) > 0) {
+		if (rspamd_reply_feed (reply, buf, r) == -1) {
+			break;
+		}
 	}
 
 	if (r < 0) {
 		msg_warn("rspamd: read, %s, %d: %m", srv->name, errno);
+		spamd_close(conn, s);
+		return -1;
+	}
+	spamd_close(conn, s);
+
+	if (rspamd_reply_end (reply) == -1) {
+		msg_warn ("rspamd: invalid reply from server %s: %s", srv->name, reply->err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * spamd_idle_get() - get keep-alive connection to server, connections that
+ * became readable are closed by server or broken and are dropped
+ */
+
+static int
+spamd_idle_get(struct spamd_server *srv)
+{
+	int s = -1;
+
+#ifdef _THREAD_SAFE
+	pthread_mutex_lock(&mx_spamd_idle);
+#endif
+	while (srv->idle_num > 0) {
+		s = srv->idle[--srv->idle_num];
+		if (poll_fd(s, 0, POLLIN) == 0) {
+			break;
+		}
+		close(s);
+		s = -1;
+	}
+#ifdef _THREAD_SAFE
+	pthread_mutex_unlock(&mx_spamd_idle);
+#endif
+
+	return s;
+}
+
+/*
+ * spamd_idle_put() - return connection to keep-alive pool or close it if
+ * pool is full
+ */
+
+static void
+spamd_idle_put(struct spamd_server *srv, int s)
+{
+#ifdef _THREAD_SAFE
+	pthread_mutex_lock(&mx_spamd_idle);
+#endif
+	if (srv->idle_num < MAX_SPAMD_IDLE) {
+		srv->idle[srv->idle_num++] = s;
+		s = -1;
+	}
+#ifdef _THREAD_SAFE
+	pthread_mutex_unlock(&mx_spamd_idle);
+#endif
+	if (s != -1) {
 		close(s);
+	}
+}
+
+/*
+ * spamd_connect() - open new connection to server
+ */
+
+static int
+spamd_connect(const struct spamd_server *srv, struct config_file *cfg)
+{
+	struct sockaddr_un server_un;
+	struct sockaddr_in server_in;
+	int s;
+
+	if (srv->sock_type == AF_LOCAL) {
+		memset(&server_un, 0, sizeof(server_un));
+		server_un.sun_family = AF_UNIX;
+		strncpy(server_un.sun_path, srv->sock.unix_path, sizeof(server_un.sun_path));
+
+		if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			msg_warn("rspamd: socket %s, %d: %m", srv->sock.unix_path, errno);
+			return -1;
+		}
+		if (connect_t(s, (struct sockaddr *) & server_un, sizeof(server_un), cfg->spamd_connect_timeout) < 0) {
+			msg_warn("rspamd: connect %s, %d: %m", srv->sock.unix_path, errno);
+			close(s);
+			return -1;
+		}
+	} else {
+		memset(&server_in, 0, sizeof(server_in));
+		server_in.sin_family = AF_INET;
+		server_in.sin_port = srv->sock.inet.port;
+		memcpy((char *)&server_in.sin_addr, &srv->sock.inet.addr, sizeof(struct in_addr));
+
+		if ((s = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+			msg_warn("rspamd: socket %d: %m",  errno);
+			return -1;
+		}
+		if (connect_t(s, (struct sockaddr *) & server_in, sizeof(server_in), cfg->spamd_connect_timeout) < 0) {
+			msg_warn("rspamd: connect %s, %d: %m", srv->name, errno);
+			close(s);
+			return -1;
+		}
+	}
+
+	return s;
+}
+
+/*
+ * http_header() - append formatted header to request buffer, returns -1 if
+ * buffer is too small
+ */
+
+static int
+http_header(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if (r < 0 || (size_t)r >= size - *len) {
 		return -1;
 	}
-	buf[size] = '\0';
-	close(s);
+	*len += r;
 
-#define TEST_WORD(x)																\
-do {																				\
-	if (remain < sizeof ((x)) - 1 || memcmp (p, (x), sizeof ((x)) - 1) != 0) {		\
-		msg_warn ("invalid reply from server %s at state %d, expected: %s, got %*s", srv->name, state, ((x)), (int)sizeof((x)), p);				\
-		return -1;																	\
-	}																				\
-	p += sizeof((x)) - 1;															\
-	remain -= sizeof((x)) - 1;														\
-} while (0)
-
-
-	c = buf;
-	p = buf;
-	remain = size - 1;
-	state = 0;
-	next_state = 100;
-
-	while (remain > 0) {
-		switch (state) {
-			case 0:
-				/*
-				 * Expect first reply line:
-				 * RSPAMD/{VERSION} {ERROR_CODE} {DESCR} CRLF
-				 */
-				TEST_WORD("RSPAMD/");
-				if ((c = strchr (p, ' ')) == NULL) {
-					msg_warn ("invalid reply from server %s on state %d", srv->name, state);
-					return -1;
-				}
-				/* Well now in c we have space symbol, skip all */
-				while (remain > 0 && isspace (*c)) {
-					c ++;
-				}
-				/* Now check code */
-				if (*c != '0') {
-					msg_warn ("invalid reply from server %s on state %d, code: %c", srv->name, state, *c);
-					return -1;
-				}
-				/* Now skip everything till \n */
-				if ((c = strchr (c, '\n')) == NULL) {
-					msg_warn ("invalid reply from server %s on state %d", srv->name, state);
-					return -1;
-				}
-				c ++;
-				remain -= c - p;
-				p = c;
-				next_state = 2;
-				state = 99;
-				break;
-			case 2:
-				/*
-				 * In this state we compare begin of line with Metric:
-				 */
-				TEST_WORD("Metric:");
-				cur = malloc (sizeof (struct rspamd_metric_result));
-				if (cur == NULL) {
-					msg_err ("malloc failed: %s", strerror (errno));
-					return -1;
-				}
-				cur->subject = NULL;
-				TAILQ_INIT(&cur->symbols);
-				next_state = 3;
-				state = 99;
-				break;
-			case 3:
-				/* 
-				 * In this state we parse metric line 
-				 * Typical line looks as name; result; score1 / score2[ / score3] and we are interested in:
-				 * name, result, score1 and score2
-				 */
-				if ((c = strchr (p, ';')) == NULL) {
-					msg_warn ("invalid reply from server %s on state %d, at position: %s", srv->name, state, p);
-					return -1;
-				}
-				/* Now in c we have end of name and in p - begin of name, so copy this data to temp buffer */
-				cur->metric_name = malloc (c - p + 1);
-				if (cur->metric_name == NULL) {
-					msg_err ("malloc failed: %s", strerror (errno));
-					return -1;
-				}
-				strlcpy (cur->metric_name, p, c - p + 1);
-				remain -= c - p + 1;
-				p = c + 1;
-				/* Now skip result from rspamd, just extract 2 numbers */
-				if ((c = strchr (p, ';')) == NULL) {
-					msg_warn ("invalid reply from server %s on state %d, at position: %s", srv->name, state, p);
-					return -1;
-				}
-				remain -= c - p + 1;
-				p = c + 1;
-				/* Now skip spaces */
-				while (isspace (*p) && remain > 0) {
-					p ++;
-					remain --;
-				}
-				/* Try to read first mark */
-				cur->score = strtod (p, &err_str);
-				if (err_str != NULL && (*err_str != ' ' && *err_str != '/')) {
-					msg_warn ("invalid reply from server %s on state %d, error converting score number: %s", srv->name, state, err_str);
-					return -1;
-				}
-				remain -= err_str - p;
-				p = err_str;
-				while (remain > 0 && (*p == ' ' || *p == '/')) {
-					remain --;
-					p ++;
-				}
-				/* Try to read second mark */
-				cur->required_score = strtod (p, &err_str);
-				if (err_str != NULL && (*err_str != ' ' && *err_str != '/' && *err_str != '\r')) {
-					msg_warn ("invalid reply from server %s on state %d, error converting required score number: %s", srv->name, state, err_str);
-					return -1;
-				}
-				remain -= err_str - p;
-				p = err_str;
-				while (remain > 0 && *p != '\n') {
-					remain --;
-					p ++;
-				}
-				state = 99;
-				next_state = 4;
-				break;
-			case 4:
-				/* Symbol/Action */
-				if (remain >= sizeof ("Symbol:") && memcmp (p, "Symbol:", sizeof ("Symbol:") - 1) == 0) {
-					state = 99;
-					next_state = 5;
-					p += sizeof("Symbol:") - 1;															\
-					remain -= sizeof("Symbol:") - 1;
-				}
-				else if (remain >= sizeof ("Action:") && memcmp (p, "Action:", sizeof ("Action:") - 1) == 0) {
-					state = 99;
-					next_state = 6;
-					p += sizeof("Action:") - 1;															\
-					remain -= sizeof("Action:") - 1;
-				}
-				else if (remain >= sizeof ("Metric:") && memcmp (p, "Metric:", sizeof ("Metric:") - 1) == 0) {
-					state = 99;
-					next_state = 3;
-					p += sizeof("Metric:") - 1;															\
-					remain -= sizeof("Metric:") - 1;
-					TAILQ_INSERT_HEAD(res, cur, entry);
-					cur = malloc (sizeof (struct rspamd_metric_result));
-					if (cur == NULL) {
-						msg_err ("malloc failed: %s", strerror (errno));
-						return -1;
-					}
-					TAILQ_INIT(&cur->symbols);
-				}
-				else if (remain >= sizeof ("Message-ID:") && memcmp (p, "Message-ID:", sizeof ("Message-ID:") - 1) == 0) {
-					state = 99;
-					next_state = 7;
-					p += sizeof("Message-ID:") - 1;															\
-					remain -= sizeof("Message-ID:") - 1;
-				}
-				else if (remain >= sizeof ("Subject:") && memcmp (p, "Subject:", sizeof ("Subject:") - 1) == 0) {
-					state = 99;
-					next_state = 8;
-					p += sizeof("Subject:") - 1;															\
-					remain -= sizeof("Subject:") - 1;
-				}
-				else {
-					toklen = strcspn (p, "\r\n");
-					if (toklen > remain) {
-						msg_info ("bad symbol name detected");
-						return -1;
-					}
-					remain -= toklen;
-					p += toklen;
-					next_state = 4;
-					state = 99;
-				}
-				break;
-			case 5:
-				/* Parse symbol line */
-				toklen = strcspn (p, ";\r\n");
-				if (toklen == 0 || toklen > remain) {
-					/* Bad symbol name */
-					msg_info ("bad symbol name detected");
-					return -1;
-				}
-				cur_symbol = malloc (sizeof (struct rspamd_symbol));
-				if (cur_symbol == NULL) {
-					msg_err ("malloc failed: %s", strerror (errno));
-					return -1;
-				}
-				cur_symbol->symbol = malloc (toklen + 1);
-				if (cur_symbol->symbol == NULL) {
-					msg_err ("malloc failed: %s", strerror (errno));
-					return -1;
-				}
-				strlcpy (cur_symbol->symbol, p, toklen + 1);
-				TAILQ_INSERT_HEAD (&cur->symbols, cur_symbol, entry);
-				/* Skip to the end of line */
-				toklen = strcspn (p, "\r\n");
-				if (toklen > remain) {
-					msg_info ("bad symbol name detected");
-					return -1;
-				}
-				remain -= toklen;
-				p += toklen;
-				next_state = 4;
-				state = 99;
-				break;
-			case 6:
-				/* Parse action */
-				if (memcmp (p, "reject", sizeof ("reject") - 1) == 0) {
-					cur->action = METRIC_ACTION_REJECT;
-				}
-				else if (memcmp (p, "greylist", sizeof ("greylist") - 1) == 0) {
-					cur->action = METRIC_ACTION_GREYLIST;
-				}
-				else if (memcmp (p, "add header", sizeof ("add header") - 1) == 0) {
-					cur->action = METRIC_ACTION_ADD_HEADER;
-				}
-				else if (memcmp (p, "rewrite subject", sizeof ("rewrite subject") - 1) == 0) {
-					cur->action = METRIC_ACTION_REWRITE_SUBJECT;
-				}
-				else {
-					cur->action = METRIC_ACTION_NOACTION;
-				}
-				/* Skip to the end of line */
-				toklen = strcspn (p, "\r\n");
-				if (toklen > remain) {
-					msg_info ("bad symbol name detected");
-					return -1;
-				}
-				remain -= toklen;
-				p += toklen;
-				next_state = 4;
-				state = 99;
-				break;
-			case 7:
-				/* Parse message id */
-				toklen = strcspn (p, "\r\n");
-				*mid = malloc (toklen + 1);
-				strlcpy (*mid, p, toklen + 1);
-				remain -= toklen;
-				p += toklen;
-				next_state = 4;
-				state = 99;
-				break;
-			case 8:
-				/* Parse subject line */
-				toklen = strcspn (p, "\r\n");
-				if (cur) {
-					cur->subject = malloc (toklen + 1);
-					strlcpy (cur->subject, p, toklen + 1);
-				}
-				remain -= toklen;
-				p += toklen;
-				next_state = 4;
-				state = 99;
-				break;
-			case 99:
-				/* Skip spaces */
-				if (isspace (*p)) {
-					p ++;
-					remain --;
-				}
-				else {
-					state = next_state;
+	return 0;
+}
+
+/*
+ * write_all() - write whole buffer to socket
+ */
+
+static int
+write_all(int s, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+#ifdef MSG_NOSIGNAL
+		r = send(s, buf, len, MSG_NOSIGNAL);
+#else
+		r = write(s, buf, len);
+#endif
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += r;
+		len -= r;
+	}
+
+	return 0;
+}
+
+/*
+ * send_file() - send whole file to socket, connection is kept alive so the
+ * server gets exactly Content-Length bytes
+ */
+
+static int
+send_file(int s, int fd, off_t size)
+{
+#if defined(LINUX)
+	off_t off = 0;
+
+	while (off < size) {
+		if (sendfile(s, fd, &off, size - off) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+	}
+#elif defined(FREEBSD) || defined(HAVE_SENDFILE)
+	if (sendfile(fd, s, 0, 0, 0, 0, 0) != 0) {
+		return -1;
+	}
+#else
+	char buf[16384];
+	ssize_t r;
+
+	while (size > 0 && (r = read(fd, buf, sizeof (buf))) > 0) {
+		if (write_all(s, buf, r) == -1) {
+			return -1;
+		}
+		size -= r;
+	}
+	if (size > 0) {
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * rspamd_http_done() - release message file
+ */
+
+static void
+rspamd_http_done(int fd)
+{
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+/*
+ * http_chunk_write() - send compressed data to socket as one chunk of
+ * chunked transfer encoding
+ */
+
+static int
+http_chunk_write(void *arg, const char *data, size_t len)
+{
+	char hdr[32];
+	int s = *(int *)arg, r;
+
+	r = snprintf(hdr, sizeof (hdr), "%lx\r\n", (unsigned long)len);
+	if (write_all(s, hdr, r) == -1 || write_all(s, data, len) == -1 ||
+			write_all(s, "\r\n", 2) == -1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * rspamd_http_body() - send message file as is or compress it on the fly,
+ * compressed body is not kept in memory
+ */
+
+static int
+rspamd_http_body(int s, int fd, off_t size, int zstd, struct config_file *cfg, struct mlfi_priv *priv)
+{
+	struct compress_stat st;
+
+	if (!zstd) {
+		return send_file(s, fd, size);
+	}
+	if (compress_stream(fd, COMPRESS_ZSTD, cfg->spamd_compress_level, http_chunk_write, &s, &st) == -1 ||
+			write_all(s, "0\r\n\r\n", 5) == -1) {
+		return -1;
+	}
+	msg_debug ("rspamd: %s: compressed %lu to %lu bytes in %ld us", priv->mlfi_id,
+			(unsigned long)st.in, (unsigned long)st.out, st.cpu_us);
+
+	return 0;
+}
+
+/*
+ * rspamdscan_http() - send file to rspamd /checkv2 HTTP endpoint, keep-alive
+ * connections are reused, request on reused connection that was closed
+ * by server is repeated once on a new connection
+ *
+ * returns 0 when reply is parsed, -1 on error (try another server)
+ */
+
+static int
+rspamdscan_http(SMFICTX *ctx, struct mlfi_priv *priv, const char *file, struct spamd_server *srv,
+		struct config_file *cfg, struct rspamd_reply *reply, struct spamd_conn *conn, int by_file)
+{
+	char buf[16384];
+	size_t len = 0;
+	int s, r, fd, reused, received, attempt, zstd = 0;
+	struct stat sb;
+	struct rcpt *rcpt;
+
+	if (!srv)
+		return 0;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1 || fstat (fd, &sb) == -1) {
+		msg_warn ("rspamd: stat failed: %m");
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+
+	/* Large messages are compressed if rspamd is remote */
+	if (by_file) {
+		/* Local rspamd reads file itself */
+		r = http_header (buf, sizeof (buf), &len, "POST /checkv2 HTTP/1.1\r\nHost: %s\r\n"
+				"Connection: keep-alive\r\nContent-Length: 0\r\nFile: %s\r\n", srv->name, file);
+	}
+	else if (cfg->spamd_compress_threshold != 0 && sb.st_size > cfg->spamd_compress_threshold &&
+			srv->sock_type != AF_LOCAL && compress_supported (COMPRESS_ZSTD)) {
+		/* Size of compressed body is not known before it is sent */
+		zstd = 1;
+		r = http_header (buf, sizeof (buf), &len, "POST /checkv2 HTTP/1.1\r\nHost: %s\r\n"
+				"Connection: keep-alive\r\nTransfer-Encoding: chunked\r\nCompression: zstd\r\n",
+				srv->name);
+	}
+	else {
+		r = http_header (buf, sizeof (buf), &len, "POST /checkv2 HTTP/1.1\r\nHost: %s\r\n"
+				"Connection: keep-alive\r\nContent-Length: %ld\r\n", srv->name, (long int)sb.st_size);
+	}
+	for (rcpt = priv->rcpts.lh_first; r == 0 && rcpt != NULL; rcpt = rcpt->r_list.le_next) {
+		r = http_header (buf, sizeof (buf), &len, "Rcpt: %s\r\n", rcpt->r_addr);
+	}
+	if (r == 0 && priv->priv_from[0] != '\0') {
+		r = http_header (buf, sizeof (buf), &len, "From: %s\r\n", priv->priv_from);
+	}
+	if (r == 0 && priv->priv_helo[0] != '\0') {
+		r = http_header (buf, sizeof (buf), &len, "Helo: %s\r\n", priv->priv_helo);
+	}
+	if (r == 0 && priv->priv_ip[0] != '\0') {
+		r = http_header (buf, sizeof (buf), &len, "IP: %s\r\n", priv->priv_ip);
+	}
+	if (r == 0 && priv->priv_user[0] != '\0') {
+		r = http_header (buf, sizeof (buf), &len, "User: %s\r\n", priv->priv_user);
+	}
+	if (r == 0) {
+		r = http_header (buf, sizeof (buf), &len, "Queue-Id: %s\r\n\r\n", priv->mlfi_id);
+	}
+	if (r == -1) {
+		msg_warn("rspamd: buffer overflow while filling buffer (%s)", srv->name);
+		close(fd);
+		return -1;
+	}
+	if (by_file) {
+		/* File is not needed any more */
+		close(fd);
+		fd = -1;
+	}
+
+	for (attempt = 0; attempt < 2; attempt ++) {
+		reused = 1;
+		if ((s = spamd_idle_get (srv)) == -1) {
+			reused = 0;
+			if ((s = spamd_connect (srv, cfg)) == -1) {
+				rspamd_http_done (fd);
+				return -1;
+			}
+		}
+		if (spamd_conn_set (conn, s) == -1) {
+			rspamd_http_done (fd);
+			close(s);
+			return -1;
+		}
+		if (fd != -1 && lseek (fd, 0, SEEK_SET) == -1) {
+			msg_warn("rspamd: lseek (%s), %d: %m", srv->name, errno);
+			rspamd_http_done (fd);
+			spamd_close(conn, s);
+			return -1;
+		}
+		rspamd_reply_free (reply);
+		received = 0;
+
+		if (write_all (s, buf, len) == -1 ||
+				(fd != -1 && rspamd_http_body (s, fd, sb.st_size, zstd, cfg, priv) == -1)) {
+			if (reused) {
+				spamd_close(conn, s);
+				continue;
+			}
+			msg_warn("rspamd: write (%s), %d: %m", srv->name, errno);
+			rspamd_http_done (fd);
+			spamd_close(conn, s);
+			return -1;
+		}
+
+		/* read reply, it is parsed as it arrives */
+		r = 0;
+		while (r == 0) {
+			if (poll_fd(s, cfg->spamd_results_timeout, POLLIN) < 1) {
+				msg_warn("rspamd: timeout waiting results %s", srv->name);
+				rspamd_http_done (fd);
+				spamd_close(conn, s);
+				return -1;
+			}
+			if ((r = read(s, buf, sizeof (buf))) <= 0) {
+				if (r < 0 && errno == EINTR) {
+					r = 0;
+					continue;
 				}
 				break;
-			default:
-				msg_err ("state machine breakage detected, state = %d, p = %s", state, p);
-				return -1;
+			}
+			received += r;
+			r = rspamd_http_feed (reply, buf, r);
+		}
+
+		if (r <= 0 && received == 0 && reused) {
+			/* Server has closed keep-alive connection, repeat request */
+			spamd_close(conn, s);
+			continue;
+		}
+		rspamd_http_done (fd);
+		if (r < 0 && reply->err == NULL) {
+			msg_warn("rspamd: read, %s, %d: %m", srv->name, errno);
+			spamd_close(conn, s);
+			return -1;
+		}
+		if (r == 0) {
+			r = rspamd_http_end (reply) == 0 ? 1 : -1;
+		}
+		if (r == -1) {
+			msg_warn ("rspamd: invalid reply from server %s: %s", srv->name, reply->err);
+			spamd_close(conn, s);
+			return -1;
+		}
+		if (reply->keepalive && spamd_conn_set (conn, -1) == 0) {
+			spamd_idle_put (srv, s);
+		}
+		else {
+			spamd_close(conn, s);
 		}
-	}
 
-	if (cur != NULL) {
-		TAILQ_INSERT_HEAD(res, cur, entry);
+		return 0;
 	}
-	return 0;
+
+	msg_warn("rspamd: keep-alive connection to %s failed", srv->name);
+	rspamd_http_done (fd);
+
+	return -1;
 }
-#undef TEST_WORD
+
 /*
  * spamdscan_socket() - send file to specified host. See spamdscan() for
  * load-balanced wrapper.
@@ -644,7 +869,8 @@ do {																				\
  */
 
 static int 
-spamdscan_socket(const char *file, const struct spamd_server *srv, struct config_file *cfg, rspamd_result_t *res)
+spamdscan_socket(const char *file, const struct spamd_server *srv, struct config_file *cfg,
+		struct rspamd_reply *reply, struct spamd_conn *conn)
 {
 #ifdef HAVE_PATH_MAX
 	char buf[PATH_MAX + 10];
@@ -660,6 +886,7 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 	struct stat sb;
 	struct rspamd_metric_result *cur = NULL;
 	struct rspamd_symbol *cur_symbol;
+	struct compressed z;
 
 	/* somebody doesn't need reply... */
 	if (!srv)
@@ -698,51 +925,86 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 			return -1;
 		}
 	}
+	if (spamd_conn_set(conn, s) == -1) {
+		close(s);
+		return -1;
+	}
 	/* Get file size */
 	fd = open(file, O_RDONLY);
 	if (fstat (fd, &sb) == -1) {
 		msg_warn ("spamd: stat failed: %m");
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	
 	if (poll_fd(s, cfg->spamd_connect_timeout, POLLOUT) < 1) {
 		msg_warn ("spamd: timeout waiting writing, %s", srv->name);
-		close (s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	/* Set blocking again */
 	ofl = fcntl(s, F_GETFL, 0);
 	fcntl(s, F_SETFL, ofl & (~O_NONBLOCK));
 
-	r = snprintf (buf, sizeof (buf), "SYMBOLS SPAMC/1.2\r\nContent-length: %ld\r\n\r\n", (long int)sb.st_size);
+	/*
+	 * Large messages are compressed if spamd is remote, spamd needs size of
+	 * compressed body first, so it is compressed into memory and is sent as is
+	 * if compressed copy is larger than COMPRESS_MAX_BUFFER or than message
+	 */
+	bzero (&z, sizeof (z));
+	if (cfg->spamd_compress_threshold != 0 && sb.st_size > cfg->spamd_compress_threshold &&
+			srv->sock_type != AF_LOCAL &&
+			compress_file (fd, COMPRESS_ZLIB, cfg->spamd_compress_level,
+					sb.st_size < COMPRESS_MAX_BUFFER ? sb.st_size : COMPRESS_MAX_BUFFER, &z) == 0) {
+		msg_debug ("spamd: compressed %ld to %lu bytes in %ld us, %s",
+				(long int)sb.st_size, (unsigned long)z.len, z.stat.cpu_us, file);
+		r = snprintf (buf, sizeof (buf), "SYMBOLS SPAMC/1.3\r\nContent-length: %lu\r\nCompress: zlib\r\n\r\n",
+				(unsigned long)z.len);
+	}
+	else {
+		lseek (fd, 0, SEEK_SET);
+		r = snprintf (buf, sizeof (buf), "SYMBOLS SPAMC/1.2\r\nContent-length: %ld\r\n\r\n", (long int)sb.st_size);
+	}
 	if (write (s, buf, r) == -1) {
 		msg_warn("spamd: write (%s), %d: %m", srv->name, errno);
 		close(fd);
-		close(s);
+		compressed_free (&z);
+		spamd_close(conn, s);
 		return -1;
 	}
 
-#if defined(FREEBSD) || defined(HAVE_SENDFILE)
-	if (sendfile(fd, s, 0, 0, 0, 0, 0) != 0) {
-		msg_warn("spamd: sendfile (%s), %d: %m", srv->name, errno);
-		close(fd);
-		close(s);
-		return -1;
+	if (z.data != NULL) {
+		r = write_all (s, z.data, z.len);
+		compressed_free (&z);
+		if (r == -1) {
+			msg_warn("spamd: write (%s), %d: %m", srv->name, errno);
+			close(fd);
+			spamd_close(conn, s);
+			return -1;
+		}
 	}
+	else {
+#if defined(FREEBSD) || defined(HAVE_SENDFILE)
+		if (sendfile(fd, s, 0, 0, 0, 0, 0) != 0) {
+			msg_warn("spamd: sendfile (%s), %d: %m", srv->name, errno);
+			close(fd);
+			spamd_close(conn, s);
+			return -1;
+		}
 #elif defined(LINUX)
-	off_t off = 0;
-	if (sendfile(s, fd, &off, sb.st_size) == -1) {
-		msg_warn("spamd: sendfile (%s), %d: %m", srv->name, errno);
-		close(fd);
-		close(s);
-		return -1;		
-	}
+		off_t off = 0;
+		if (sendfile(s, fd, &off, sb.st_size) == -1) {
+			msg_warn("spamd: sendfile (%s), %d: %m", srv->name, errno);
+			close(fd);
+			spamd_close(conn, s);
+			return -1;		
+		}
 #else 
-	while ((r = read (fd, buf, sizeof (buf))) > 0) {
-		write (s, buf, r);
-	}
+		while ((r = read (fd, buf, sizeof (buf))) > 0) {
+			write (s, buf, r);
+		}
 #endif
+	}
 
 	fcntl(s, F_SETFL, ofl);
 	close(fd);
@@ -751,7 +1013,7 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 
 	if (poll_fd(s, cfg->spamd_results_timeout, POLLIN) < 1) {
 		msg_warn("spamd: timeout waiting results %s", srv->name);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 	
@@ -768,11 +1030,11 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 
 	if (r < 0) {
 		msg_warn("spamd: read, %s, %d: %m", srv->name, errno);
-		close(s);
+		spamd_close(conn, s);
 		return -1;
 	}
 
-	close(s);
+	spamd_close(conn, s);
 
 	/*
 	 * ok, we got result; test what we got
@@ -784,12 +1046,13 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 	}
 	else {
 
-		cur = malloc (sizeof (struct rspamd_metric_result));
+		cur = rspamd_reply_alloc (reply, sizeof (struct rspamd_metric_result));
 		if (cur == NULL) {
 			msg_err ("malloc falied: %s", strerror (errno));
 			return -1;
 		}
 		bzero (cur, sizeof (struct rspamd_metric_result));
+		TAILQ_INIT(&cur->symbols);
 		/* Find mark */
 		c = strchr (c, ';');
 		if (c != NULL && *c != '\0') {
@@ -816,8 +1079,11 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 		if (err != NULL) {
 			*err = '\0';
 		}
-		cur_symbol = malloc (sizeof (struct rspamd_symbol));
-		cur_symbol->symbol = strdup (c);
+		cur_symbol = rspamd_reply_alloc (reply, sizeof (struct rspamd_symbol));
+		if (cur_symbol == NULL || (cur_symbol->symbol = rspamd_reply_strdup (reply, c, strlen (c))) == NULL) {
+			msg_err ("malloc falied: %s", strerror (errno));
+			return -1;
+		}
 		TAILQ_INSERT_HEAD(&cur->symbols, cur_symbol, entry);
 	}
 
@@ -829,6 +1095,473 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
 	return 0;
 }
 
+/*
+ * rspamd_scan() - scan file with rspamd server using its protocol
+ */
+
+static int
+rspamd_scan(SMFICTX *ctx, struct mlfi_priv *priv, const char *file, struct spamd_server *srv,
+		struct config_file *cfg, struct rspamd_reply *reply, struct spamd_conn *conn, int by_file)
+{
+	if (srv->type == SPAMD_RSPAMD_HTTP) {
+		return rspamdscan_http (ctx, priv, file, srv, cfg, reply, conn, by_file);
+	}
+
+	return rspamdscan_socket (ctx, priv, file, srv, cfg, reply, conn, by_file);
+}
+
+/*
+ * spamd_scan_server() - scan file with one server using its protocol, local
+ * rspamd gets path of file if configured so, and its content if it has
+ * failed to read file
+ */
+
+static int
+spamd_scan_server(SMFICTX *ctx, struct mlfi_priv *priv, const char *file, struct spamd_server *srv,
+		struct config_file *cfg, struct rspamd_reply *reply, struct spamd_conn *conn)
+{
+	time_t now;
+	int r;
+
+	if (srv->type == SPAMD_SPAMASSASSIN) {
+		return spamdscan_socket (file, srv, cfg, reply, conn);
+	}
+	now = time (NULL);
+	if (!cfg->spamd_pass_file || srv->sock_type != AF_LOCAL || *file != '/' ||
+			now - srv->file_failed < SPAMD_FILE_RETRY) {
+		return rspamd_scan (ctx, priv, file, srv, cfg, reply, conn, 0);
+	}
+
+	r = rspamd_scan (ctx, priv, file, srv, cfg, reply, conn, 1);
+	if (r == -1 && reply->server_error) {
+		msg_warn ("rspamd: %s cannot read %s, send content for %d seconds",
+				srv->name, file, SPAMD_FILE_RETRY);
+		srv->file_failed = now;
+		rspamd_reply_free (reply);
+		r = rspamd_scan (ctx, priv, file, srv, cfg, reply, conn, 0);
+	}
+
+	return r;
+}
+
+/*
+ * Hedged requests: if server has not replied within configured percentile of
+ * scan times, the same scan is sent to another server and the first complete
+ * reply is taken. Scan times are kept in histogram that slowly forgets old
+ * values, separately for main and extra servers.
+ */
+
+static struct spamd_latency {
+	unsigned int buckets[HEDGE_BUCKETS];
+	unsigned int total;
+	time_t second;
+	unsigned int hedged;
+} spamd_latency[2];
+
+/*
+ * hedge_record() - add time of successful scan in milliseconds
+ */
+
+static void
+hedge_record(int extra, unsigned int ms)
+{
+	struct spamd_latency *lat = &spamd_latency[extra ? 1 : 0];
+	int i;
+
+	pthread_mutex_lock(&mx_spamd_hedge);
+	ms /= HEDGE_BUCKET_MS;
+	lat->buckets[ms < HEDGE_BUCKETS ? ms : HEDGE_BUCKETS - 1] ++;
+	if (++lat->total >= HEDGE_WINDOW) {
+		lat->total = 0;
+		for (i = 0; i < HEDGE_BUCKETS; i++) {
+			lat->buckets[i] /= 2;
+			lat->total += lat->buckets[i];
+		}
+	}
+	pthread_mutex_unlock(&mx_spamd_hedge);
+}
+
+/*
+ * hedge_delay() - get delay in milliseconds before hedged request, returns -1
+ * if hedging is disabled or there are too few scans to know percentile
+ */
+
+static int
+hedge_delay(struct config_file *cfg, int extra)
+{
+	struct spamd_latency *lat = &spamd_latency[extra ? 1 : 0];
+	unsigned int sum = 0, limit;
+	int i, r = -1;
+
+	if (cfg->spamd_hedge_percentile == 0 ||
+			(extra ? cfg->extra_spamd_servers_num : cfg->spamd_servers_num) < 2) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&mx_spamd_hedge);
+	if (lat->total >= HEDGE_MIN_SCANS) {
+		limit = (unsigned long long)lat->total * cfg->spamd_hedge_percentile / 100;
+		for (i = 0; i < HEDGE_BUCKETS - 1; i++) {
+			sum += lat->buckets[i];
+			if (sum >= limit) {
+				break;
+			}
+		}
+		r = (i + 1) * HEDGE_BUCKET_MS;
+	}
+	pthread_mutex_unlock(&mx_spamd_hedge);
+
+	return r;
+}
+
+/*
+ * hedge_allow() - check and spend budget of hedged requests per second
+ */
+
+static int
+hedge_allow(struct config_file *cfg, int extra)
+{
+	struct spamd_latency *lat = &spamd_latency[extra ? 1 : 0];
+	time_t now = time(NULL);
+	int r = 0;
+
+	pthread_mutex_lock(&mx_spamd_hedge);
+	if (lat->second != now) {
+		lat->second = now;
+		lat->hedged = 0;
+	}
+	if (lat->hedged < cfg->spamd_hedge_budget) {
+		lat->hedged ++;
+		r = 1;
+	}
+	pthread_mutex_unlock(&mx_spamd_hedge);
+
+	return r;
+}
+
+/*
+ * hedge_upstream() - select alive server other than primary one
+ */
+
+static struct spamd_server *
+hedge_upstream(struct config_file *cfg, int extra, struct spamd_server *primary)
+{
+	struct spamd_server *servers, *srv;
+	size_t num, start, i;
+
+	servers = extra ? cfg->extra_spamd_servers : cfg->spamd_servers;
+	num = extra ? cfg->extra_spamd_servers_num : cfg->spamd_servers_num;
+	start = rand() % num;
+	for (i = 0; i < num; i++) {
+		srv = &servers[(start + i) % num];
+		if (srv != primary && !srv->up.dead) {
+			return srv;
+		}
+	}
+
+	return NULL;
+}
+
+struct spamd_hedge {
+	pthread_mutex_t mtx;
+	pthread_cond_t cond;
+	SMFICTX *ctx;
+	struct mlfi_priv *priv;
+	const char *file;
+	struct config_file *cfg;
+	int extra;
+	int delay;
+	struct spamd_server *primary;
+	struct spamd_conn *primary_conn;
+	int primary_done;
+	/* Hedged request */
+	struct spamd_server *srv;
+	struct spamd_conn conn;
+	struct rspamd_reply *reply;
+	int done;
+	int r;
+};
+
+/*
+ * hedge_thread() - wait for primary scan and send hedged request if it is
+ * too slow
+ */
+
+static void *
+hedge_thread(void *arg)
+{
+	struct spamd_hedge *h = arg;
+	struct spamd_server *srv;
+	struct timeval tv;
+	struct timespec ts;
+	int r;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + h->delay / 1000;
+	ts.tv_nsec = tv.tv_usec * 1000 + (h->delay % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec ++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&h->mtx);
+	while (!h->primary_done) {
+		if (pthread_cond_timedwait(&h->cond, &h->mtx, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	if (!h->primary_done && hedge_allow(h->cfg, h->extra)) {
+		/* Primary scan waits for hedged one from now */
+		h->srv = hedge_upstream(h->cfg, h->extra, h->primary);
+	}
+	srv = h->srv;
+	pthread_mutex_unlock(&h->mtx);
+
+	if (srv == NULL) {
+		return NULL;
+	}
+	msg_info("spamdscan: no reply from %s in %d ms, send hedged request to %s, %s",
+			h->primary->name, h->delay, srv->name, h->priv->file);
+
+	r = spamd_scan_server (h->ctx, h->priv, h->file, srv, h->cfg, h->reply, &h->conn);
+
+	pthread_mutex_lock(&h->mtx);
+	h->r = r;
+	h->done = 1;
+	if ((r == 0 || r == 1) && !h->primary_done) {
+		/* First complete reply wins */
+		spamd_conn_cancel(h->primary_conn);
+	}
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->mtx);
+
+	return NULL;
+}
+
+/*
+ * spamdscan_hedged() - scan file with selected server and with another one if
+ * the first is too slow; selected is set to server which reply is taken,
+ * reply of hedged request is written to hreply
+ */
+
+static int
+spamdscan_hedged(SMFICTX *ctx, struct mlfi_priv *priv, const char *file, struct config_file *cfg, int extra, int delay,
+		struct spamd_server **selected, struct rspamd_reply *reply, struct rspamd_reply *hreply, int *hedged)
+{
+	struct spamd_hedge h;
+	struct spamd_conn conn;
+	pthread_t thr;
+	int r;
+
+	bzero(&h, sizeof (h));
+	pthread_mutex_init(&h.mtx, NULL);
+	pthread_cond_init(&h.cond, NULL);
+	h.ctx = ctx;
+	h.priv = priv;
+	h.file = file;
+	h.cfg = cfg;
+	h.extra = extra;
+	h.delay = delay;
+	h.primary = *selected;
+	h.primary_conn = &conn;
+	h.conn.mtx = &h.mtx;
+	h.conn.sock = -1;
+	h.reply = hreply;
+	conn.mtx = &h.mtx;
+	conn.sock = -1;
+	conn.cancelled = 0;
+	*hedged = 0;
+
+	if (pthread_create(&thr, NULL, hedge_thread, &h) != 0) {
+		msg_warn("spamdscan: cannot create thread for hedged request: %s", strerror(errno));
+		r = spamd_scan_server (ctx, priv, file, *selected, cfg, reply, NULL);
+	}
+	else {
+		r = spamd_scan_server (ctx, priv, file, *selected, cfg, reply, &conn);
+
+		pthread_mutex_lock(&h.mtx);
+		h.primary_done = 1;
+		if (r == 0 || r == 1) {
+			if (h.srv != NULL && !h.done) {
+				spamd_conn_cancel(&h.conn);
+			}
+		}
+		else {
+			/* Wait for hedged request if it is sent */
+			while (h.srv != NULL && !h.done) {
+				pthread_cond_wait(&h.cond, &h.mtx);
+			}
+			if (h.srv != NULL && (h.r == 0 || h.r == 1)) {
+				if (!conn.cancelled) {
+					upstream_fail (&(*selected)->up, time(NULL));
+				}
+				*selected = h.srv;
+				*hedged = 1;
+				r = h.r;
+			}
+			else if (h.srv != NULL && !h.conn.cancelled) {
+				upstream_fail (&h.srv->up, time(NULL));
+			}
+		}
+		pthread_cond_broadcast(&h.cond);
+		pthread_mutex_unlock(&h.mtx);
+		pthread_join(thr, NULL);
+	}
+
+	pthread_mutex_destroy(&h.mtx);
+	pthread_cond_destroy(&h.cond);
+
+	return r;
+}
+
+/*
+ * spamd_boundary() - check whether line at buf + pos is a delimiter of MIME
+ * part, its boundary must be declared before it, returns length of boundary
+ */
+
+static size_t
+spamd_boundary(const char *buf, size_t pos, size_t len)
+{
+	const char *b = buf + pos + 2, *c;
+	size_t blen = 0, i;
+
+	if (pos + 2 >= len || buf[pos] != '-' || buf[pos + 1] != '-') {
+		return 0;
+	}
+	while (pos + 2 + blen < len && b[blen] != '\r' && b[blen] != '\n' && !isspace ((u_char)b[blen])) {
+		blen ++;
+	}
+	if (blen == 0 || blen > 70) {
+		return 0;
+	}
+	/* Look for boundary="..." or boundary=..., declared value must end there */
+	for (i = 0; i + blen < pos; i ++) {
+		c = buf + i;
+		if (i > 0 && (c[-1] == '=' || c[-1] == '"') && memcmp (c, b, blen) == 0 &&
+				(c[blen] == '"' || c[blen] == ';' || isspace ((u_char)c[blen]))) {
+			return blen;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * spamd_partial() - write headers and beginning of body of large message to
+ * path, body is cut before delimiter of MIME part if there is one. Original
+ * size is passed to scanner in X-Rmilter-Original-Size header.
+ *
+ * returns 1 if partial copy is written, 0 if message is small enough, -1 on error
+ */
+
+static int
+spamd_partial(struct mlfi_priv *priv, struct config_file *cfg, char *path, size_t pathlen)
+{
+	char *buf, hdr[64], end[80];
+	struct stat sb;
+	size_t len, body = 0, half, cut = 0, blen = 0, i;
+	ssize_t r;
+	FILE *out;
+	int fd, hlen, elen = 0, mime = 0;
+
+	if (stat (priv->file, &sb) == -1 || sb.st_size <= (off_t)cfg->spamd_partial_size) {
+		return 0;
+	}
+	if ((size_t)snprintf (path, pathlen, "%s.part", priv->file) >= pathlen) {
+		return -1;
+	}
+	len = cfg->spamd_partial_size + SPAMD_PARTIAL_HEADERS;
+	if ((off_t)len > sb.st_size) {
+		len = sb.st_size;
+	}
+	if ((fd = open (priv->file, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if ((buf = malloc (len)) == NULL) {
+		close (fd);
+		return -1;
+	}
+	r = read (fd, buf, len);
+	close (fd);
+	if (r != (ssize_t)len) {
+		free (buf);
+		return -1;
+	}
+
+	/* Find the end of headers */
+	for (i = 0; i + 1 < len; i ++) {
+		if (buf[i] == '\n' && (buf[i + 1] == '\n' || (buf[i + 1] == '\r' && i + 2 < len && buf[i + 2] == '\n'))) {
+			body = i + (buf[i + 1] == '\n' ? 2 : 3);
+			break;
+		}
+	}
+	if (body == 0 || body + cfg->spamd_partial_size >= (size_t)sb.st_size) {
+		/* Headers are too long or body is small */
+		free (buf);
+		return 0;
+	}
+	if (body + cfg->spamd_partial_size < len) {
+		len = body + cfg->spamd_partial_size;
+	}
+
+	/*
+	 * Cut before the last delimiter of MIME part or at the end of line in the
+	 * second half of window, then close multipart
+	 */
+	half = body + cfg->spamd_partial_size / 2;
+	for (i = len; i >= body; i --) {
+		if (buf[i - 1] != '\n') {
+			continue;
+		}
+		if (cut == 0) {
+			cut = i;
+		}
+		if ((blen = spamd_boundary (buf, i, len)) != 0) {
+			if (i >= half) {
+				cut = i;
+				mime = 1;
+			}
+			break;
+		}
+	}
+	if (cut < half) {
+		/* Too long line */
+		cut = len;
+		elen = snprintf (end, sizeof (end), "\r\n");
+	}
+	if (blen != 0) {
+		elen += snprintf (end + elen, sizeof (end) - elen, "--%.*s--\r\n", (int)blen, buf + i + 2);
+	}
+
+	hlen = snprintf (hdr, sizeof (hdr), "X-Rmilter-Original-Size: %ld\r\n", (long int)sb.st_size);
+	if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, cfg->spamd_pass_file ? 0640 : 0600)) == -1 ||
+			(out = fdopen (fd, "w")) == NULL) {
+		msg_warn ("spamd_partial: cannot open %s: %m", path);
+		if (fd != -1) {
+			close (fd);
+			unlink (path);
+		}
+		free (buf);
+		return -1;
+	}
+	fwrite (hdr, 1, hlen, out);
+	fwrite (buf, 1, cut, out);
+	if (elen > 0) {
+		fwrite (end, 1, elen, out);
+	}
+	free (buf);
+	fd = ferror (out);
+	if (fclose (out) == EOF || fd) {
+		msg_warn ("spamd_partial: cannot write %s: %m", path);
+		unlink (path);
+		return -1;
+	}
+	msg_info ("spamdscan: %s: message size %ld, scan first %lu bytes%s", priv->mlfi_id,
+			(long int)sb.st_size, (unsigned long)cut, mime ? ", cut at mime boundary" : "");
+
+	return 1;
+}
+
 /*
  * spamdscan() - send file to one of remote spamd, with pseudo load-balancing
  * (select one random server, fallback to others in case of errors).
@@ -837,28 +1570,75 @@ spamdscan_socket(const char *file, const struct spamd_server *srv, struct config
  * 1 if file scanned and spam found ,
  * 2 if file scanned and this is probably spam,
  * -1 when retry limit exceeded, -2 on unexpected error, e.g. unexpected reply from
- * server (suppose scanned message killed spamd...)
+ * server (suppose scanned message killed spamd...),
+ * -3 if there was no free slot during queue timeout
  */
 
 int 
 spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **subject, int extra)
 {
-	int retry = 5, r = -2, hr = 0, to_trace = 0;
-	struct timeval t;
+	int r = -2, hr = 0, to_trace = 0, hedged = 0, delay, scanned = 0, cached = 0;
+	struct timeval t, ta;
 	double ts, tf;
-	struct spamd_server *selected = NULL;
+	struct spamd_server *selected = NULL, *next;
+	struct upstream_retry rt;
 	char rbuf[BUFSIZ], hdrbuf[BUFSIZ];
 	char *prefix = "s", *mid = NULL, *c;
-	rspamd_result_t res;
-	struct rspamd_metric_result *cur = NULL, *tmp, *res_metric;
-	struct rspamd_symbol *cur_symbol, *tmp_symbol;
+	struct rspamd_reply reply, hreply, *res;
+	struct rspamd_metric_result *cur = NULL, *res_metric = NULL;
+	struct rspamd_symbol *cur_symbol;
 	enum rspamd_metric_action res_action = METRIC_ACTION_NOACTION;
+	verdict_key_t vkey;
+	struct verdict v;
+#ifdef HAVE_PATH_MAX
+	char partial[PATH_MAX];
+#elif defined(HAVE_MAXPATHLEN)
+	char partial[MAXPATHLEN];
+#else
+#error "neither PATH_MAX nor MAXPATHEN defined"
+#endif
+	const char *file = priv->file;
 	
 
 	gettimeofday(&t, NULL);
 	ts = t.tv_sec + t.tv_usec / 1000000.0;
 
-	TAILQ_INIT(&res);
+	/* Reuse verdict for the same message scanned recently */
+	if (!extra && cfg->verdict_cache != NULL &&
+			verdict_make_key (cfg->verdict_cache, priv, &vkey)) {
+		cached = 1;
+		if (verdict_lookup (cfg->verdict_cache, &vkey, t.tv_sec, &v)) {
+			msg_info ("spamdscan: scan qid: <%s>, cached verdict: action %d, [%f / %f], %.2f%% of scans avoided",
+					priv->mlfi_id, v.action, v.score, v.required_score,
+					verdict_avoided (cfg->verdict_cache));
+			if (cfg->extended_spam_headers) {
+				snprintf (hdrbuf, sizeof (hdrbuf), "%s: %s [%.2f / %.2f] cached",
+						cfg->rspamd_metric,
+						v.score > v.required_score ? "True" : "False",
+						v.score,
+						v.required_score);
+				smfi_addheader (ctx, "X-Spamd-Result", hdrbuf);
+				smfi_addheader (ctx, "X-Spamd-Queue-ID", priv->mlfi_id);
+			}
+			return v.action;
+		}
+	}
+
+	/* Wait for free slot, extra servers are not limited */
+	if (!extra && scan_sched_enter (cfg->spamd_sched, scan_class_get (priv)) == -1) {
+		msg_warn ("spamdscan: %s: queue timeout exceeded, %s", priv->mlfi_id, priv->file);
+		return -3;
+	}
+
+	/* Scan only beginning of large message */
+	if (cfg->spamd_partial_size != 0 &&
+			spamd_partial (priv, cfg, partial, sizeof (partial)) == 1) {
+		file = partial;
+	}
+
+	rspamd_reply_init (&reply);
+	rspamd_reply_init (&hreply);
+	upstream_retry_init (&rt, cfg->spamd_retry_budget);
 
 	/* try to scan with available servers */
 	while (1) {
@@ -874,19 +1654,51 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 		}
 		if (selected == NULL) {
 			msg_err ("spamdscan: upstream get error, %s", priv->file);
+			rspamd_reply_free (&reply);
+			rspamd_reply_free (&hreply);
+			if (file != priv->file) {
+				unlink (file);
+			}
+			if (!extra) {
+				scan_sched_leave (cfg->spamd_sched);
+			}
 			return -1;
 		}
+		/* Fail over to server that was not tried yet */
+		if (extra) {
+			next = (struct spamd_server *) upstream_retry_select (&rt, &selected->up, (void *)cfg->extra_spamd_servers,
+					cfg->extra_spamd_servers_num, sizeof (struct spamd_server));
+		}
+		else {
+			next = (struct spamd_server *) upstream_retry_select (&rt, &selected->up, (void *)cfg->spamd_servers,
+					cfg->spamd_servers_num, sizeof (struct spamd_server));
+		}
+		if (next == NULL) {
+			if (upstream_retry_backoff (&rt) == -1) {
+				msg_warn("%spamdscan: retry budget exceeded after %u attempts, %u of %u ms, %s",
+						prefix, rt.attempts, upstream_retry_elapsed (&rt), rt.budget, priv->file);
+				break;
+			}
+			gettimeofday(&t, NULL);
+			continue;
+		}
+		selected = next;
 		
-		if (selected->type == SPAMD_SPAMASSASSIN) {
-			prefix = "s";
-			r = spamdscan_socket (priv->file, selected, cfg, &res);
+		/* Drop results of failed attempt */
+		rspamd_reply_free (&reply);
+		rspamd_reply_free (&hreply);
+		gettimeofday(&ta, NULL);
+		if ((delay = hedge_delay (cfg, extra)) != -1) {
+			r = spamdscan_hedged (ctx, priv, file, cfg, extra, delay, &selected, &reply, &hreply, &hedged);
 		}
 		else {
-			prefix = "rs";
-			r = rspamdscan_socket (ctx, priv, selected, cfg, &res, &mid);
+			r = spamd_scan_server (ctx, priv, file, selected, cfg, &reply, NULL);
 		}
+		prefix = selected->type == SPAMD_SPAMASSASSIN ? "s" : "rs";
 		if (r == 0 || r == 1) {
 			upstream_ok (&selected->up, t.tv_sec);
+			gettimeofday(&t, NULL);
+			hedge_record (extra, (t.tv_sec - ta.tv_sec) * 1000 + (t.tv_usec - ta.tv_usec) / 1000);
 			break;
 		}
 		upstream_fail (&selected->up, t.tv_sec);
@@ -894,12 +1706,17 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 			msg_warn("%spamdscan: unexpected problem, %s, %s", prefix, selected->name, priv->file);
 			break;
 		}
-		if (--retry < 1) {
-			msg_warn("%spamdscan: retry limit exceeded, %s, %s", prefix, selected->name, priv->file);
+		if (upstream_retry_elapsed (&rt) >= rt.budget) {
+			msg_warn("%spamdscan: retry budget exceeded after %u attempts, %u of %u ms, %s, %s",
+					prefix, rt.attempts, upstream_retry_elapsed (&rt), rt.budget, selected->name, priv->file);
 			break;
 		}
 		msg_warn("%spamdscan: failed to scan, retry, %s, %s", prefix, selected->name, priv->file);
-		sleep(1);
+	}
+	scanned = (r == 0 || r == 1);
+	if (rt.attempts > 1 && scanned) {
+		msg_info("%spamdscan: %u attempts used %u of %u ms retry budget, %s",
+				prefix, rt.attempts, upstream_retry_elapsed (&rt), rt.budget, priv->file);
 	}
 
 	/*
@@ -909,7 +1726,9 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 	tf = t.tv_sec + t.tv_usec / 1000000.0;
 	
 	/* Parse res tailq */
-	cur = TAILQ_FIRST(&res);
+	res = hedged ? &hreply : &reply;
+	mid = res->mid;
+	cur = TAILQ_FIRST(&res->metrics);
 	while (cur) {
 		if (cur->metric_name) {
 			if (cfg->extended_spam_headers) {
@@ -928,7 +1747,6 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 					cur->metric_name,
 					cur->score,
 					cur->required_score);
-			free (cur->metric_name);
 		}
 		else {
 			if (cfg->extended_spam_headers) {
@@ -991,23 +1809,15 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 									cur_symbol->symbol);
 						}
 					}
-					free (cur_symbol->symbol);
 				}
-				tmp_symbol = cur_symbol;
 				cur_symbol = TAILQ_NEXT(cur_symbol, entry);
-				free (tmp_symbol);
 			}
 		}
 		msg_info ("%s", rbuf);
-		if (cur->subject != NULL) {
-			free (cur->subject);
-		}
 
-		tmp = cur;
 		cur = TAILQ_NEXT(cur, entry);
-
-		free (tmp);
-		if (cfg->extended_spam_headers) {
+		/* Shadow scans have no milter context */
+		if (ctx != NULL && cfg->extended_spam_headers) {
 			if (extra) {
 				smfi_addheader (ctx, "X-Spamd-Extra-Result", hdrbuf);
 			}
@@ -1017,7 +1827,7 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 		}
 	}
 	/* All other statistic headers */
-	if (cfg->extended_spam_headers) {
+	if (ctx != NULL && cfg->extended_spam_headers) {
 		if (extra) {
 			smfi_addheader (ctx, "X-Spamd-Extra-Server", selected->name);
 			snprintf (hdrbuf, sizeof (hdrbuf), "%.2f", tf - ts);
@@ -1035,7 +1845,26 @@ spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **
 		smfi_addrcpt (ctx, cfg->trace_addr);
 		smfi_setpriv (ctx, priv);
 	}
-
+	/* Subject from rspamd and tracing are not cached */
+	if (cached && scanned && !to_trace &&
+			(res_action != METRIC_ACTION_REWRITE_SUBJECT || res_metric->subject == NULL)) {
+		if (res_metric == NULL) {
+			res_metric = TAILQ_FIRST(&res->metrics);
+		}
+		v.action = res_action;
+		v.score = res_metric != NULL ? res_metric->score : 0.0;
+		v.required_score = res_metric != NULL ? res_metric->required_score : 0.0;
+		verdict_add (cfg->verdict_cache, &vkey, t.tv_sec, &v);
+	}
+	/* Free all results at once */
+	rspamd_reply_free (&reply);
+	rspamd_reply_free (&hreply);
+	if (file != priv->file) {
+		unlink (file);
+	}
+	if (!extra) {
+		scan_sched_leave (cfg->spamd_sched);
+	}
 
 	return res_action;
 }
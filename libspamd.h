@@ -39,6 +39,7 @@
 #else
 #include "queue.h"
 #endif
+#include "rspamd.h"
 
 
 struct config_file;
@@ -46,32 +47,4 @@ struct mlfi_priv;
 
 int spamdscan(SMFICTX *ctx, struct mlfi_priv *priv, struct config_file *cfg, char **subject, int is_extra);
 
-/* Structure for rspamd results */
-enum rspamd_metric_action {
-	METRIC_ACTION_NOACTION = 0,
-	METRIC_ACTION_GREYLIST,
-	METRIC_ACTION_ADD_HEADER,
-	METRIC_ACTION_REWRITE_SUBJECT,
-	METRIC_ACTION_REJECT
-};
-
-struct rspamd_symbol {
-	char *symbol;
-	double score;
-	TAILQ_ENTRY(rspamd_symbol) entry;
-};
-
-struct rspamd_metric_result {
-	char *metric_name;
-	double score;
-	double required_score;
-	double reject_score;
-	enum rspamd_metric_action action;
-	char *subject;
-	TAILQ_HEAD (symbolq, rspamd_symbol) symbols;
-	TAILQ_ENTRY (rspamd_metric_result) entry;
-};
-
-typedef TAILQ_HEAD(metricsq, rspamd_metric_result) rspamd_result_t;
-
 #endif
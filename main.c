@@ -44,6 +44,8 @@
 #include <libmilter/mfapi.h>
 #include "cfg_file.h"
 #include "rmilter.h"
+#include "regexp.h"
+#include "shadow.h"
 
 /* config options here... */
 
@@ -52,6 +54,8 @@ extern struct smfiDesc smfilter;
 
 pthread_cond_t cfg_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t cfg_reload_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t profile_cond = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t profile_mtx = PTHREAD_MUTEX_INITIALIZER;
 /* R/W lock for reconfiguring milter */
 pthread_rwlock_t cfg_mtx = PTHREAD_RWLOCK_INITIALIZER;
 
@@ -153,14 +157,32 @@ reload_thread (void *unused)
 		}
 		/* Sort spf domains array */
 		qsort ((void *)cfg->spf_domains, cfg->spf_domains_num, sizeof (char *), my_strcmp);
+		/* Load lists of networks, unchanged ones are taken from old config */
+		load_ip_lists (cfg, tmp);
+		regexp_init_rules (cfg);
 		/* Init awl */
 		if (cfg->awl_enable) {
-			cfg->awl_hash = awl_init (cfg->awl_pool_size, cfg->awl_max_hits, cfg->awl_ttl);
+			cfg->awl_hash = awl_init (cfg->awl_pool_size, cfg->awl_max_hits, cfg->awl_ttl, cfg->awl_ipv6_prefix,
+				cfg->awl_file, cfg->awl_shm);
 			if (cfg->awl_hash == NULL) {
 				msg_warn ("cannot init awl");
 				cfg->awl_enable = 0;
 			}
 		}
+		/* Init verdict cache */
+		if (cfg->verdict_cache_size != 0) {
+			cfg->verdict_cache = verdict_init (cfg->verdict_cache_size, cfg->verdict_cache_ttl, cfg->verdict_cache_key);
+			if (cfg->verdict_cache == NULL) {
+				msg_warn ("cannot init verdict cache");
+			}
+		}
+		/* Init scan schedulers */
+		if (cfg->clamav_max_scans != 0) {
+			cfg->clamav_sched = scan_sched_init ("clamav", cfg->clamav_max_scans, cfg->clamav_queue_timeout);
+		}
+		if (cfg->spamd_max_scans != 0) {
+			cfg->spamd_sched = scan_sched_init ("spamd", cfg->spamd_max_scans, cfg->spamd_queue_timeout);
+		}
 #ifdef HAVE_SRANDOMDEV
    		srandomdev();
 #else
@@ -175,6 +197,76 @@ reload_thread (void *unused)
 	return NULL;
 }
 
+static void
+sig_usr2_handler (int signo)
+{
+	pthread_cond_signal(&profile_cond);
+}
+
+static void *
+profile_thread (void *unused)
+{
+	FILE *f;
+	const char *path;
+	struct sigaction signals;
+
+	bzero (&signals, sizeof (struct sigaction));
+	sigemptyset(&signals.sa_mask);
+	sigaddset(&signals.sa_mask, SIGUSR2);
+	signals.sa_handler = sig_usr2_handler;
+	sigaction (SIGUSR2, &signals, NULL);
+
+	msg_info ("profile_thread: starting...");
+
+	/* Dump rules statistic on each SIGUSR2 */
+	while (1) {
+		pthread_mutex_lock(&profile_mtx);
+		pthread_cond_wait(&profile_cond, &profile_mtx);
+		pthread_mutex_unlock(&profile_mtx);
+
+		CFG_RLOCK();
+		path = cfg->rules_profile_file ? cfg->rules_profile_file : DEFAULT_RULES_PROFILE_FILE;
+		f = fopen (path, "w");
+		if (f == NULL) {
+			msg_warn ("profile_thread: cannot open file %s, %m", path);
+			CFG_UNLOCK();
+			continue;
+		}
+		if (regexp_profile_dump (cfg, f) == -1) {
+			msg_warn ("profile_thread: cannot dump rules statistic");
+		}
+		else {
+			msg_info ("profile_thread: rules statistic is written to %s", path);
+		}
+		CFG_UNLOCK();
+		fclose (f);
+	}
+	return NULL;
+}
+
+static void *
+awl_sync_thread (void *unused)
+{
+	unsigned int interval;
+
+	msg_info ("awl_sync_thread: starting...");
+
+	while (1) {
+		CFG_RLOCK();
+		interval = cfg->awl_sync_interval;
+		CFG_UNLOCK();
+		sleep (interval > 0 ? interval : DEFAULT_AWL_SYNC_INTERVAL);
+
+		/* Write awl snapshot to disk */
+		CFG_RLOCK();
+		if (cfg->awl_enable && cfg->awl_hash != NULL) {
+			awl_sync (cfg->awl_hash, 0);
+		}
+		CFG_UNLOCK();
+	}
+	return NULL;
+}
+
 int 
 main(int argc, char *argv[])
 {
@@ -184,7 +276,7 @@ main(int argc, char *argv[])
     const char *args = "c:h";
 	char *cfg_file = NULL;
 	FILE *f;
-	pthread_t reload_thr;
+	pthread_t reload_thr, awl_sync_thr, profile_thr;
 
     /* Process command line options */
     while ((c = getopt(argc, argv, args)) != -1) {
@@ -254,15 +346,34 @@ main(int argc, char *argv[])
 	/* Sort spf domains array */
 	qsort ((void *)cfg->spf_domains, cfg->spf_domains_num, sizeof (char *), my_strcmp);
 
+	load_ip_lists (cfg, NULL);
+	regexp_init_rules (cfg);
+
 	/* Init awl */
 	if (cfg->awl_enable) {
-		cfg->awl_hash = awl_init (cfg->awl_pool_size, cfg->awl_max_hits, cfg->awl_ttl);
+		cfg->awl_hash = awl_init (cfg->awl_pool_size, cfg->awl_max_hits, cfg->awl_ttl, cfg->awl_ipv6_prefix,
+				cfg->awl_file, cfg->awl_shm);
 		if (cfg->awl_hash == NULL) {
 			msg_warn ("cannot init awl");
 			cfg->awl_enable = 0;
 		}
 	}
 
+	/* Init verdict cache */
+	if (cfg->verdict_cache_size != 0) {
+		cfg->verdict_cache = verdict_init (cfg->verdict_cache_size, cfg->verdict_cache_ttl, cfg->verdict_cache_key);
+		if (cfg->verdict_cache == NULL) {
+			msg_warn ("cannot init verdict cache");
+		}
+	}
+	/* Init scan schedulers */
+	if (cfg->clamav_max_scans != 0) {
+		cfg->clamav_sched = scan_sched_init ("clamav", cfg->clamav_max_scans, cfg->clamav_queue_timeout);
+	}
+	if (cfg->spamd_max_scans != 0) {
+		cfg->spamd_sched = scan_sched_init ("spamd", cfg->spamd_max_scans, cfg->spamd_queue_timeout);
+	}
+
 #ifdef HAVE_SRANDOMDEV
    	srandomdev();
 #else
@@ -285,9 +396,28 @@ main(int argc, char *argv[])
 	if (pthread_create (&reload_thr, NULL, reload_thread, NULL)) {
 		msg_warn ("main: cannot start reload thread, ignoring error");
 	}
+	if (pthread_create (&awl_sync_thr, NULL, awl_sync_thread, NULL)) {
+		msg_warn ("main: cannot start awl sync thread, ignoring error");
+	}
+	if (pthread_create (&profile_thr, NULL, profile_thread, NULL)) {
+		msg_warn ("main: cannot start profile thread, ignoring error");
+	}
+	if (shadow_start () == -1) {
+		msg_warn ("main: cannot start shadow scan threads, ignoring error");
+	}
 
     r = smfi_main();
 
+	/* Remove messages left in shadow queue */
+	shadow_destroy ();
+
+	/* Save awl snapshot on shutdown */
+	CFG_RLOCK();
+	if (cfg->awl_enable && cfg->awl_hash != NULL) {
+		awl_sync (cfg->awl_hash, 1);
+	}
+	CFG_UNLOCK();
+
 	if (cfg_file != NULL) free (cfg_file);
 
     return r;
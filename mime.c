@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+static void
+reset_part (struct mime_parser *mp)
+{
+	/* Default content type of a part without headers */
+	strcpy (mp->ctype, "text/plain");
+	mp->boundary[0] = '\0';
+	mp->encoding = MIME_ENC_IDENTITY;
+	mp->header_len = 0;
+}
+
+struct mime_parser *
+mime_parser_new (void)
+{
+	struct mime_parser *mp;
+
+	mp = malloc (sizeof (struct mime_parser));
+	if (mp == NULL) {
+		return NULL;
+	}
+	bzero (mp, sizeof (struct mime_parser));
+	reset_part (mp);
+
+	return mp;
+}
+
+static void
+parse_content_type (struct mime_parser *mp, const char *value)
+{
+	const char *p = value, *c;
+	size_t len = 0;
+
+	while (*p == ' ' || *p == '\t') {
+		p ++;
+	}
+	while (*p && *p != ';' && !isspace ((unsigned char)*p) && len < sizeof (mp->ctype) - 1) {
+		mp->ctype[len++] = tolower ((unsigned char)*p++);
+	}
+	mp->ctype[len] = '\0';
+
+	/* Parameters */
+	while ((p = strchr (p, ';')) != NULL) {
+		p ++;
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			p ++;
+		}
+		if (strncasecmp (p, "boundary=", sizeof ("boundary=") - 1) != 0) {
+			continue;
+		}
+		p += sizeof ("boundary=") - 1;
+		len = 0;
+		if (*p == '"') {
+			p ++;
+			c = strchr (p, '"');
+			len = c ? (size_t)(c - p) : strlen (p);
+		}
+		else {
+			while (p[len] && p[len] != ';' && !isspace ((unsigned char)p[len])) {
+				len ++;
+			}
+		}
+		if (len > 0 && len <= MIME_BOUNDARY_MAX) {
+			memcpy (mp->boundary, p, len);
+			mp->boundary[len] = '\0';
+		}
+		break;
+	}
+}
+
+void
+mime_header (struct mime_parser *mp, const char *name, const char *value)
+{
+	const char *p = value;
+
+	if (strcasecmp (name, "Content-Type") == 0) {
+		parse_content_type (mp, value);
+	}
+	else if (strcasecmp (name, "Content-Transfer-Encoding") == 0) {
+		while (*p == ' ' || *p == '\t') {
+			p ++;
+		}
+		if (strncasecmp (p, "base64", sizeof ("base64") - 1) == 0) {
+			mp->encoding = MIME_ENC_BASE64;
+		}
+		else if (strncasecmp (p, "quoted-printable", sizeof ("quoted-printable") - 1) == 0) {
+			mp->encoding = MIME_ENC_QP;
+		}
+		else {
+			mp->encoding = MIME_ENC_IDENTITY;
+		}
+	}
+}
+
+static void
+finish_header (struct mime_parser *mp)
+{
+	char *c;
+
+	if (mp->header_len > 0) {
+		mp->header[mp->header_len] = '\0';
+		if ((c = strchr (mp->header, ':')) != NULL) {
+			*c++ = '\0';
+			mime_header (mp, mp->header, c);
+		}
+		mp->header_len = 0;
+	}
+}
+
+static void
+start_body (struct mime_parser *mp)
+{
+	if (strncmp (mp->ctype, "multipart/", sizeof ("multipart/") - 1) == 0) {
+		if (mp->boundary[0] != '\0' && mp->depth < MIME_DEPTH_MAX) {
+			strcpy (mp->boundaries[mp->depth++], mp->boundary);
+		}
+		/* Preamble */
+		mp->state = MIME_STATE_SKIP;
+	}
+	else if (strcmp (mp->ctype, "message/rfc822") == 0) {
+		reset_part (mp);
+		mp->state = MIME_STATE_HEADERS;
+	}
+	else if (strncmp (mp->ctype, "text/", sizeof ("text/") - 1) == 0) {
+		mp->part_len = 0;
+		mp->b64_bits = 0;
+		mp->b64_count = 0;
+		mp->state = MIME_STATE_TEXT;
+	}
+	else {
+		mp->state = MIME_STATE_SKIP;
+	}
+}
+
+static void
+out_append (struct mime_parser *mp, const char *data, size_t len)
+{
+	char *tmp;
+
+	if (mp->part_len + len > MIME_PART_MAX) {
+		len = MIME_PART_MAX - mp->part_len;
+	}
+	if (len == 0) {
+		return;
+	}
+	if (mp->out_len + len > mp->out_size) {
+		tmp = realloc (mp->out, mp->out_len + len + MIME_LINE_MAX);
+		if (tmp == NULL) {
+			return;
+		}
+		mp->out = tmp;
+		mp->out_size = mp->out_len + len + MIME_LINE_MAX;
+	}
+	memcpy (mp->out + mp->out_len, data, len);
+	mp->out_len += len;
+	mp->part_len += len;
+}
+
+static const signed char b64_table[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+	52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+	-1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+	15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+	-1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+	41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static int
+hex_value (char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+
+	return -1;
+}
+
+static void
+decode_line (struct mime_parser *mp, const char *line, size_t len, int nl)
+{
+	char buf[MIME_LINE_MAX + 1];
+	size_t i, olen = 0;
+	int v, hi, lo;
+
+	switch (mp->encoding) {
+	case MIME_ENC_BASE64:
+		for (i = 0; i < len; i++) {
+			if (line[i] == '=') {
+				if (mp->b64_count == 2) {
+					buf[olen++] = (mp->b64_bits >> 4) & 0xff;
+				}
+				else if (mp->b64_count == 3) {
+					buf[olen++] = (mp->b64_bits >> 10) & 0xff;
+					buf[olen++] = (mp->b64_bits >> 2) & 0xff;
+				}
+				mp->b64_count = 0;
+				mp->b64_bits = 0;
+				break;
+			}
+			if ((v = b64_table[(unsigned char)line[i]]) == -1) {
+				continue;
+			}
+			mp->b64_bits = (mp->b64_bits << 6) | v;
+			if (++mp->b64_count == 4) {
+				buf[olen++] = (mp->b64_bits >> 16) & 0xff;
+				buf[olen++] = (mp->b64_bits >> 8) & 0xff;
+				buf[olen++] = mp->b64_bits & 0xff;
+				mp->b64_count = 0;
+				mp->b64_bits = 0;
+			}
+		}
+		break;
+	case MIME_ENC_QP:
+		/* Trailing whitespace is not a part of encoded line */
+		while (nl && len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) {
+			len --;
+		}
+		for (i = 0; i < len; i++) {
+			if (line[i] != '=') {
+				buf[olen++] = line[i];
+			}
+			else if (i == len - 1) {
+				/* Soft line break */
+				nl = 0;
+			}
+			else if (i + 2 < len && (hi = hex_value (line[i + 1])) != -1
+					&& (lo = hex_value (line[i + 2])) != -1) {
+				buf[olen++] = (hi << 4) | lo;
+				i += 2;
+			}
+			else {
+				buf[olen++] = line[i];
+			}
+		}
+		if (nl) {
+			buf[olen++] = '\n';
+		}
+		break;
+	default:
+		memcpy (buf, line, len);
+		olen = len;
+		if (nl) {
+			buf[olen++] = '\n';
+		}
+		break;
+	}
+
+	out_append (mp, buf, olen);
+}
+
+static int
+check_boundary (struct mime_parser *mp, const char *line, size_t len)
+{
+	size_t blen, pos;
+	int i, closing;
+
+	if (mp->depth == 0 || len < 2 || line[0] != '-' || line[1] != '-') {
+		return 0;
+	}
+	for (i = mp->depth - 1; i >= 0; i--) {
+		blen = strlen (mp->boundaries[i]);
+		if (len < blen + 2 || memcmp (line + 2, mp->boundaries[i], blen) != 0) {
+			continue;
+		}
+		/* Boundary may be followed only by "--" and trailing whitespace */
+		pos = blen + 2;
+		closing = len >= blen + 4 && line[pos] == '-' && line[pos + 1] == '-';
+		if (closing) {
+			pos += 2;
+		}
+		while (pos < len && isspace ((u_char)line[pos])) {
+			pos ++;
+		}
+		if (pos != len) {
+			continue;
+		}
+		if (mp->state == MIME_STATE_TEXT && mp->part_len > 0) {
+			/* Do not glue text of adjacent parts */
+			out_append (mp, "\n", 1);
+		}
+		if (closing) {
+			/* Closing boundary, skip epilogue of this multipart */
+			mp->depth = i;
+			mp->state = MIME_STATE_SKIP;
+		}
+		else {
+			mp->depth = i + 1;
+			reset_part (mp);
+			mp->state = MIME_STATE_HEADERS;
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+process_line (struct mime_parser *mp, const char *line, size_t len, int nl)
+{
+	size_t n;
+
+	if (nl && len > 0 && line[len - 1] == '\r') {
+		len --;
+	}
+	if (check_boundary (mp, line, len)) {
+		return;
+	}
+
+	switch (mp->state) {
+	case MIME_STATE_HEADERS:
+		if (len == 0) {
+			finish_header (mp);
+			start_body (mp);
+		}
+		else {
+			if (line[0] != ' ' && line[0] != '\t') {
+				finish_header (mp);
+			}
+			n = MIME_HEADER_MAX - 1 - mp->header_len;
+			if (len < n) {
+				n = len;
+			}
+			memcpy (mp->header + mp->header_len, line, n);
+			mp->header_len += n;
+		}
+		break;
+	case MIME_STATE_TEXT:
+		decode_line (mp, line, len, nl);
+		break;
+	default:
+		break;
+	}
+}
+
+void
+mime_feed (struct mime_parser *mp, const char *data, size_t len)
+{
+	const char *p = data, *end = data + len, *nl;
+	size_t n;
+
+	if (mp->state == MIME_STATE_TOP) {
+		/* Message headers were passed by mime_header */
+		start_body (mp);
+	}
+
+	while (p < end) {
+		nl = memchr (p, '\n', end - p);
+		n = (nl != NULL ? nl : end) - p;
+		if (n > MIME_LINE_MAX - mp->line_len) {
+			n = MIME_LINE_MAX - mp->line_len;
+			nl = NULL;
+		}
+		memcpy (mp->line + mp->line_len, p, n);
+		mp->line_len += n;
+		p += n;
+		if (nl != NULL) {
+			process_line (mp, mp->line, mp->line_len, 1);
+			mp->line_len = 0;
+			p ++;
+		}
+		else if (mp->line_len == MIME_LINE_MAX) {
+			/* Too long line is processed by pieces */
+			process_line (mp, mp->line, mp->line_len, 0);
+			mp->line_len = 0;
+		}
+	}
+}
+
+void
+mime_end (struct mime_parser *mp)
+{
+	if (mp->state == MIME_STATE_TOP) {
+		start_body (mp);
+	}
+	if (mp->line_len > 0) {
+		process_line (mp, mp->line, mp->line_len, 0);
+		mp->line_len = 0;
+	}
+}
+
+void
+mime_parser_free (struct mime_parser *mp)
+{
+	if (mp->out != NULL) {
+		free (mp->out);
+	}
+	free (mp);
+}
+
+/* 
+ * vi:ts=4 
+ */
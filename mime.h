@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MIME_H
+#define MIME_H
+
+#include <sys/types.h>
+
+#define MIME_LINE_MAX 4096
+#define MIME_HEADER_MAX 1024
+#define MIME_BOUNDARY_MAX 72
+#define MIME_DEPTH_MAX 8
+/* Only beginning of each text part is decoded */
+#define MIME_PART_MAX 512 * 1024
+
+enum mime_state {
+	MIME_STATE_TOP = 0,
+	MIME_STATE_HEADERS,
+	MIME_STATE_TEXT,
+	MIME_STATE_SKIP
+};
+
+enum mime_encoding {
+	MIME_ENC_IDENTITY = 0,
+	MIME_ENC_BASE64,
+	MIME_ENC_QP
+};
+
+/*
+ * Incremental MIME parser: message body is fed by chunks, text parts are
+ * decoded to out buffer that is emptied by caller, other parts are skipped
+ */
+struct mime_parser {
+	enum mime_state state;
+	char line[MIME_LINE_MAX];
+	size_t line_len;
+	char header[MIME_HEADER_MAX];
+	size_t header_len;
+
+	/* Current part */
+	char ctype[64];
+	char boundary[MIME_BOUNDARY_MAX + 1];
+	enum mime_encoding encoding;
+	size_t part_len;
+	unsigned int b64_bits;
+	int b64_count;
+
+	char boundaries[MIME_DEPTH_MAX][MIME_BOUNDARY_MAX + 1];
+	int depth;
+
+	char *out;
+	size_t out_len;
+	size_t out_size;
+};
+
+struct mime_parser * mime_parser_new (void);
+void mime_header (struct mime_parser *mp, const char *name, const char *value);
+void mime_feed (struct mime_parser *mp, const char *data, size_t len);
+void mime_end (struct mime_parser *mp);
+void mime_parser_free (struct mime_parser *mp);
+
+#endif
+/* 
+ * vi:ts=4 
+ */
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "prefilter.h"
+
+#define LOWER(c) (((c) >= 'A' && (c) <= 'Z') ? (c) - 'A' + 'a' : (c))
+
+/* Escapes that match some class of characters or an empty string */
+static const char class_escapes[] = "dDwWsSbBAzZGhHvVRXCK";
+
+static const char *
+skip_class (const char *p)
+{
+	const char *q;
+
+	if (*p == '^') {
+		p ++;
+	}
+	if (*p == ']') {
+		p ++;
+	}
+	while (*p && *p != ']') {
+		if (*p == '\\' && p[1] != '\0') {
+			p += 2;
+		}
+		else if (*p == '[' && p[1] == ':' && (q = strstr (p + 2, ":]")) != NULL) {
+			p = q + 2;
+		}
+		else {
+			p ++;
+		}
+	}
+
+	return *p ? p + 1 : NULL;
+}
+
+static const char *
+skip_group (const char *p)
+{
+	int depth = 1;
+
+	while (*p) {
+		if (*p == '\\') {
+			if (p[1] == '\0') {
+				return NULL;
+			}
+			p += 2;
+			continue;
+		}
+		else if (*p == '[') {
+			if ((p = skip_class (p + 1)) == NULL) {
+				return NULL;
+			}
+			continue;
+		}
+		else if (*p == '(') {
+			depth ++;
+		}
+		else if (*p == ')' && --depth == 0) {
+			return p + 1;
+		}
+		p ++;
+	}
+
+	return NULL;
+}
+
+static const char *
+skip_quantifier (const char *p, int *min_zero)
+{
+	const char *q;
+
+	if (*p == '*' || *p == '?') {
+		*min_zero = 1;
+		p ++;
+	}
+	else if (*p == '+') {
+		*min_zero = 0;
+		p ++;
+	}
+	else if (*p == '{' && isdigit ((unsigned char)p[1])) {
+		q = p + 1;
+		*min_zero = 1;
+		while (isdigit ((unsigned char)*q)) {
+			if (*q != '0') {
+				*min_zero = 0;
+			}
+			q ++;
+		}
+		if (*q == ',') {
+			q ++;
+			while (isdigit ((unsigned char)*q)) {
+				q ++;
+			}
+		}
+		if (*q != '}') {
+			/* Not a quantifier, but literal brace */
+			return NULL;
+		}
+		p = q + 1;
+	}
+	else {
+		return NULL;
+	}
+	/* Lazy and possessive forms */
+	if (*p == '?' || *p == '+') {
+		p ++;
+	}
+
+	return p;
+}
+
+/*
+ * Find the longest literal that any string matched by re must contain, the
+ * literal is lowercased and written to buf. Returns 0 if pattern has
+ * alternatives or constructs that are not understood here.
+ */
+size_t
+prefilter_extract_literal (const char *re, char *buf, size_t buflen)
+{
+	char run[PREFILTER_MAX_LITERAL];
+	size_t runlen = 0, best = 0;
+	const char *p = re, *q;
+	int literal, min_zero = 0;
+	unsigned char c = 0;
+
+	if (strstr (re, "\\Q") != NULL) {
+		return 0;
+	}
+
+	while (*p) {
+		literal = 0;
+		switch (*p) {
+		case '\\':
+			if (p[1] == '\0') {
+				return 0;
+			}
+			if (isalnum ((unsigned char)p[1])) {
+				/* Backreferences, hex and octal codes and so on */
+				if (strchr (class_escapes, p[1]) == NULL) {
+					return 0;
+				}
+			}
+			else {
+				c = p[1];
+				literal = c < 0x80;
+			}
+			p += 2;
+			break;
+		case '[':
+			if ((p = skip_class (p + 1)) == NULL) {
+				return 0;
+			}
+			break;
+		case '(':
+			if (p[1] == '?') {
+				/* (?x) changes meaning of whitespace in the rest of pattern */
+				for (q = p + 2; isalpha ((unsigned char)*q) || *q == '-'; q ++) {
+					if (*q == 'x') {
+						return 0;
+					}
+				}
+			}
+			if ((p = skip_group (p + 1)) == NULL) {
+				return 0;
+			}
+			break;
+		case '|':
+			return 0;
+		case '.':
+		case '^':
+		case '$':
+			p ++;
+			break;
+		default:
+			c = *p++;
+			/* Case folding of non ascii characters depends on pcre options */
+			literal = c < 0x80;
+			break;
+		}
+
+		q = skip_quantifier (p, &min_zero);
+		if (q != NULL) {
+			p = q;
+		}
+		if (literal && (q == NULL || !min_zero) && runlen < sizeof (run)) {
+			run[runlen++] = LOWER (c);
+		}
+		if (!literal || q != NULL) {
+			if (runlen > best && runlen < buflen) {
+				memcpy (buf, run, runlen);
+				best = runlen;
+			}
+			runlen = 0;
+		}
+	}
+	if (runlen > best && runlen < buflen) {
+		memcpy (buf, run, runlen);
+		best = runlen;
+	}
+	if (buflen > 0) {
+		buf[best] = '\0';
+	}
+
+	return best;
+}
+
+struct prefilter *
+prefilter_new (void)
+{
+	struct prefilter *pf;
+
+	pf = malloc (sizeof (struct prefilter));
+	if (pf == NULL) {
+		return NULL;
+	}
+	bzero (pf, sizeof (struct prefilter));
+
+	return pf;
+}
+
+/* Returns id of literal that is set in found bitmap by prefilter_scan */
+int
+prefilter_add (struct prefilter *pf, const char *literal, size_t len)
+{
+	unsigned int i;
+	void *tmp;
+
+	if (pf->trans != NULL || len == 0) {
+		return -1;
+	}
+	for (i = 0; i < pf->count; i++) {
+		if (pf->lens[i] == len && strncasecmp (pf->literals[i], literal, len) == 0) {
+			return i;
+		}
+	}
+	if (pf->count == pf->allocated) {
+		pf->allocated = pf->allocated ? pf->allocated * 2 : 32;
+		if ((tmp = realloc (pf->literals, pf->allocated * sizeof (char *))) == NULL) {
+			return -1;
+		}
+		pf->literals = tmp;
+		if ((tmp = realloc (pf->lens, pf->allocated * sizeof (size_t))) == NULL) {
+			return -1;
+		}
+		pf->lens = tmp;
+	}
+	if ((pf->literals[pf->count] = malloc (len)) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < len; i++) {
+		pf->literals[pf->count][i] = LOWER (literal[i]);
+	}
+	pf->lens[pf->count] = len;
+
+	return pf->count ++;
+}
+
+/*
+ * Build automaton with all transitions resolved, so scan costs one table
+ * lookup per byte. Bytes that do not occur in literals share class 0.
+ */
+int
+prefilter_compile (struct prefilter *pf)
+{
+	unsigned int i, j, cl, s, t, max_states, *queue, qhead = 0, qtail = 0;
+	uint32_t *fail;
+	unsigned char c;
+
+	pf->classes = 1;
+	max_states = 1;
+	for (i = 0; i < pf->count; i++) {
+		for (j = 0; j < pf->lens[i]; j++) {
+			c = pf->literals[i][j];
+			if (pf->classmap[c] == 0) {
+				pf->classmap[c] = pf->classes ++;
+				if (c >= 'a' && c <= 'z') {
+					pf->classmap[c - 'a' + 'A'] = pf->classmap[c];
+				}
+			}
+		}
+		max_states += pf->lens[i];
+	}
+
+	pf->trans = calloc ((size_t)max_states * pf->classes, sizeof (uint32_t));
+	pf->out = malloc (max_states * sizeof (int32_t));
+	pf->dict = calloc (max_states, sizeof (uint32_t));
+	fail = calloc (max_states, sizeof (uint32_t));
+	queue = malloc (max_states * sizeof (unsigned int));
+	if (pf->trans == NULL || pf->out == NULL || pf->dict == NULL || fail == NULL || queue == NULL) {
+		free (fail);
+		free (queue);
+		return -1;
+	}
+	for (i = 0; i < max_states; i++) {
+		pf->out[i] = -1;
+	}
+
+	/* Trie of literals */
+	pf->states = 1;
+	for (i = 0; i < pf->count; i++) {
+		s = 0;
+		for (j = 0; j < pf->lens[i]; j++) {
+			cl = pf->classmap[(unsigned char)pf->literals[i][j]];
+			if (pf->trans[s * pf->classes + cl] == 0) {
+				pf->trans[s * pf->classes + cl] = pf->states ++;
+			}
+			s = pf->trans[s * pf->classes + cl];
+		}
+		pf->out[s] = i;
+	}
+
+	/* Failure links in breadth first order, missing edges are replaced by edges of failure state */
+	for (cl = 0; cl < pf->classes; cl++) {
+		if ((t = pf->trans[cl]) != 0) {
+			queue[qtail++] = t;
+		}
+	}
+	while (qhead < qtail) {
+		s = queue[qhead++];
+		for (cl = 0; cl < pf->classes; cl++) {
+			t = pf->trans[s * pf->classes + cl];
+			if (t != 0) {
+				fail[t] = pf->trans[fail[s] * pf->classes + cl];
+				pf->dict[t] = pf->out[fail[t]] >= 0 ? fail[t] : pf->dict[fail[t]];
+				queue[qtail++] = t;
+			}
+			else {
+				pf->trans[s * pf->classes + cl] = pf->trans[fail[s] * pf->classes + cl];
+			}
+		}
+	}
+
+	free (fail);
+	free (queue);
+
+	return 0;
+}
+
+/* Set bits of all literals found in data, found must be PREFILTER_BYTES long */
+void
+prefilter_scan (const struct prefilter *pf, const char *data, size_t len, unsigned char *found)
+{
+	const unsigned char *p = (const unsigned char *)data, *end = p + len;
+	uint32_t s = 0, o;
+
+	while (p < end) {
+		s = pf->trans[s * pf->classes + pf->classmap[*p++]];
+		for (o = s; o != 0; o = pf->dict[o]) {
+			if (pf->out[o] >= 0) {
+				found[pf->out[o] / 8] |= 1 << (pf->out[o] % 8);
+			}
+		}
+	}
+}
+
+void
+prefilter_free (struct prefilter *pf)
+{
+	unsigned int i;
+
+	for (i = 0; i < pf->count; i++) {
+		free (pf->literals[i]);
+	}
+	free (pf->literals);
+	free (pf->lens);
+	free (pf->trans);
+	free (pf->out);
+	free (pf->dict);
+	free (pf);
+}
+
+/* 
+ * vi:ts=4 
+ */
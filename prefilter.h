@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PREFILTER_H
+#define PREFILTER_H
+
+#include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+/* Shorter literals are too common to skip anything */
+#define PREFILTER_MIN_LITERAL 3
+#define PREFILTER_MAX_LITERAL 64
+
+/*
+ * Case insensitive multi-literal scanner (Aho-Corasick automaton), used to
+ * skip regexps whose required literal is not found in matched string
+ */
+struct prefilter {
+	char **literals;
+	size_t *lens;
+	unsigned int count;
+	unsigned int allocated;
+
+	unsigned char classmap[256];
+	unsigned int classes;
+	uint32_t *trans;
+	int32_t *out;
+	uint32_t *dict;
+	unsigned int states;
+};
+
+#define PREFILTER_BYTES(pf) (((pf)->count + 7) / 8)
+#define PREFILTER_ISSET(found, id) (((found)[(id) / 8] & (1 << ((id) % 8))) != 0)
+
+size_t prefilter_extract_literal (const char *re, char *buf, size_t buflen);
+struct prefilter * prefilter_new (void);
+int prefilter_add (struct prefilter *pf, const char *literal, size_t len);
+int prefilter_compile (struct prefilter *pf);
+void prefilter_scan (const struct prefilter *pf, const char *data, size_t len, unsigned char *found);
+void prefilter_free (struct prefilter *pf);
+
+#endif
+/* 
+ * vi:ts=4 
+ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Compare lookups in radix tree and multibit trie, usage: radix-bench [prefixes] [lookups]
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "radix.h"
+
+#define PREFIXES 100000
+#define LOOKUPS 10000000
+
+static double
+get_ticks (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static uint32_t
+random32 (void)
+{
+	return ((uint32_t)random () << 16) ^ (uint32_t)random ();
+}
+
+int 
+main (int argc, char **argv)
+{
+	radix_tree_t *tree;
+	radix_mb_tree_t *mb_tree;
+	uint32_t *prefixes, *keys, key, mask;
+	int prefixes_num = PREFIXES, lookups = LOOKUPS, i, masklen, found = 0, errors = 0;
+	unsigned char r1, r2;
+	double start, t1, t2;
+
+	if (argc > 1) {
+		prefixes_num = atoi (argv[1]);
+	}
+	if (argc > 2) {
+		lookups = atoi (argv[2]);
+	}
+
+	srandom (1);
+	tree = radix_tree_create ();
+	mb_tree = radix_mb_tree_create (32);
+	prefixes = malloc (prefixes_num * sizeof (uint32_t));
+	keys = malloc (lookups * sizeof (uint32_t));
+	if (tree == NULL || mb_tree == NULL || prefixes == NULL || keys == NULL) {
+		printf ("Cannot allocate memory\n");
+		return 1;
+	}
+
+	/* Mostly /24 networks with some wider and host ones */
+	for (i = 0; i < prefixes_num; i++) {
+		switch (random () % 8) {
+		case 0:
+			masklen = 8 + random () % 16;
+			break;
+		case 1:
+			masklen = 32;
+			break;
+		default:
+			masklen = 24;
+			break;
+		}
+		mask = 0xffffffff << (32 - masklen);
+		key = random32 () & mask;
+		prefixes[i] = key;
+		radix32tree_insert (tree, key, mask, i % 250);
+		radix32_mb_insert (mb_tree, key, masklen, i % 250);
+	}
+
+	/* Half of lookups hit inserted networks */
+	for (i = 0; i < lookups; i++) {
+		if (i & 1) {
+			keys[i] = prefixes[random () % prefixes_num] | (random () & 0xff);
+		}
+		else {
+			keys[i] = random32 ();
+		}
+	}
+
+	for (i = 0; i < lookups; i++) {
+		r1 = radix32tree_find (tree, keys[i]);
+		r2 = radix32_mb_find (mb_tree, keys[i]);
+		if (r1 != r2) {
+			errors ++;
+		}
+		if (r1 != RADIX_NO_VALUE) {
+			found ++;
+		}
+	}
+	printf ("%d prefixes, %d lookups, %d found, %d mismatches\n", prefixes_num, lookups, found, errors);
+
+	start = get_ticks ();
+	for (i = 0; i < lookups; i++) {
+		found += radix32tree_find (tree, keys[i]);
+	}
+	t1 = get_ticks () - start;
+
+	start = get_ticks ();
+	for (i = 0; i < lookups; i++) {
+		found += radix32_mb_find (mb_tree, keys[i]);
+	}
+	t2 = get_ticks () - start;
+
+	printf ("radix32tree_find: %.1f ns per lookup, %lu bytes\n", t1 * 1e9 / lookups, (unsigned long)tree->size);
+	printf ("radix32_mb_find: %.1f ns per lookup, %lu bytes\n", t2 * 1e9 / lookups, (unsigned long)mb_tree->size);
+	/* Do not let compiler to drop lookups */
+	if (found == -1) {
+		printf ("\n");
+	}
+
+	radix_tree_free (tree);
+	radix_mb_tree_free (mb_tree);
+	free (prefixes);
+	free (keys);
+
+	return errors != 0;
+}
+
+/* 
+ * vi:ts=4 
+ */
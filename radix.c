@@ -26,6 +26,7 @@
 
 #include <sys/types.h>
 #include <stdlib.h>
+#include <strings.h>
 
 #include "radix.h"
 
@@ -264,6 +265,267 @@ radix_tree_free(radix_tree_t *tree)
 		free (tmp);
 	}
 }
+
+radix_mb_tree_t *
+radix_mb_tree_create(int bits)
+{
+	radix_mb_tree_t *tree;
+
+	if (bits != 32 && bits != 128) {
+		return NULL;
+	}
+
+	tree = malloc (sizeof (radix_mb_tree_t));
+	if (tree == NULL) {
+		return NULL;
+	}
+
+	tree->root = calloc (1 << RADIX_MB_ROOT_BITS, sizeof (radix_mb_slot_t));
+	if (tree->root == NULL) {
+		free (tree);
+		return NULL;
+	}
+	/* Node with index 0 is not used as 0 means no child */
+	tree->nodes_allocated = 64;
+	tree->nodes = calloc (tree->nodes_allocated, sizeof (radix_mb_slot_t) * RADIX_MB_NODE_SLOTS);
+	if (tree->nodes == NULL) {
+		free (tree->root);
+		free (tree);
+		return NULL;
+	}
+	tree->nodes_num = 1;
+	tree->bits = bits;
+	tree->size = (sizeof (radix_mb_slot_t) << RADIX_MB_ROOT_BITS) +
+			tree->nodes_allocated * sizeof (radix_mb_slot_t) * RADIX_MB_NODE_SLOTS;
+
+	return tree;
+}
+
+/* Get index in node at specified depth */
+static inline uint32_t
+radix_mb_index(const u_char *key, int depth)
+{
+	if (depth == 0) {
+		return (key[0] << 8) | key[1];
+	}
+	if (depth & 7) {
+		return key[depth >> 3] & 0xf;
+	}
+	return key[depth >> 3] >> 4;
+}
+
+static uint32_t
+radix_mb_alloc(radix_mb_tree_t *tree)
+{
+	radix_mb_slot_t *new;
+	size_t node_size = sizeof (radix_mb_slot_t) * RADIX_MB_NODE_SLOTS;
+
+	if (tree->nodes_num == tree->nodes_allocated) {
+		new = realloc (tree->nodes, tree->nodes_allocated * 2 * node_size);
+		if (new == NULL) {
+			return 0;
+		}
+		bzero (new + tree->nodes_allocated * RADIX_MB_NODE_SLOTS, tree->nodes_allocated * node_size);
+		tree->nodes = new;
+		tree->size += tree->nodes_allocated * node_size;
+		tree->nodes_allocated *= 2;
+	}
+
+	return tree->nodes_num ++;
+}
+
+/*
+ * Insert prefix, key is in network order. Prefix is expanded to all slots
+ * it covers in the node where it ends, longer prefixes win in these slots,
+ * or all prefixes are merged if is_mask is set.
+ * Returns 0 on success, 1 if prefix already exists and -1 on error
+ */
+static int
+radix_mb_insert_common(radix_mb_tree_t *tree, const u_char *key, int masklen,
+	unsigned char value, int is_mask)
+{
+	radix_mb_slot_t *node;
+	uint32_t cur = 0, idx, count, i, child;
+	int depth = 0, stride = RADIX_MB_ROOT_BITS;
+
+	if (masklen < 0 || masklen > tree->bits) {
+		return -1;
+	}
+
+	for (;;) {
+		node = cur == 0 ? tree->root : tree->nodes + cur * RADIX_MB_NODE_SLOTS;
+		idx = radix_mb_index (key, depth);
+
+		if (masklen <= depth + stride) {
+			count = 1 << (depth + stride - masklen);
+			idx &= ~(count - 1);
+			if (node[idx].set && node[idx].plen == masklen &&
+					(!is_mask || (node[idx].value & value) == value)) {
+				return 1;
+			}
+			for (i = idx; i < idx + count; i++) {
+				if (is_mask) {
+					node[i].value = node[i].set ? node[i].value | value : value;
+					if (!node[i].set || node[i].plen < masklen) {
+						node[i].plen = masklen;
+					}
+					node[i].set = 1;
+				}
+				else if (!node[i].set || node[i].plen < masklen) {
+					node[i].value = value;
+					node[i].plen = masklen;
+					node[i].set = 1;
+				}
+			}
+			return 0;
+		}
+
+		if (node[idx].child == 0) {
+			child = radix_mb_alloc (tree);
+			if (child == 0) {
+				return -1;
+			}
+			/* Nodes may be moved by realloc */
+			node = cur == 0 ? tree->root : tree->nodes + cur * RADIX_MB_NODE_SLOTS;
+			node[idx].child = child;
+		}
+		cur = node[idx].child;
+		depth += stride;
+		stride = RADIX_MB_STRIDE;
+	}
+}
+
+int
+radix_mb_insert(radix_mb_tree_t *tree, const u_char *key, int masklen,
+	unsigned char value)
+{
+	return radix_mb_insert_common (tree, key, masklen, value, 0);
+}
+
+int
+radix_mb_add_mask(radix_mb_tree_t *tree, const u_char *key, int masklen,
+	unsigned char bits)
+{
+	return radix_mb_insert_common (tree, key, masklen, bits, 1);
+}
+
+int
+radix32_mb_insert(radix_mb_tree_t *tree, uint32_t key, int masklen,
+	unsigned char value)
+{
+	u_char buf[4];
+
+	if (tree->bits != 32) {
+		return -1;
+	}
+	buf[0] = key >> 24;
+	buf[1] = key >> 16;
+	buf[2] = key >> 8;
+	buf[3] = key;
+
+	return radix_mb_insert (tree, buf, masklen, value);
+}
+
+unsigned char
+radix_mb_find(radix_mb_tree_t *tree, const u_char *key)
+{
+	radix_mb_slot_t *slot;
+	unsigned char value = RADIX_NO_VALUE;
+	int depth = RADIX_MB_ROOT_BITS;
+
+	slot = &tree->root[radix_mb_index (key, 0)];
+	for (;;) {
+		if (slot->set) {
+			value = slot->value;
+		}
+		if (slot->child == 0) {
+			break;
+		}
+		slot = &tree->nodes[slot->child * RADIX_MB_NODE_SLOTS + radix_mb_index (key, depth)];
+		depth += RADIX_MB_STRIDE;
+	}
+
+	return value;
+}
+
+/* Key is in host order like in radix32tree_find */
+unsigned char
+radix32_mb_find(radix_mb_tree_t *tree, uint32_t key)
+{
+	radix_mb_slot_t *slot;
+	unsigned char value = RADIX_NO_VALUE;
+	int shift = 32 - RADIX_MB_ROOT_BITS - RADIX_MB_STRIDE;
+
+	slot = &tree->root[key >> (32 - RADIX_MB_ROOT_BITS)];
+	for (;;) {
+		if (slot->set) {
+			value = slot->value;
+		}
+		if (slot->child == 0) {
+			break;
+		}
+		slot = &tree->nodes[slot->child * RADIX_MB_NODE_SLOTS +
+				((key >> shift) & (RADIX_MB_NODE_SLOTS - 1))];
+		shift -= RADIX_MB_STRIDE;
+	}
+
+	return value;
+}
+
+/* Masks of all prefixes on the path are merged */
+unsigned char
+radix32_mb_find_mask(radix_mb_tree_t *tree, uint32_t key)
+{
+	radix_mb_slot_t *slot;
+	unsigned char value = 0;
+	int shift = 32 - RADIX_MB_ROOT_BITS - RADIX_MB_STRIDE;
+
+	slot = &tree->root[key >> (32 - RADIX_MB_ROOT_BITS)];
+	for (;;) {
+		if (slot->set) {
+			value |= slot->value;
+		}
+		if (slot->child == 0) {
+			break;
+		}
+		slot = &tree->nodes[slot->child * RADIX_MB_NODE_SLOTS +
+				((key >> shift) & (RADIX_MB_NODE_SLOTS - 1))];
+		shift -= RADIX_MB_STRIDE;
+	}
+
+	return value;
+}
+
+unsigned char
+radix_mb_find_mask(radix_mb_tree_t *tree, const u_char *key)
+{
+	radix_mb_slot_t *slot;
+	unsigned char value = 0;
+	int depth = RADIX_MB_ROOT_BITS;
+
+	slot = &tree->root[radix_mb_index (key, 0)];
+	for (;;) {
+		if (slot->set) {
+			value |= slot->value;
+		}
+		if (slot->child == 0) {
+			break;
+		}
+		slot = &tree->nodes[slot->child * RADIX_MB_NODE_SLOTS + radix_mb_index (key, depth)];
+		depth += RADIX_MB_STRIDE;
+	}
+
+	return value;
+}
+
+void
+radix_mb_tree_free(radix_mb_tree_t *tree)
+{
+	free (tree->nodes);
+	free (tree->root);
+	free (tree);
+}
+
 /* 
  * vi:ts=4 
  */
@@ -61,4 +61,46 @@ int radix32tree_delete(radix_tree_t *tree,
 unsigned char radix32tree_find(radix_tree_t *tree, uint32_t key);
 void radix_tree_free(radix_tree_t *tree);
 
+/*
+ * Multibit trie for 32 and 128 bit keys: the first level is indexed by 16 bits
+ * of key and the next levels by 4 bits, so ipv4 lookup takes at most 5 steps.
+ * Nodes live in one contiguous array and refer to children by index.
+ */
+#define RADIX_MB_ROOT_BITS 16
+#define RADIX_MB_STRIDE 4
+#define RADIX_MB_NODE_SLOTS (1 << RADIX_MB_STRIDE)
+
+typedef struct radix_mb_slot_s {
+	/* Index of child node, 0 if there is no child */
+	uint32_t child;
+	unsigned char value;
+	/* Length of prefix that value belongs to */
+	unsigned char plen;
+	unsigned char set;
+} radix_mb_slot_t;
+
+typedef struct {
+	radix_mb_slot_t *root;
+	radix_mb_slot_t *nodes;
+	uint32_t nodes_num;
+	uint32_t nodes_allocated;
+	/* Key length, 32 or 128 */
+	int bits;
+	size_t size;
+} radix_mb_tree_t;
+
+radix_mb_tree_t *radix_mb_tree_create(int bits);
+int radix_mb_insert(radix_mb_tree_t *tree,
+    const u_char *key, int masklen, unsigned char value);
+int radix32_mb_insert(radix_mb_tree_t *tree,
+    uint32_t key, int masklen, unsigned char value);
+unsigned char radix_mb_find(radix_mb_tree_t *tree, const u_char *key);
+unsigned char radix32_mb_find(radix_mb_tree_t *tree, uint32_t key);
+/* Values are bitmasks, lookup returns union of all matching prefixes */
+int radix_mb_add_mask(radix_mb_tree_t *tree,
+    const u_char *key, int masklen, unsigned char bits);
+unsigned char radix_mb_find_mask(radix_mb_tree_t *tree, const u_char *key);
+unsigned char radix32_mb_find_mask(radix_mb_tree_t *tree, uint32_t key);
+void radix_mb_tree_free(radix_mb_tree_t *tree);
+
 #endif
@@ -102,13 +102,13 @@ extract_user_part (const char *str)
 }
 
 static int
-is_whitelisted (struct in_addr *addr, const char *rcpt, struct config_file *cfg)
+is_whitelisted (struct mlfi_priv *priv, const char *rcpt, struct config_file *cfg)
 {
 	if (is_whitelisted_rcpt (cfg, rcpt, 0) || is_whitelisted_rcpt (cfg, rcpt, 1)) {
 		return 1;
 	}
 	
-	if (radix32tree_find (cfg->limit_whitelist_tree, ntohl((uint32_t)addr->s_addr)) != RADIX_NO_VALUE) {
+	if (priv->ip_class & IP_CLASS_LIMIT_WHITELIST) {
 		return 2;
 	}
 
@@ -268,8 +268,8 @@ rate_check (struct mlfi_priv *priv, struct config_file *cfg, const char *rcpt, i
 	struct timeval tm;
 	int r;
 
-	if (priv->priv_addr.family == AF_INET &&
-			is_whitelisted (&priv->priv_addr.addr.sa4.sin_addr, rcpt, cfg) != 0) {
+	/* ip_class is empty for addresses that are not classified */
+	if (is_whitelisted (priv, rcpt, cfg) != 0) {
 		msg_info ("rate_check: address is whitelisted, skipping checks");
 		return 1;
 	}
@@ -0,0 +1,370 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measure rules matching from concurrent threads:
+ * regexp-bench [-l] [-n] [-p] [-r rules] [-m message] [max_threads] [iterations]
+ * -l serializes matching on a global mutex like old regexp_mtx did
+ * -n disables pcre_study and JIT
+ * -p disables literal prefilter
+ * -r loads rules from file, one per line: "header <name_re> <value_re>" or
+ *    "body <re>"
+ * -m takes headers and body from message file
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pcre.h"
+#include "cfg_file.h"
+#include "rmilter.h"
+#include "regexp.h"
+
+#define HEADER_RULES 100
+#define BODY_RULES 50
+#define MAX_THREADS 8
+#define ITERATIONS 2000
+#define MAX_HEADERS 64
+
+static struct config_file bench_cfg;
+static int use_lock = 0, use_study = 1, use_prefilter = 1, iterations = ITERATIONS;
+static int header_rules = 0, body_rules = 0;
+static pthread_mutex_t bench_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static char *header_names[MAX_HEADERS], *header_values[MAX_HEADERS];
+static int headers_num = 0;
+static char *body;
+static size_t body_len;
+
+static double
+get_ticks (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+static void
+compile (struct cond_arg *arg, const char *pattern)
+{
+	const char *err;
+	int off;
+
+	arg->literal = -1;
+	if (pattern == NULL) {
+		arg->empty = 1;
+		return;
+	}
+	arg->src = strdup (pattern);
+	arg->re = pcre_compile (pattern, 0, &err, &off, NULL);
+	if (arg->re == NULL) {
+		fprintf (stderr, "cannot compile %s: %s\n", pattern, err);
+		exit (1);
+	}
+	if (use_study) {
+		arg->extra = regexp_study (arg->re, 0);
+	}
+}
+
+static void
+add_rule (enum condition_type type, const char *arg1, const char *arg2)
+{
+	struct rule *rule;
+	struct condition *cond;
+
+	rule = calloc (1, sizeof (struct rule));
+	cond = calloc (1, sizeof (struct condition));
+	rule->conditions = calloc (1, sizeof (*rule->conditions));
+	rule->act = calloc (1, sizeof (struct action));
+	rule->act->type = ACTION_REJECT;
+	LIST_INIT (rule->conditions);
+
+	cond->type = type;
+	compile (&cond->args[0], arg1);
+	compile (&cond->args[1], arg2);
+	LIST_INSERT_HEAD (rule->conditions, cond, next);
+	if (type == COND_HEADER) {
+		rule->flags = COND_HEADER_FLAG;
+		header_rules ++;
+	}
+	else {
+		rule->flags = COND_BODY_FLAG;
+		body_rules ++;
+	}
+	LIST_INSERT_HEAD (&bench_cfg.rules, rule, next);
+}
+
+static void
+load_rules (const char *path)
+{
+	FILE *f;
+	char line[BUFSIZ], *type, *arg1, *arg2;
+
+	if ((f = fopen (path, "r")) == NULL) {
+		perror (path);
+		exit (1);
+	}
+	while (fgets (line, sizeof (line), f) != NULL) {
+		line[strcspn (line, "\r\n")] = '\0';
+		type = strtok (line, " \t");
+		if (type == NULL || *type == '#') {
+			continue;
+		}
+		arg1 = strtok (NULL, " \t");
+		arg2 = strtok (NULL, "");
+		if (arg1 == NULL) {
+			continue;
+		}
+		if (strcmp (type, "header") == 0) {
+			add_rule (COND_HEADER, arg1, arg2);
+		}
+		else if (strcmp (type, "body") == 0) {
+			add_rule (COND_BODY, arg1, NULL);
+		}
+	}
+	fclose (f);
+}
+
+static void
+default_rules (void)
+{
+	char buf[128];
+	int i;
+
+	for (i = 0; i < HEADER_RULES; i++) {
+		snprintf (buf, sizeof (buf), "^X-Header-%d$", i * 2);
+		add_rule (COND_HEADER, buf, "number 1[0-9] that");
+	}
+	for (i = 0; i < BODY_RULES; i++) {
+		snprintf (buf, sizeof (buf), "(buy|cheap) (pills|watches) %d", i);
+		add_rule (COND_BODY, buf, NULL);
+	}
+}
+
+static void
+load_message (const char *path)
+{
+	FILE *f;
+	char line[BUFSIZ], *c;
+	size_t len, allocated = BUFSIZ;
+	int in_body = 0;
+
+	if ((f = fopen (path, "r")) == NULL) {
+		perror (path);
+		exit (1);
+	}
+	body = malloc (allocated);
+	body_len = 0;
+	while (fgets (line, sizeof (line), f) != NULL) {
+		if (!in_body) {
+			line[strcspn (line, "\r\n")] = '\0';
+			if (line[0] == '\0') {
+				in_body = 1;
+			}
+			else if ((c = strchr (line, ':')) != NULL && headers_num < MAX_HEADERS) {
+				*c++ = '\0';
+				while (*c == ' ' || *c == '\t') {
+					c ++;
+				}
+				header_names[headers_num] = strdup (line);
+				header_values[headers_num] = strdup (c);
+				headers_num ++;
+			}
+			continue;
+		}
+		len = strlen (line);
+		if (body_len + len + 1 > allocated) {
+			allocated = (body_len + len + 1) * 2;
+			body = realloc (body, allocated);
+		}
+		memcpy (body + body_len, line, len);
+		body_len += len;
+	}
+	body[body_len] = '\0';
+	fclose (f);
+}
+
+static void
+default_message (void)
+{
+	char buf[128];
+	size_t i;
+
+	for (i = 0; i < 20; i++) {
+		snprintf (buf, sizeof (buf), "X-Header-%d", (int)i * 4);
+		header_names[i] = strdup (buf);
+		snprintf (buf, sizeof (buf), "some header value number %d that is not too short", (int)i);
+		header_values[i] = strdup (buf);
+	}
+	headers_num = i;
+	body_len = 4095;
+	body = malloc (body_len + 1);
+	for (i = 0; i < body_len; i++) {
+		body[i] = "abcdefghijklmnopqrstuvwxyz    \n"[i % 31];
+	}
+	body[body_len] = '\0';
+}
+
+static void *
+bench_thread (void *unused)
+{
+	struct mlfi_priv *priv;
+	int i, j, matched = 0;
+
+	priv = calloc (1, sizeof (struct mlfi_priv));
+	priv->priv_cur_body.value = body;
+	priv->priv_cur_body.len = body_len;
+
+	for (i = 0; i < iterations; i++) {
+		if (use_lock) {
+			pthread_mutex_lock (&bench_mtx);
+		}
+		for (j = 0; j < headers_num; j++) {
+			priv->priv_cur_header.header_name = header_names[j];
+			priv->priv_cur_header.header_value = header_values[j];
+			if (regexp_check (&bench_cfg, priv, STAGE_HEADER) != NULL) {
+				matched ++;
+			}
+		}
+		if (regexp_check (&bench_cfg, priv, STAGE_BODY) != NULL) {
+			matched ++;
+		}
+		if (use_lock) {
+			pthread_mutex_unlock (&bench_mtx);
+		}
+	}
+	free (priv);
+
+	return (void *)(uintptr_t)matched;
+}
+
+int 
+main (int argc, char **argv)
+{
+	pthread_t threads[64];
+	int max_threads = MAX_THREADS, i, t, ch;
+	void *matched;
+	unsigned long total;
+	char *rules_file = NULL, *message_file = NULL;
+	double start, elapsed, base = 0;
+
+	while ((ch = getopt (argc, argv, "lnpr:m:")) != -1) {
+		switch (ch) {
+			case 'l':
+				use_lock = 1;
+				break;
+			case 'n':
+				use_study = 0;
+				break;
+			case 'p':
+				use_prefilter = 0;
+				break;
+			case 'r':
+				rules_file = optarg;
+				break;
+			case 'm':
+				message_file = optarg;
+				break;
+			default:
+				fprintf (stderr, "usage: regexp-bench [-l] [-n] [-p] [-r rules] [-m message] "
+						"[max_threads] [iterations]\n");
+				exit (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 0) {
+		max_threads = atoi (argv[0]);
+		if (max_threads < 1 || max_threads > 64) {
+			max_threads = MAX_THREADS;
+		}
+	}
+	if (argc > 1) {
+		iterations = atoi (argv[1]);
+	}
+
+	LIST_INIT (&bench_cfg.rules);
+	if (rules_file != NULL) {
+		load_rules (rules_file);
+	}
+	else {
+		default_rules ();
+	}
+	regexp_init_rules (&bench_cfg);
+	if (!use_prefilter) {
+		for (i = 0; i < COND_MAX; i++) {
+			if (bench_cfg.prefilters[i][0] != NULL) {
+				prefilter_free (bench_cfg.prefilters[i][0]);
+				bench_cfg.prefilters[i][0] = NULL;
+			}
+			if (bench_cfg.prefilters[i][1] != NULL) {
+				prefilter_free (bench_cfg.prefilters[i][1]);
+				bench_cfg.prefilters[i][1] = NULL;
+			}
+		}
+	}
+	if (message_file != NULL) {
+		load_message (message_file);
+	}
+	else {
+		default_message ();
+	}
+
+	printf ("%d header and %d body rules, %d headers and %zu bytes of body, "
+			"%d iterations per thread%s%s%s\n", header_rules, body_rules, headers_num,
+			body_len, iterations, use_study ? "" : ", no study", use_prefilter ? "" : ", no prefilter",
+			use_lock ? ", global lock" : "");
+	for (t = 1; t <= max_threads; t++) {
+		start = get_ticks ();
+		for (i = 0; i < t; i++) {
+			pthread_create (&threads[i], NULL, bench_thread, NULL);
+		}
+		total = 0;
+		for (i = 0; i < t; i++) {
+			pthread_join (threads[i], &matched);
+			total += (uintptr_t)matched;
+		}
+		elapsed = get_ticks () - start;
+		if (t == 1) {
+			base = iterations / elapsed;
+		}
+		printf ("%2d threads: %.0f messages/s, speedup %.2f, %lu rules matched\n", t,
+				t * iterations / elapsed, t * iterations / elapsed / base, total);
+	}
+
+	return 0;
+}
+
+/* 
+ * vi:ts=4 
+ */
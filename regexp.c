@@ -25,21 +25,182 @@
  */
 
 #include <sys/types.h>
+#include <sys/time.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <syslog.h>
+#include <time.h>
 
 #include "pcre.h"
 #include "rmilter.h"
 #include "cfg_file.h"
 #include "regexp.h"
+#include "mime.h"
 
-extern pthread_mutex_t regexp_mtx;
+#ifdef PCRE_STUDY_JIT_COMPILE
+#define JIT_STACK_MIN 32 * 1024
+#define JIT_STACK_MAX 512 * 1024
 
-#define C_LOCK() do { pthread_mutex_lock (&regexp_mtx); } while (0)
-#define C_UNLOCK() do { pthread_mutex_unlock (&regexp_mtx); } while (0)
+static pthread_key_t jit_stack_key;
+static pthread_once_t jit_stack_once = PTHREAD_ONCE_INIT;
+static int jit_available = 0;
 
+static void
+jit_stack_free (void *stack)
+{
+	pcre_jit_stack_free (stack);
+}
+
+static void
+jit_stack_init (void)
+{
+	int r = 0;
+
+	if (pcre_config (PCRE_CONFIG_JIT, &r) == 0 && r == 1) {
+		if (pthread_key_create (&jit_stack_key, jit_stack_free) == 0) {
+			jit_available = 1;
+		}
+	}
+}
+
+/*
+ * JIT stack can be used only by one thread at a time, so each milter thread
+ * allocates its own on the first match; returning NULL makes pcre use 32K of
+ * the machine stack
+ */
+static pcre_jit_stack *
+jit_stack_get (void *unused)
+{
+	pcre_jit_stack *stack;
+
+	stack = pthread_getspecific (jit_stack_key);
+	if (stack == NULL) {
+		stack = pcre_jit_stack_alloc (JIT_STACK_MIN, JIT_STACK_MAX);
+		if (stack != NULL) {
+			pthread_setspecific (jit_stack_key, stack);
+		}
+	}
+
+	return stack;
+}
+#endif
+
+/*
+ * Study pattern and compile it to machine code where pcre supports JIT,
+ * partial is set for patterns used in streaming body matching; returns NULL
+ * if pattern cannot be optimized and pcre_exec should be called without
+ * extra data
+ */
+pcre_extra *
+regexp_study (const pcre *re, int partial)
+{
+	pcre_extra *extra;
+	const char *err = NULL;
+	int flags = 0;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+	pthread_once (&jit_stack_once, jit_stack_init);
+	if (jit_available) {
+		flags |= PCRE_STUDY_JIT_COMPILE;
+#ifdef PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE
+		if (partial) {
+			flags |= PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE;
+		}
+#endif
+	}
+#endif
+	extra = pcre_study (re, flags, &err);
+	if (extra == NULL) {
+		if (err != NULL) {
+			msg_warn ("regexp_study: pcre_study failed: %s", err);
+		}
+		return NULL;
+	}
+#ifdef PCRE_STUDY_JIT_COMPILE
+	if (jit_available) {
+		pcre_assign_jit_stack (extra, jit_stack_get, NULL);
+	}
+#endif
+
+	return extra;
+}
+
+void
+regexp_free_study (pcre_extra *extra)
+{
+	if (extra != NULL) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+		pcre_free_study (extra);
+#else
+		pcre_free (extra);
+#endif
+	}
+}
+
+/* Set from config by regexp_init_rules */
+static int profile_enabled = 0;
+static int reorder_enabled = 0;
+
+#if defined(__GNUC__)
+#define STAT_ADD(v, n) __sync_fetch_and_add (&(v), (n))
+#else
+#define STAT_ADD(v, n) ((v) += (n))
+#endif
+
+static inline uint64_t
+profile_ticks (void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return ((uint64_t)hi << 32) | lo;
+#else
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static inline void
+condition_stat (struct cond_arg *arg, uint64_t ticks, int r)
+{
+	STAT_ADD (arg->stat.ticks, ticks);
+	STAT_ADD (arg->stat.evals, 1);
+	if (r >= 0) {
+		STAT_ADD (arg->stat.matches, 1);
+	}
+}
+
+static int
+condition_exec (struct cond_arg *arg, const char *str, size_t len, int options, int *ovector, int ovecsize)
+{
+	uint64_t start;
+	int r;
+
+	if (!profile_enabled) {
+		return pcre_exec (arg->re, arg->extra, str, len, 0, options, ovector, ovecsize);
+	}
+
+	start = profile_ticks ();
+	r = pcre_exec (arg->re, arg->extra, str, len, 0, options, ovector, ovecsize);
+	condition_stat (arg, profile_ticks () - start, r);
+
+	return r;
+}
+
+/*
+ * Compiled patterns are not modified by pcre_exec and ovector is on the stack
+ * of calling thread, so rules are checked by milter threads concurrently
+ */
 static int
-check_condition (struct cond_arg *arg, const char *match_str, size_t str_len)
+check_condition (struct cond_arg *arg, const char *match_str, size_t str_len, const unsigned char *found)
 {
 	int ovector[30];
 	int r;
@@ -47,8 +208,31 @@ check_condition (struct cond_arg *arg, const char *match_str, size_t str_len)
 	if (!arg || !match_str || arg->empty) {
 		return 0;
 	}
-
- 	r = pcre_exec (arg->re, NULL, match_str, str_len, 0, 0, ovector, sizeof(ovector)/sizeof(int));
+	if (arg->exact != NULL) {
+		/* $ also matches before newline at the end of string */
+		r = -1;
+		if (str_len == arg->exact_len || (str_len == arg->exact_len + 1 && match_str[str_len - 1] == '\n')) {
+			if (arg->caseless) {
+				r = strncasecmp (match_str, arg->exact, arg->exact_len) == 0 ? 0 : -1;
+			}
+			else {
+				r = memcmp (match_str, arg->exact, arg->exact_len) == 0 ? 0 : -1;
+			}
+		}
+		if (profile_enabled) {
+			condition_stat (arg, 0, r);
+		}
+	}
+	else if (found != NULL && arg->literal != -1 && !PREFILTER_ISSET (found, arg->literal)) {
+		/* Required literal is not in string, so pattern cannot match */
+		r = -1;
+		if (profile_enabled) {
+			condition_stat (arg, 0, r);
+		}
+	}
+	else {
+		r = condition_exec (arg, match_str, str_len, 0, ovector, sizeof(ovector)/sizeof(int));
+	}
 
 	if (arg->not) {
 		return r < 0;
@@ -58,205 +242,777 @@ check_condition (struct cond_arg *arg, const char *match_str, size_t str_len)
 	}
 }
 
-static struct rule *
-check_connect_rule (struct rule *cur, const struct mlfi_priv *priv)
+/* Number of checks between reordering and before counters are trusted */
+#define REORDER_INTERVAL 1024
+#define REORDER_MIN_EVALS 256
+
+/* Probability that argument check is passed */
+static double
+pass_rate (const struct cond_arg *arg)
 {
-	struct condition *cond;
-	size_t hlen, iplen;
+	double p = (double)arg->stat.matches / arg->stat.evals;
 
-	hlen = strlen (priv->priv_hostname);
-	iplen = strlen (priv->priv_ip);
+	return arg->not ? 1. - p : p;
+}
 
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_CONNECT) {
-			/* Hostname and ip address */
-			if (check_condition (&cond->args[0], priv->priv_hostname, hlen)
-			    && check_condition (&cond->args[1], priv->priv_ip, iplen)) {
-				return cur;
-			}
+/*
+ * Checking argument a first costs c(a) + p(a) * c(b) on average, so a goes
+ * first if c(a) * (1 - p(b)) < c(b) * (1 - p(a)); counters are read without
+ * lock as both orders give the same result
+ */
+static void
+reorder_condition (struct condition *cond)
+{
+	const struct cond_stat *s0 = &cond->args[0].stat, *s1 = &cond->args[1].stat;
+	double c0, c1;
+
+	if (s0->evals < REORDER_MIN_EVALS || s1->evals < REORDER_MIN_EVALS) {
+		return;
+	}
+	c0 = (double)s0->ticks / s0->evals;
+	c1 = (double)s1->ticks / s1->evals;
+	cond->first = c1 * (1. - pass_rate (&cond->args[0])) < c0 * (1. - pass_rate (&cond->args[1]));
+}
+
+/*
+ * Both arguments of condition must match, second argument is ignored if
+ * stage has no string for it
+ */
+static int
+check_args (struct condition *cond, const char **str, size_t *len, unsigned char **found)
+{
+	int i = cond->first, j = !cond->first;
+
+	if (reorder_enabled && cond->args[i].stat.evals % REORDER_INTERVAL == REORDER_INTERVAL - 1) {
+		reorder_condition (cond);
+	}
+
+	return (str[i] == NULL && i == 1 ? 1 : check_condition (&cond->args[i], str[i], len[i], found[i]))
+		&& (str[j] == NULL && j == 1 ? 1 : check_condition (&cond->args[j], str[j], len[j], found[j]));
+}
+
+/*
+ * Static cost of argument check: empty pattern never matches, exact
+ * comparison and absent required literal do not call pcre, unbounded
+ * repeats are likely to backtrack
+ */
+static unsigned int
+pattern_cost (const struct cond_arg *arg)
+{
+	const char *p;
+	unsigned int cost;
+
+	if (arg->empty || arg->src == NULL) {
+		return 0;
+	}
+	if (arg->exact != NULL) {
+		return 1;
+	}
+	if (arg->literal != -1) {
+		return 2;
+	}
+	cost = 8;
+	for (p = arg->src; *p != '\0'; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			p ++;
+		}
+		else if (*p == '*' || *p == '+' || *p == '{') {
+			cost += 8;
 		}
+		cost ++;
 	}
-	return NULL;
+
+	return cost;
 }
 
-static struct rule *
-check_helo_rule (struct rule *cur, const struct mlfi_priv *priv)
+#define HEADER_NAME_MAX 128
+
+/*
+ * Check whether pattern is a plain ^literal$ optionally prefixed with (?i),
+ * literal is written to buf
+ */
+static int
+pattern_literal (const char *src, char *buf, size_t buflen, int *caseless)
 {
+	const char *p = src;
+	size_t len = 0;
+
+	*caseless = 0;
+	if (strncmp (p, "(?i)", 4) == 0) {
+		*caseless = 1;
+		p += 4;
+	}
+	if (*p++ != '^') {
+		return 0;
+	}
+	if (strncmp (p, "(?i)", 4) == 0) {
+		*caseless = 1;
+		p += 4;
+	}
+	while (*p != '$' && len < buflen - 1) {
+		if (*p == '\\' && p[1] != '\0' && !isalnum ((unsigned char)p[1])) {
+			p ++;
+		}
+		else if (strchr ("\\^$.[|()?*+{", *p) != NULL) {
+			return 0;
+		}
+		buf[len++] = *p++;
+	}
+	if (len == 0 || p[0] != '$' || p[1] != '\0') {
+		return 0;
+	}
+	buf[len] = '\0';
+
+	return 1;
+}
+
+static int
+add_header_ref (struct config_file *cfg, unsigned int idx, const char *name, int caseless)
+{
+	struct header_bucket *hb;
+	struct header_ref *ref;
+	char lname[HEADER_NAME_MAX];
+	size_t i, len;
+	void *tmp;
+
+	len = strlen (name);
+	for (i = 0; i <= len; i++) {
+		lname[i] = tolower ((unsigned char)name[i]);
+	}
+	HASH_FIND (hh, cfg->header_buckets, lname, len, hb, memcmp);
+	if (hb == NULL) {
+		if ((hb = malloc (sizeof (struct header_bucket))) == NULL) {
+			return 0;
+		}
+		bzero (hb, sizeof (struct header_bucket));
+		if ((hb->name = strdup (lname)) == NULL) {
+			free (hb);
+			return 0;
+		}
+		HASH_ADD_KEYPTR (hh, cfg->header_buckets, hb->name, len, hb);
+	}
+	if (hb->len == hb->allocated) {
+		hb->allocated = hb->allocated ? hb->allocated * 2 : 4;
+		if ((tmp = realloc (hb->refs, hb->allocated * sizeof (struct header_ref))) == NULL) {
+			return 0;
+		}
+		hb->refs = tmp;
+	}
+	ref = &hb->refs[hb->len];
+	ref->idx = idx;
+	ref->exact = NULL;
+	if (!caseless && (ref->exact = strdup (name)) == NULL) {
+		return 0;
+	}
+	hb->len ++;
+
+	return 1;
+}
+
+/*
+ * Build arrays of conditions for each stage in order of rules and collect
+ * required literals of conditions into one scanner per condition type and
+ * argument, must be called after config is parsed
+ */
+void
+regexp_init_rules (struct config_file *cfg)
+{
+	struct rule *cur;
 	struct condition *cond;
-	size_t hlen;
+	struct cond_arg *arg;
+	struct prefilter **pf;
+	struct rule_cond *rc;
+	char literal[PREFILTER_MAX_LITERAL + 1], name[HEADER_NAME_MAX];
+	size_t len;
+	int i, j, caseless, indexed;
 
-	hlen = strlen (priv->priv_helo);
+	/* Reordering uses the same counters as profiling */
+	profile_enabled = cfg->rules_profile || cfg->rules_reorder;
+	reorder_enabled = cfg->rules_reorder;
 
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_HELO) {
-			/* Helo */
-			if (check_condition (&cond->args[0], priv->priv_helo, hlen)) {
-				return cur;
+	LIST_FOREACH (cur, &cfg->rules, next) {
+		LIST_FOREACH (cond, cur->conditions, next) {
+			cfg->rule_plan_len[cond->type] ++;
+		}
+	}
+	for (i = 0; i < COND_MAX; i++) {
+		if (cfg->rule_plan_len[i] != 0) {
+			cfg->rule_plan[i] = malloc (cfg->rule_plan_len[i] * sizeof (struct rule_cond));
+			if (cfg->rule_plan[i] == NULL) {
+				msg_err ("regexp_init_rules: malloc failed, rules of type %d are not checked", i);
+				cfg->rule_plan_len[i] = 0;
+			}
+		}
+	}
+	if (cfg->rule_plan_len[COND_HEADER] != 0) {
+		cfg->header_generic = malloc (cfg->rule_plan_len[COND_HEADER] * sizeof (unsigned int));
+	}
+	bzero (cfg->rule_plan_len, sizeof (cfg->rule_plan_len));
+
+	LIST_FOREACH (cur, &cfg->rules, next) {
+		LIST_FOREACH (cond, cur->conditions, next) {
+			if (cfg->rule_plan[cond->type] != NULL) {
+				rc = &cfg->rule_plan[cond->type][cfg->rule_plan_len[cond->type]++];
+				rc->rule = cur;
+				rc->cond = cond;
+			}
+			if (cond->type == COND_BODY && cond->decoded) {
+				cfg->body_decoded_num ++;
+			}
+			/* Header conditions for fixed names are found by name */
+			indexed = 0;
+			if (cond->type == COND_HEADER && cfg->header_generic != NULL) {
+				if (!cond->args[0].empty && !cond->args[0].not && cond->args[0].src != NULL
+						&& pattern_literal (cond->args[0].src, name, sizeof (name), &caseless)) {
+					indexed = add_header_ref (cfg, cfg->rule_plan_len[COND_HEADER] - 1, name, caseless);
+				}
+				if (!indexed) {
+					cfg->header_generic[cfg->header_generic_len++] = cfg->rule_plan_len[COND_HEADER] - 1;
+				}
+			}
+			for (i = 0; i < 2; i++) {
+				arg = &cond->args[i];
+				arg->literal = -1;
+				if (arg->empty || arg->src == NULL || (i == 0 && indexed)) {
+					continue;
+				}
+				/* Body is matched in chunks, so it is always checked by pcre */
+				if (cond->type != COND_BODY && arg->exact == NULL
+						&& pattern_literal (arg->src, name, sizeof (name), &caseless)) {
+					arg->exact_len = strlen (name);
+					arg->exact = strdup (name);
+					arg->caseless = caseless;
+				}
+				/* Negated patterns must be checked when literal is absent */
+				if (arg->not || arg->exact != NULL) {
+					continue;
+				}
+				len = prefilter_extract_literal (arg->src, literal, sizeof (literal));
+				if (len < PREFILTER_MIN_LITERAL) {
+					continue;
+				}
+				pf = &cfg->prefilters[cond->type][i];
+				if (*pf == NULL && (*pf = prefilter_new ()) == NULL) {
+					continue;
+				}
+				arg->literal = prefilter_add (*pf, literal, len);
+			}
+			/* Cheaper argument is checked first until counters are collected */
+			cond->first = pattern_cost (&cond->args[1]) < pattern_cost (&cond->args[0]);
+		}
+	}
+
+	for (i = 0; i < COND_MAX; i++) {
+		for (j = 0; j < 2; j++) {
+			if (cfg->prefilters[i][j] != NULL && prefilter_compile (cfg->prefilters[i][j]) == -1) {
+				msg_warn ("regexp_init_rules: cannot build literal scanner, checking all rules");
+				prefilter_free (cfg->prefilters[i][j]);
+				cfg->prefilters[i][j] = NULL;
 			}
 		}
 	}
-	return NULL;
 }
 
+#define PREFILTER_STACK_BYTES 256
+
+/*
+ * Merge conditions for this header name with conditions for regexp names in
+ * order of rules, so the first matched rule is the same as with full scan
+ */
 static struct rule *
-check_envfrom_rule (struct rule *cur, const struct mlfi_priv *priv)
+check_header_rules (const struct config_file *cfg, const char **str, size_t *len, unsigned char **found)
 {
-	struct condition *cond;
-	size_t flen;
-
-	flen = strlen (priv->priv_from);
+	struct header_bucket *hb = NULL;
+	struct header_ref *ref;
+	struct rule_cond *rc;
+	char lname[HEADER_NAME_MAX];
+	unsigned int i = 0, j = 0, n;
+	size_t k;
+
+	if (len[0] < sizeof (lname)) {
+		for (k = 0; k < len[0]; k++) {
+			lname[k] = tolower ((unsigned char)str[0][k]);
+		}
+		HASH_FIND (hh, cfg->header_buckets, lname, len[0], hb, memcmp);
+	}
 
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_ENVFROM) {
-			/* From: */
-			if (check_condition (&cond->args[0], priv->priv_from, flen)) {
-				return cur;
+	while ((hb != NULL && i < hb->len) || j < cfg->header_generic_len) {
+		if (j == cfg->header_generic_len || (hb != NULL && i < hb->len && hb->refs[i].idx < cfg->header_generic[j])) {
+			ref = &hb->refs[i++];
+			if (ref->exact != NULL && strcmp (ref->exact, str[0]) != 0) {
+				continue;
+			}
+			rc = &cfg->rule_plan[COND_HEADER][ref->idx];
+			if (check_condition (&rc->cond->args[1], str[1], len[1], found[1])) {
+				return rc->rule;
+			}
+		}
+		else {
+			n = cfg->header_generic[j++];
+			rc = &cfg->rule_plan[COND_HEADER][n];
+			if (str[1] != NULL && check_args (rc->cond, str, len, found)) {
+				return rc->rule;
 			}
 		}
 	}
+
 	return NULL;
 }
 
-static struct rule *
-check_envrcpt_rule (struct rule *cur, const struct mlfi_priv *priv)
+struct rule *
+regexp_check (const struct config_file *cfg, const struct mlfi_priv *priv, enum milter_stage stage)
 {
+	struct rule *r = NULL;
+	struct rule_cond *plan;
 	struct condition *cond;
+	struct prefilter *pf;
 	struct rcpt *rcpt;
-	size_t tlen;
-
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_ENVRCPT) {
-			/* To: */
-			for (rcpt = priv->rcpts.lh_first; rcpt != NULL; rcpt = rcpt->r_list.le_next) {
-				tlen = strlen (rcpt->r_addr);
-				if (check_condition (&cond->args[0], rcpt->r_addr, tlen)) {
-					return cur;
+	unsigned char *found[2], buf[2][PREFILTER_STACK_BYTES];
+	const char *str[2] = {NULL, NULL};
+	size_t len[2] = {0, 0};
+	unsigned int n;
+	int i;
+
+	/* Strings matched by each argument of conditions for this stage */
+	switch (stage) {
+	case STAGE_CONNECT:
+		str[0] = priv->priv_hostname;
+		str[1] = priv->priv_ip;
+		break;
+	case STAGE_HELO:
+		str[0] = priv->priv_helo;
+		break;
+	case STAGE_ENVFROM:
+		str[0] = priv->priv_from;
+		break;
+	case STAGE_HEADER:
+		str[0] = priv->priv_cur_header.header_name;
+		str[1] = priv->priv_cur_header.header_value;
+		break;
+	case STAGE_BODY:
+		str[0] = priv->priv_cur_body.value;
+		len[0] = priv->priv_cur_body.len;
+		break;
+	default:
+		break;
+	}
+	for (i = 0; i < 2; i++) {
+		if (str[i] != NULL && len[i] == 0) {
+			len[i] = strlen (str[i]);
+		}
+	}
+
+	/* Find literals of all rules in one pass over each string */
+	for (i = 0; i < 2; i++) {
+		found[i] = NULL;
+		pf = (int)stage < COND_MAX ? cfg->prefilters[stage][i] : NULL;
+		if (pf == NULL) {
+			continue;
+		}
+		if (PREFILTER_BYTES (pf) <= PREFILTER_STACK_BYTES) {
+			found[i] = buf[i];
+		}
+		else if ((found[i] = malloc (PREFILTER_BYTES (pf))) == NULL) {
+			continue;
+		}
+		bzero (found[i], PREFILTER_BYTES (pf));
+		if (stage == STAGE_ENVRCPT) {
+			/* Condition is checked against every recipient */
+			LIST_FOREACH (rcpt, &priv->rcpts, r_list) {
+				prefilter_scan (pf, rcpt->r_addr, strlen (rcpt->r_addr), found[i]);
+			}
+		}
+		else if (str[i] != NULL) {
+			prefilter_scan (pf, str[i], len[i], found[i]);
+		}
+	}
+
+	/* Conditions of this stage in order of rules, first matched rule wins */
+	plan = (int)stage < COND_MAX ? cfg->rule_plan[stage] : NULL;
+	if (stage == STAGE_HEADER && cfg->header_generic != NULL) {
+		r = check_header_rules (cfg, str, len, found);
+		plan = NULL;
+	}
+	for (n = 0; plan != NULL && n < cfg->rule_plan_len[stage] && r == NULL; n++) {
+		cond = plan[n].cond;
+		if (stage == STAGE_ENVRCPT) {
+			LIST_FOREACH (rcpt, &priv->rcpts, r_list) {
+				if (check_condition (&cond->args[0], rcpt->r_addr, strlen (rcpt->r_addr), found[0])) {
+					r = plan[n].rule;
+					break;
 				}
 			}
 		}
+		else if (cond->decoded) {
+			/* Only checked by regexp_check_body */
+			continue;
+		}
+		else if (check_args (cond, str, len, found)) {
+			r = plan[n].rule;
+		}
 	}
-	return NULL;
+
+	for (i = 0; i < 2; i++) {
+		if (found[i] != NULL && found[i] != buf[i]) {
+			free (found[i]);
+		}
+	}
+	
+	return r;
 }
-static struct rule *
-check_header_rule (struct rule *cur, const struct mlfi_priv *priv)
+
+#ifdef PCRE_PARTIAL_SOFT
+#define BODY_PARTIAL PCRE_PARTIAL_SOFT
+#else
+#define BODY_PARTIAL 0
+#endif
+
+/*
+ * Body conditions are matched against the whole message body, chunk by chunk:
+ * a pattern found in any chunk is remembered, the tail of chunk where some
+ * pattern has a partial match (at least BODY_WINDOW bytes) is prepended to the
+ * next chunk. Conditions skipped by prefilter are still checked for partial
+ * matches. Only conditions before the first matched one are checked further.
+ * Raw body and text decoded from MIME parts are separate streams.
+ */
+static void
+body_scan (const struct config_file *cfg, struct body_match *bm, int decoded,
+		const char *chunk, size_t chunk_len)
 {
-	struct condition *cond;
-	size_t nlen, vlen;
+	struct rule_cond *plan = cfg->rule_plan[COND_BODY];
+	struct cond_arg *arg;
+	struct prefilter *pf = cfg->prefilters[COND_BODY][0];
+	unsigned char *found = NULL, buf[PREFILTER_STACK_BYTES];
+	const char *data;
+	char *tmp, *carry;
+	size_t len, keep, off;
+	unsigned int n;
+	int ovector[30], r;
+
+	len = bm->carry_len[decoded] + chunk_len;
+	tmp = NULL;
+	if (bm->carry_len[decoded] > 0) {
+		if ((tmp = malloc (len)) == NULL) {
+			return;
+		}
+		memcpy (tmp, bm->carry[decoded], bm->carry_len[decoded]);
+		memcpy (tmp + bm->carry_len[decoded], chunk, chunk_len);
+		data = tmp;
+	}
+	else {
+		data = chunk;
+	}
 
-	nlen = strlen (priv->priv_cur_header.header_name);
-	vlen = strlen (priv->priv_cur_header.header_value);
+	if (pf != NULL) {
+		if (PREFILTER_BYTES (pf) <= PREFILTER_STACK_BYTES) {
+			found = buf;
+		}
+		else {
+			found = malloc (PREFILTER_BYTES (pf));
+		}
+		if (found != NULL) {
+			bzero (found, PREFILTER_BYTES (pf));
+			prefilter_scan (pf, data, len, found);
+		}
+	}
 
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_HEADER) {
-			/* Header name and value */
-			if (check_condition (&cond->args[0], priv->priv_cur_header.header_name, nlen) 
-				&& check_condition (&cond->args[1], priv->priv_cur_header.header_value, vlen)) {
-				return cur;
+	keep = len > BODY_WINDOW ? len - BODY_WINDOW : 0;
+	for (n = 0; n < bm->first; n++) {
+		arg = &plan[n].cond->args[0];
+		if (bm->found[n] || arg->empty || plan[n].cond->decoded != decoded) {
+			continue;
+		}
+		if (found != NULL && arg->literal != -1 && !PREFILTER_ISSET (found, arg->literal)) {
+			/*
+			 * Pattern cannot match without its literal, but it may start here
+			 * and end in the next chunk: look for a partial match only in the
+			 * part of data that can be carried
+			 */
+			if (BODY_PARTIAL == 0 || len - keep >= BODY_CARRY_MAX) {
+				continue;
+			}
+			off = len > BODY_CARRY_MAX ? len - BODY_CARRY_MAX : 0;
+			r = condition_exec (arg, data + off, len - off, BODY_PARTIAL, ovector,
+					sizeof (ovector) / sizeof (int));
+			if (r == PCRE_ERROR_PARTIAL && off + ovector[0] < keep) {
+				keep = off + ovector[0];
+			}
+			continue;
+		}
+		r = condition_exec (arg, data, len, BODY_PARTIAL, ovector,
+				sizeof (ovector) / sizeof (int));
+		if (r >= 0) {
+			bm->found[n] = 1;
+			if (!arg->not) {
+				bm->first = n;
+				break;
 			}
 		}
+		else if (r == PCRE_ERROR_PARTIAL && (size_t)ovector[0] < keep) {
+			keep = ovector[0];
+		}
+	}
+
+	/* Save tail for the next chunk */
+	if (len - keep > BODY_CARRY_MAX) {
+		keep = len - BODY_CARRY_MAX;
+	}
+	carry = NULL;
+	if (len > keep && (carry = malloc (len - keep)) != NULL) {
+		memcpy (carry, data + keep, len - keep);
+	}
+	if (bm->carry[decoded] != NULL) {
+		free (bm->carry[decoded]);
+	}
+	bm->carry[decoded] = carry;
+	bm->carry_len[decoded] = carry != NULL ? len - keep : 0;
+
+	if (tmp != NULL) {
+		free (tmp);
+	}
+	if (found != NULL && found != buf) {
+		free (found);
 	}
-	return NULL;
 }
 
-static struct rule *
-check_body_rule (struct rule *cur, const struct mlfi_priv *priv)
+/* State of body conditions depends on config, MIME parser does not */
+static void
+body_match_free (struct mlfi_priv *priv)
 {
-	struct condition *cond;
+	int i;
 
-	LIST_FOREACH (cond, cur->conditions, next) {
-		if (cond->type == COND_BODY) {
-			/* Body line */
-			if (check_condition (&cond->args[0], priv->priv_cur_body.value, priv->priv_cur_body.len)) {
-				return cur;
+	if (priv->body_match != NULL) {
+		free (priv->body_match->found);
+		for (i = 0; i < 2; i++) {
+			if (priv->body_match->carry[i] != NULL) {
+				free (priv->body_match->carry[i]);
 			}
 		}
+		free (priv->body_match);
+		priv->body_match = NULL;
 	}
-	return NULL;
 }
 
 struct rule *
-regexp_check (const struct config_file *cfg, const struct mlfi_priv *priv, enum milter_stage stage)
+regexp_check_body (const struct config_file *cfg, struct mlfi_priv *priv)
 {
-	struct rule *cur;
-	struct rule *r = NULL;
+	struct body_match *bm = priv->body_match;
+	struct rule_cond *plan = cfg->rule_plan[COND_BODY];
 
-	/* Check rules for specific stage */
-	LIST_FOREACH (cur, &cfg->rules, next) {
-		if ((cur->flags & COND_CONNECT_FLAG) != 0 && stage == STAGE_CONNECT) {
-			C_LOCK ();
-			r = check_connect_rule (cur, priv);
-			C_UNLOCK ();
+	if (plan == NULL) {
+		return NULL;
+	}
+	if (bm != NULL && bm->serial != cfg->serial) {
+		/* Config was reloaded in the middle of message, MIME parser is kept */
+		body_match_free (priv);
+		bm = NULL;
+	}
+	if (bm == NULL) {
+		if ((bm = malloc (sizeof (struct body_match))) == NULL) {
+			return NULL;
+		}
+		bzero (bm, sizeof (struct body_match));
+		if ((bm->found = calloc (cfg->rule_plan_len[COND_BODY], 1)) == NULL) {
+			free (bm);
+			return NULL;
+		}
+		bm->serial = cfg->serial;
+		bm->first = cfg->rule_plan_len[COND_BODY];
+		priv->body_match = bm;
+	}
 
-		} else if ((cur->flags & COND_HELO_FLAG) != 0 && stage == STAGE_HELO) {
-			C_LOCK ();
-			r = check_helo_rule (cur, priv);
-			C_UNLOCK ();
+	if (bm->first > 0 && cfg->body_decoded_num < cfg->rule_plan_len[COND_BODY]) {
+		body_scan (cfg, bm, 0, priv->priv_cur_body.value, priv->priv_cur_body.len);
+	}
+	if (priv->mime != NULL) {
+		if (bm->first > 0 && priv->mime->out_len > 0) {
+			body_scan (cfg, bm, 1, priv->mime->out, priv->mime->out_len);
+		}
+		priv->mime->out_len = 0;
+	}
 
-		} else if ((cur->flags & COND_ENVFROM_FLAG) != 0 && stage == STAGE_ENVFROM) {
-			C_LOCK ();
-			r = check_envfrom_rule (cur, priv);
-			C_UNLOCK ();
+	return bm->first < cfg->rule_plan_len[COND_BODY] ? plan[bm->first].rule : NULL;
+}
 
-		} else if ((cur->flags & COND_ENVRCPT_FLAG) != 0 && stage == STAGE_ENVRCPT) {
-			C_LOCK ();
-			r = check_envrcpt_rule (cur, priv);
-			C_UNLOCK ();
+/* Negated body conditions are true if pattern was not found in the whole body */
+struct rule *
+regexp_body_end (const struct config_file *cfg, struct mlfi_priv *priv)
+{
+	struct body_match *bm = priv->body_match;
+	struct cond_arg *arg;
+	unsigned int n;
 
-		} else if ((cur->flags & COND_HEADER_FLAG) != 0 && stage == STAGE_HEADER) {
-			C_LOCK ();
-			r = check_header_rule (cur, priv);
-			C_UNLOCK ();
+	if (bm == NULL || bm->serial != cfg->serial) {
+		return NULL;
+	}
+	if (priv->mime != NULL) {
+		/* Last line of body without newline */
+		mime_end (priv->mime);
+		if (bm->first > 0 && priv->mime->out_len > 0) {
+			body_scan (cfg, bm, 1, priv->mime->out, priv->mime->out_len);
+		}
+		priv->mime->out_len = 0;
+	}
+	for (n = 0; n < bm->first; n++) {
+		arg = &cfg->rule_plan[COND_BODY][n].cond->args[0];
+		if (arg->not && !arg->empty && !bm->found[n]) {
+			bm->first = n;
+			break;
+		}
+	}
 
-		} else if ((cur->flags & COND_BODY_FLAG) != 0 && stage == STAGE_BODY) {
-			C_LOCK ();
-			r = check_body_rule (cur, priv);
-			C_UNLOCK ();
+	return bm->first < cfg->rule_plan_len[COND_BODY] ? cfg->rule_plan[COND_BODY][bm->first].rule : NULL;
+}
 
-		}
-		/* Stop matching on finding matched rule */
-		if (r != NULL) {
-			return r;
+void
+regexp_body_free (struct mlfi_priv *priv)
+{
+	body_match_free (priv);
+	if (priv->mime != NULL) {
+		mime_parser_free (priv->mime);
+		priv->mime = NULL;
+	}
+}
+
+struct profile_entry {
+	struct condition *cond;
+	struct cond_arg *arg;
+};
+
+static int
+profile_cmp (const void *a, const void *b)
+{
+	const struct profile_entry *e1 = a, *e2 = b;
+
+	if (e1->arg->stat.ticks == e2->arg->stat.ticks) {
+		return 0;
+	}
+
+	return e1->arg->stat.ticks < e2->arg->stat.ticks ? 1 : -1;
+}
+
+/* Number of profile_ticks per microsecond */
+static double
+profile_rate (void)
+{
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	struct timeval tv1, tv2;
+	struct timespec ts;
+	uint64_t t1, t2;
+	double usec;
+
+	gettimeofday (&tv1, NULL);
+	t1 = profile_ticks ();
+	ts.tv_sec = 0;
+	ts.tv_nsec = 50000000;
+	nanosleep (&ts, NULL);
+	gettimeofday (&tv2, NULL);
+	t2 = profile_ticks ();
+	usec = (tv2.tv_sec - tv1.tv_sec) * 1000000. + (tv2.tv_usec - tv1.tv_usec);
+
+	return usec > 0 ? (t2 - t1) / usec : 1.;
+#else
+	return 1.;
+#endif
+}
+
+static const char *cond_names[COND_MAX] = {
+	"connect", "helo", "envfrom", "envrcpt", "header", "body"
+};
+
+/*
+ * Write counters of all rule regexps sorted by time spent in them, counters
+ * are accumulated since config was loaded
+ */
+int
+regexp_profile_dump (const struct config_file *cfg, FILE *f)
+{
+	struct profile_entry *entries;
+	struct cond_arg *arg;
+	unsigned int i, n, count = 0, total = 0;
+	uint64_t ticks = 0;
+	double rate;
+	int j;
+
+	for (i = 0; i < COND_MAX; i++) {
+		total += cfg->rule_plan_len[i] * 2;
+	}
+	if (total == 0) {
+		fprintf (f, "# no rules\n");
+		return 0;
+	}
+	if ((entries = malloc (total * sizeof (struct profile_entry))) == NULL) {
+		return -1;
+	}
+	for (i = 0; i < COND_MAX; i++) {
+		for (n = 0; n < cfg->rule_plan_len[i]; n++) {
+			for (j = 0; j < 2; j++) {
+				arg = &cfg->rule_plan[i][n].cond->args[j];
+				if (arg->empty || arg->src == NULL) {
+					continue;
+				}
+				entries[count].cond = cfg->rule_plan[i][n].cond;
+				entries[count].arg = arg;
+				ticks += arg->stat.ticks;
+				count ++;
+			}
 		}
 	}
-	
-	return NULL;
+	qsort (entries, count, sizeof (struct profile_entry), profile_cmp);
+
+	rate = profile_rate ();
+	fprintf (f, "# total %.0f usec in %u regexps%s\n", ticks / rate, count,
+			profile_enabled ? "" : ", profiling is disabled");
+	fprintf (f, "# usec\tshare\tevals\tmatches\tline\ttype\tregexp\n");
+	for (i = 0; i < count; i++) {
+		arg = entries[i].arg;
+		fprintf (f, "%.0f\t%.2f%%\t%llu\t%llu\t%d\t%s%s\t%s%s\n", arg->stat.ticks / rate,
+				ticks ? arg->stat.ticks * 100. / ticks : 0., (unsigned long long)arg->stat.evals,
+				(unsigned long long)arg->stat.matches, entries[i].cond->line,
+				cond_names[entries[i].cond->type], entries[i].cond->decoded ? "_decoded" : "",
+				arg->not ? "not " : "", arg->src);
+	}
+	free (entries);
+
+	return 0;
 }
 
+/*
+ * Rule is applied if every type of its conditions has matched some rule at
+ * corresponding stage, reject actions are returned before accept ones
+ */
 struct action * 
 rules_check (struct rule **rules)
 {
-	struct rule *cur = NULL;
-	struct condition *cond;
-	int i, r;
+	struct rule *accept = NULL;
+	uint8_t matched = 0;
+	int i;
 
 	for (i = 0; i < STAGE_MAX; i++) {
-		if (rules[i] == NULL) {
-			continue;
+		if (rules[i] != NULL) {
+			matched |= 1 << i;
 		}
-		cur = rules[i];
-		r = 1;
-		LIST_FOREACH (cond, cur->conditions, next) {
-			if (rules[cond->type] == 0) {
-				r = 0;
-				break;
-			}
+	}
+	if (matched == 0) {
+		return NULL;
+	}
+
+	for (i = 0; i < STAGE_MAX; i++) {
+		if (rules[i] == NULL || (rules[i]->flags & ~matched) != 0) {
+			continue;
 		}
-		/* Return reject actions before any accept action */
-		if (r == 1 && cur->act->type != ACTION_ACCEPT) {
-			return cur->act;
+		if (rules[i]->act->type != ACTION_ACCEPT) {
+			return rules[i]->act;
 		}
-		else if (r == 0) {
-			cur = NULL;
+		else if (accept == NULL) {
+			accept = rules[i];
 		}
 	}
-	
+
 	/* Return accept action if found */
-	if (cur) {
-		return cur->act;
+	if (accept) {
+		return accept->act;
 	}
 
 	return NULL;
 }
-
-#undef C_LOCK
-#undef C_UNLOCK
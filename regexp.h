@@ -29,6 +29,8 @@
 
 
 #include <sys/types.h>
+#include <stdio.h>
+#include "pcre.h"
 #include "rmilter.h"
 #include "cfg_file.h"
 
@@ -46,4 +48,25 @@ struct rule  * regexp_check (const struct config_file *,	/* Config file */
 				  enum milter_stage);						/* Current Stage */
 struct action * rules_check (struct rule **);
 
+/* Tail of body kept for patterns spanning chunks */
+#define BODY_WINDOW 256
+#define BODY_CARRY_MAX 16384
+
+/* Body matching state kept between mlfi_body calls */
+struct body_match {
+	short int serial;
+	unsigned char *found;						/* pattern of condition occurred */
+	unsigned int first;							/* first matched condition */
+	char *carry[2];								/* raw and decoded */
+	size_t carry_len[2];
+};
+
+struct rule * regexp_check_body (const struct config_file *cfg, struct mlfi_priv *priv);
+struct rule * regexp_body_end (const struct config_file *cfg, struct mlfi_priv *priv);
+void regexp_body_free (struct mlfi_priv *priv);
+int regexp_profile_dump (const struct config_file *cfg, FILE *f);
+pcre_extra * regexp_study (const pcre *re, int partial);
+void regexp_free_study (pcre_extra *extra);
+void regexp_init_rules (struct config_file *cfg);
+
 #endif
@@ -60,6 +60,8 @@
 #include "cfg_file.h"
 #include "rmilter.h"
 #include "regexp.h"
+#include "mime.h"
+#include "shadow.h"
 #ifdef HAVE_DCC
 #include "dccif.h"
 #endif
@@ -130,7 +132,6 @@ extern struct config_file *cfg;
 
 /* Milter mutexes */
 pthread_mutex_t mkstemp_mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t regexp_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static sfsistat
 set_reply (SMFICTX *ctx, const struct action *act)
@@ -193,6 +194,10 @@ create_temp_file (struct mlfi_priv *priv)
 		msg_warn ("create_temp_file: %s: mkstemp failed, %d: %m", priv->mlfi_id, errno);
 		return -1;
 	}
+	/* Local rspamd reads file by path, it should be in group of rmilter */
+	if (cfg->spamd_pass_file && fchmod (fd, 0640) == -1) {
+		msg_warn ("create_temp_file: %s: fchmod failed, %d: %m", priv->mlfi_id, errno);
+	}
 	priv->fileh = fdopen(fd, "w");
 
 	if (!priv->fileh) {
@@ -250,7 +255,7 @@ check_message_id (struct mlfi_priv *priv, char *header)
 
 	/* First of all do regexp check of message to determine special message id */
 	if (cfg->special_mid_re) {
-		if ((r = pcre_exec (cfg->special_mid_re, NULL, header, s, 0, 0, NULL, 0)) >= 0) {
+		if ((r = pcre_exec (cfg->special_mid_re, cfg->special_mid_extra, header, s, 0, 0, NULL, 0)) >= 0) {
 			priv->complete_to_beanstalk = 1;	
 		}
 	}
@@ -380,17 +385,14 @@ check_greylisting (struct mlfi_priv *priv)
 	char ipout[INET_ADDRSTRLEN + 1];
 	bool ip_whitelisted = false;
 
-	if (priv->priv_addr.family == AF_INET) {
-		if (radix32tree_find (cfg->grey_whitelist_tree,
-				ntohl((uint32_t)priv->priv_addr.addr.sa4.sin_addr.s_addr)) != RADIX_NO_VALUE) {
-			ip_whitelisted = true;
-		}
+	if (priv->ip_class & IP_CLASS_GREY_WHITELIST) {
+		ip_whitelisted = true;
 	}
 
 	/* Check whitelist */
 	if (!ip_whitelisted) {
-		if (cfg->awl_enable && priv->priv_addr.family == AF_INET &&
-				awl_check ((uint32_t)priv->priv_addr.addr.sa4.sin_addr.s_addr, cfg->awl_hash, priv->conn_tm.tv_sec) == 1) {
+		if (cfg->awl_enable &&
+				awl_check (&priv->priv_addr.addr.sa, cfg->awl_hash, priv->conn_tm.tv_sec) == 1) {
 			/* Auto whitelisted */
 			return GREY_WHITELISTED;
 		}
@@ -555,8 +557,8 @@ check_greylisting (struct mlfi_priv *priv)
 			}
 			else {
 				/* Write to autowhitelist */
-				if (cfg->awl_enable && priv->priv_addr.family == AF_INET) {
-					awl_add ((uint32_t)priv->priv_addr.addr.sa4.sin_addr.s_addr, cfg->awl_hash, priv->conn_tm.tv_sec);
+				if (cfg->awl_enable) {
+					awl_add (&priv->priv_addr.addr.sa, cfg->awl_hash, priv->conn_tm.tv_sec);
 				}
 				/* Write to whitelist memcached server */
 				selected = (struct memcached_server *) get_upstream_by_hash ((void *)cfg->memcached_servers_white,
@@ -903,6 +905,18 @@ mlfi_connect(SMFICTX * ctx, char *hostname, _SOCK_ADDR * addr)
 		}
 	}
 
+	/* Look up all address lists once per connection */
+	if (priv->priv_addr.family == AF_INET) {
+		CFG_RLOCK();
+		priv->ip_class = get_ip_class (cfg, ntohl ((uint32_t)priv->priv_addr.addr.sa4.sin_addr.s_addr));
+		CFG_UNLOCK();
+	}
+	else if (priv->priv_addr.family == AF_INET6) {
+		CFG_RLOCK();
+		priv->ip_class = get_ip_class6 (cfg, &priv->priv_addr.addr.sa6.sin6_addr);
+		CFG_UNLOCK();
+	}
+
 	if (hostname != NULL) {
 		strlcpy (priv->priv_hostname, hostname, sizeof (priv->priv_hostname));
 	}
@@ -1297,6 +1311,15 @@ mlfi_header(SMFICTX * ctx, char *headerf, char *headerv)
 	if (act != NULL) {
 		priv->matched_rules[STAGE_HEADER] = act;
 	}
+	/* Top level headers of message for MIME parser */
+	if (cfg->body_decoded_num > 0) {
+		if (priv->mime == NULL) {
+			priv->mime = mime_parser_new ();
+		}
+		if (priv->mime != NULL) {
+			mime_header (priv->mime, headerf, headerv);
+		}
+	}
 
 	CFG_UNLOCK();
 	return SMFIS_CONTINUE;
@@ -1332,6 +1355,12 @@ mlfi_eoh(SMFICTX * ctx)
 		fprintf (priv->fileh, "\r\n");
 		priv->eoh_pos = ftell (priv->fileh);
 	}
+	/* Body is hashed for verdict cache only if it is seen from the beginning */
+	CFG_RLOCK();
+	if (cfg->verdict_cache != NULL && priv->verdict == NULL) {
+		priv->verdict = verdict_body_new ();
+	}
+	CFG_UNLOCK();
 #ifdef ENABLE_DKIM
 	int r;
 
@@ -1363,8 +1392,9 @@ mlfi_eom(SMFICTX * ctx)
 	double prob_cur;
 	struct stat sb;
 	struct action *act;
+	struct rule *rule;
 	struct rcpt *rcpt;
-	bool ip_whitelisted = false;
+	bool ip_whitelisted = false, too_big = false;
 
 	if ((priv = (struct mlfi_priv *) smfi_getpriv (ctx)) == NULL) {
 		msg_err ("Internal error: smfi_getpriv() returns NULL");
@@ -1393,6 +1423,9 @@ mlfi_eom(SMFICTX * ctx)
 	CFG_RLOCK();
 	if (cfg->serial == priv->serial) {
 		msg_debug ("mlfi_eom: %s: checking regexp rules", priv->mlfi_id);
+		if ((rule = regexp_body_end (cfg, priv)) != NULL) {
+			priv->matched_rules[STAGE_BODY] = rule;
+		}
 		act = rules_check (priv->matched_rules);
 		if (act != NULL && act->type != ACTION_ACCEPT) {
 			CFG_UNLOCK ();
@@ -1443,6 +1476,13 @@ mlfi_eom(SMFICTX * ctx)
 		CFG_UNLOCK();
 		return mlfi_cleanup (ctx, true);
 	}
+	else if (cfg->sizelimit != 0 && sb.st_size > (off_t)cfg->sizelimit &&
+			cfg->spamd_partial_size != 0 && cfg->spamd_servers_num != 0) {
+		/* Check only beginning of message by spamd */
+		msg_warn ("mlfi_eom: %s: message size(%ld) exceeds limit(%ld), only partial spamd scan, %s",
+				priv->mlfi_id, (long int)sb.st_size, (long int)cfg->sizelimit, priv->file);
+		too_big = true;
+	}
 	else if (cfg->sizelimit != 0 && sb.st_size > (off_t)cfg->sizelimit) {
 #ifndef FREEBSD_LEGACY
 		msg_warn ("mlfi_eom: %s: message size(%zd) exceeds limit(%zd), not scanned, %s", priv->mlfi_id, (size_t)sb.st_size, cfg->sizelimit, priv->file);
@@ -1461,7 +1501,7 @@ mlfi_eom(SMFICTX * ctx)
 
 #ifdef HAVE_DCC
 	/* Check dcc */
-	if (cfg->use_dcc == 1 && !priv->has_whitelisted && priv->strict &&
+	if (cfg->use_dcc == 1 && !too_big && !priv->has_whitelisted && priv->strict &&
 			(cfg->strict_auth && *priv->priv_user != '\0')) {
 		msg_debug ("mlfi_eom: %s: check dcc", priv->mlfi_id);
 		r = check_dcc (priv);
@@ -1489,9 +1529,17 @@ mlfi_eom(SMFICTX * ctx)
 #endif
 
 	/* Check clamav */
-	if (cfg->clamav_servers_num != 0) {
+	if (cfg->clamav_servers_num != 0 && !too_big) {
 		msg_debug ("mlfi_eom: %s: check clamav", priv->mlfi_id);
+		if (scan_sched_enter (cfg->clamav_sched, scan_class_get (priv)) == -1) {
+			msg_warn ("mlfi_eom: %s: clamav queue timeout exceeded", priv->mlfi_id);
+			smfi_setreply (ctx, RCODE_TEMPFAIL, XCODE_TEMPFAIL, (char *)"Try again later");
+			CFG_UNLOCK();
+			mlfi_cleanup (ctx, false);
+			return SMFIS_TEMPFAIL;
+		}
 		r = check_clamscan (priv->file, strres, sizeof (strres));
+		scan_sched_leave (cfg->clamav_sched);
 		if (r < 0) {
 			msg_warn ("mlfi_eom: %s: check_clamscan() failed, %d", priv->mlfi_id, r);
 			CFG_UNLOCK();
@@ -1508,11 +1556,11 @@ mlfi_eom(SMFICTX * ctx)
 		}
 	}
 	/* Write message to beanstalk */
-	if (cfg->beanstalk_servers_num > 0 && cfg->send_beanstalk_headers) {
+	if (cfg->beanstalk_servers_num > 0 && cfg->send_beanstalk_headers && !too_big) {
 		send_beanstalk (priv);
 	}
 	/* Maybe write its copy */
-	if (cfg->copy_server && cfg->send_beanstalk_copy) {
+	if (cfg->copy_server && cfg->send_beanstalk_copy && !too_big) {
 		prob_cur = cfg->beanstalk_copy_prob;
 		/* Normalize */
 		prob_max = 100;
@@ -1524,11 +1572,8 @@ mlfi_eom(SMFICTX * ctx)
 			send_beanstalk_copy (priv, cfg->copy_server);
 		}
 	}
-	if (priv->priv_addr.family == AF_INET) {
-		if (radix32tree_find (cfg->spamd_whitelist,
-				ntohl((uint32_t)priv->priv_addr.addr.sa4.sin_addr.s_addr)) != RADIX_NO_VALUE) {
-			ip_whitelisted = true;
-		}
+	if (priv->ip_class & IP_CLASS_SPAMD_WHITELIST) {
+		ip_whitelisted = true;
 	}
 	/* Check spamd */
 	if (cfg->spamd_servers_num != 0 && !priv->has_whitelisted && priv->strict
@@ -1536,9 +1581,24 @@ mlfi_eom(SMFICTX * ctx)
 			(cfg->strict_auth || *priv->priv_user == '\0')) {
 		msg_debug ("mlfi_eom: %s: check spamd", priv->mlfi_id);
 		r = spamdscan (ctx, priv, cfg, &subject, 0);
+		if (r == -3) {
+			/* Message is not accepted unchecked when scanners are busy */
+			msg_warn ("mlfi_eom: %s: spamd queue timeout exceeded", priv->mlfi_id);
+			smfi_setreply (ctx, RCODE_TEMPFAIL, XCODE_TEMPFAIL, (char *)"Try again later");
+			CFG_UNLOCK();
+			mlfi_cleanup (ctx, false);
+			return SMFIS_TEMPFAIL;
+		}
 
 		/* Check on extra servers */
-		if (cfg->extra_spamd_servers_num != 0) {
+		if (cfg->extra_spamd_servers_num != 0 && cfg->spamd_shadow_ratio > 0) {
+			/* Extra scan of sampled messages is done in background */
+			if (r >= 0 && (double)rand () / RAND_MAX < cfg->spamd_shadow_ratio) {
+				msg_debug ("mlfi_eom: %s: queue shadow spamd check", priv->mlfi_id);
+				shadow_add (priv, r);
+			}
+		}
+		else if (cfg->extra_spamd_servers_num != 0) {
 			msg_debug ("mlfi_eom: %s: check spamd", priv->mlfi_id);
 			er = spamdscan (ctx, priv, cfg, &subject, 1);
 			if (er < 0) {
@@ -1546,6 +1606,7 @@ mlfi_eom(SMFICTX * ctx)
 			}
 			else if (r != er) {
 				msg_warn ("mlfi_eom: spamd_extra_scan returned %d and normal scan returned %d", er, r);
+				shadow_diff (cfg, priv, r, er);
 			}
 		}
 		if (r < 0) {
@@ -1713,6 +1774,11 @@ mlfi_cleanup(SMFICTX * ctx, bool ok)
 		free (priv->priv_subject);
 		priv->priv_subject = NULL;
 	}
+	regexp_body_free (priv);
+	if (priv->verdict != NULL) {
+		verdict_body_free (priv->verdict);
+		priv->verdict = NULL;
+	}
 	if (ok) {
 		/* If ok is not true do not clean SMTP data, just reject message */
 		priv->priv_from[0] = '\0';
@@ -1761,7 +1827,19 @@ mlfi_body(SMFICTX * ctx, u_char * bodyp, size_t bodylen)
 	priv->priv_cur_body.len = bodylen;
 	CFG_RLOCK();
 
-	act = regexp_check (cfg, priv, STAGE_BODY);
+	if (cfg->body_decoded_num > 0) {
+		if (priv->mime == NULL) {
+			priv->mime = mime_parser_new ();
+		}
+		if (priv->mime != NULL) {
+			mime_feed (priv->mime, (const char *)bodyp, bodylen);
+		}
+	}
+	if (priv->verdict != NULL) {
+		verdict_body_update (priv->verdict, (const char *)bodyp, bodylen);
+	}
+
+	act = regexp_check_body (cfg, priv);
 	if (act != NULL) {
 		priv->matched_rules[STAGE_BODY] = act;
 	}
@@ -129,6 +129,11 @@ struct mlfi_priv {
 	int filed;
 	struct timeval conn_tm;
 	struct rule* matched_rules[STAGE_MAX];
+	struct body_match *body_match;
+	/* Decoder of MIME parts for body_decoded rules */
+	struct mime_parser *mime;
+	/* Body digest for verdict cache */
+	struct verdict_body *verdict;
 	short int strict;
 	long eoh_pos;
 	/* Config serial */
@@ -136,6 +141,8 @@ struct mlfi_priv {
 	short int has_return_path;
 	short int complete_to_beanstalk;
 	short int has_whitelisted;
+	/* Whitelists client address belongs to, IP_CLASS_* flags */
+	unsigned char ip_class;
 #ifdef ENABLE_DKIM
 	DKIM *dkim;
 #endif
@@ -0,0 +1,357 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Measure parsing of rspamd replies and check parser on corpus:
+ * rspamd-bench [-s symbols] [iterations]
+ * rspamd-bench -f [-m mutations] reply...
+ * -s number of symbols in generated replies
+ * -f parses each reply file whole and split at random points, results must
+ *    be the same, then parses randomly mutated copies of it (run it built
+ *    with -fsanitize=address); files named *.http are HTTP replies to
+ *    /checkv2, others are RSPAMC replies
+ * -m number of mutated copies of each file
+ *
+ * Built with -DRSPAMD_FUZZER it provides entry point for libFuzzer instead.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rspamd.h"
+
+#define SYMBOLS 300
+#define ITERATIONS 2000
+#define MUTATIONS 2000
+#define SPLITS 100
+
+/* Parse reply fed by pieces of chunk bytes, chunk 0 means random pieces */
+static int
+parse (struct rspamd_reply *reply, const char *buf, size_t len, size_t chunk, int http)
+{
+	size_t off = 0, n;
+	int r;
+
+	rspamd_reply_init (reply);
+	while (off < len) {
+		n = chunk ? chunk : (size_t)(rand () % 512) + 1;
+		if (n > len - off) {
+			n = len - off;
+		}
+		r = http ? rspamd_http_feed (reply, buf + off, n) : rspamd_reply_feed (reply, buf + off, n);
+		if (r != 0) {
+			return r == 1 ? 0 : -1;
+		}
+		off += n;
+	}
+
+	return http ? rspamd_http_end (reply) : rspamd_reply_end (reply);
+}
+
+#ifdef RSPAMD_FUZZER
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data, size_t size)
+{
+	struct rspamd_reply reply;
+
+	parse (&reply, (const char *)data, size, size > 0 ? data[0] % 64 + 1 : 1, size > 0 && data[0] >= 128);
+	rspamd_reply_free (&reply);
+
+	return 0;
+}
+
+#else
+
+static double
+get_ticks (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+/* Text form of results to compare parses */
+static char *
+dump (struct rspamd_reply *reply, int r)
+{
+	struct rspamd_metric_result *cur;
+	struct rspamd_symbol *sym;
+	size_t len = 0, allocated = BUFSIZ, need;
+	char *buf, *tmp;
+
+	buf = malloc (allocated);
+	len = snprintf (buf, allocated, "%d %s %d\n", r, reply->mid ? reply->mid : "-", reply->keepalive);
+	TAILQ_FOREACH (cur, &reply->metrics, entry) {
+		need = strlen (cur->metric_name) + (cur->subject ? strlen (cur->subject) : 1) + 128;
+		TAILQ_FOREACH (sym, &cur->symbols, entry) {
+			need += strlen (sym->symbol) + 1;
+		}
+		if (len + need > allocated) {
+			allocated = (len + need) * 2;
+			tmp = realloc (buf, allocated);
+			buf = tmp;
+		}
+		len += snprintf (buf + len, allocated - len, "%s %.2f %.2f %.2f %d %s", cur->metric_name,
+				cur->score, cur->required_score, cur->reject_score, cur->action,
+				cur->subject ? cur->subject : "-");
+		TAILQ_FOREACH (sym, &cur->symbols, entry) {
+			len += snprintf (buf + len, allocated - len, " %s", sym->symbol);
+		}
+		len += snprintf (buf + len, allocated - len, "\n");
+	}
+
+	return buf;
+}
+
+static char *
+read_file (const char *path, size_t *len)
+{
+	struct stat st;
+	FILE *f;
+	char *buf;
+
+	if ((f = fopen (path, "r")) == NULL || fstat (fileno (f), &st) == -1) {
+		perror (path);
+		exit (1);
+	}
+	buf = malloc (st.st_size + 1);
+	*len = fread (buf, 1, st.st_size, f);
+	fclose (f);
+
+	return buf;
+}
+
+static void
+mutate (char *buf, size_t *len)
+{
+	size_t pos;
+	int n = rand () % 4 + 1;
+
+	while (n-- > 0 && *len > 0) {
+		pos = rand () % *len;
+		switch (rand () % 5) {
+			case 0:
+				buf[pos] = rand () % 256;
+				break;
+			case 1:
+				buf[pos] = "\n\r;/ :0"[rand () % 7];
+				break;
+			case 2:
+				*len = pos;
+				break;
+			case 3:
+				/* Copy part of reply over another one */
+				memmove (buf + pos, buf + pos / 2, (*len - pos) / 2);
+				break;
+			default:
+				memset (buf + pos, 'A', *len - pos > 16 ? 16 : *len - pos);
+				break;
+		}
+	}
+}
+
+static int
+check_file (const char *path, int mutations)
+{
+	struct rspamd_reply reply;
+	char *buf, *copy, *expected, *got;
+	size_t len, copy_len;
+	int i, r, bad = 0, http;
+
+	http = strlen (path) > 5 && strcmp (path + strlen (path) - 5, ".http") == 0;
+	buf = read_file (path, &len);
+	r = parse (&reply, buf, len, len, http);
+	expected = dump (&reply, r);
+	rspamd_reply_free (&reply);
+
+	for (i = 0; i < SPLITS; i++) {
+		r = parse (&reply, buf, len, i < 16 ? (size_t)i + 1 : 0, http);
+		got = dump (&reply, r);
+		rspamd_reply_free (&reply);
+		if (strcmp (expected, got) != 0) {
+			fprintf (stderr, "%s: results differ when split\n%s---\n%s", path, expected, got);
+			bad ++;
+		}
+		free (got);
+	}
+
+	copy = malloc (len + 1);
+	for (i = 0; i < mutations; i++) {
+		memcpy (copy, buf, len);
+		copy_len = len;
+		mutate (copy, &copy_len);
+		parse (&reply, copy, copy_len, 0, http);
+		rspamd_reply_free (&reply);
+	}
+	printf ("%s: %zu bytes, %s", path, len, expected);
+	free (copy);
+	free (expected);
+	free (buf);
+
+	return bad;
+}
+
+static char *
+generate_reply (int symbols, size_t *len)
+{
+	size_t allocated = 1024 + symbols * 128;
+	char *buf;
+	int i;
+
+	buf = malloc (allocated);
+	*len = snprintf (buf, allocated, "RSPAMD/1.2 0 EX_OK\r\n"
+			"Metric: default; True; 24.50 / 5.00 / 15.00\r\n"
+			"Action: reject\r\n");
+	for (i = 0; i < symbols; i++) {
+		*len += snprintf (buf + *len, allocated - *len,
+				"Symbol: SYMBOL_NUMBER_%d(%d.%02d); option%d, other option\r\n",
+				i, i % 5, i % 100, i);
+	}
+	*len += snprintf (buf + *len, allocated - *len,
+			"Subject: ***SPAM*** subject of the message\r\n"
+			"Metric: extra; False; 1.00 / 10.00\r\n"
+			"Symbol: EXTRA_SYMBOL(1.00)\r\n"
+			"Message-ID: <1234567890.abcdef@example.com>\r\n");
+
+	return buf;
+}
+
+static char *
+generate_http_reply (int symbols, size_t *len)
+{
+	size_t allocated = 1024 + symbols * 160, hlen, blen = 0;
+	char *body, *buf;
+	int i;
+
+	body = malloc (allocated);
+	blen = snprintf (body, allocated, "{\"is_skipped\":false,\"score\":24.5,\"required_score\":15.0,"
+			"\"action\":\"reject\",\"symbols\":{");
+	for (i = 0; i < symbols; i++) {
+		blen += snprintf (body + blen, allocated - blen,
+				"%s\"SYMBOL_NUMBER_%d\":{\"name\":\"SYMBOL_NUMBER_%d\",\"score\":%d.%02d,"
+				"\"metric_score\":1.0,\"options\":[\"option%d\",\"other option\"]}",
+				i ? "," : "", i, i, i % 5, i % 100, i);
+	}
+	blen += snprintf (body + blen, allocated - blen, "},\"messages\":{},"
+			"\"message-id\":\"1234567890.abcdef@example.com\",\"time_real\":0.1}");
+
+	buf = malloc (blen + 256);
+	hlen = snprintf (buf, 256, "HTTP/1.1 200 OK\r\nConnection: keep-alive\r\n"
+			"Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n", blen);
+	memcpy (buf + hlen, body, blen);
+	*len = hlen + blen;
+	free (body);
+
+	return buf;
+}
+
+static void
+bench (const char *name, char *buf, size_t len, int iterations, int http)
+{
+	struct rspamd_reply reply;
+	size_t chunks[] = {0, 16384, 1460, 64, 1}, k;
+	int i, parsed;
+	double start, elapsed;
+
+	printf ("%s reply of %zu bytes, %d iterations\n", name, len, iterations);
+	for (k = 0; k < sizeof (chunks) / sizeof (chunks[0]); k++) {
+		parsed = 0;
+		start = get_ticks ();
+		for (i = 0; i < iterations; i++) {
+			if (parse (&reply, buf, len, chunks[k] ? chunks[k] : len, http) == 0) {
+				parsed ++;
+			}
+			rspamd_reply_free (&reply);
+		}
+		elapsed = get_ticks () - start;
+		printf ("%5zu bytes reads: %.0f replies/s, %.1f MB/s, %d parsed\n",
+				chunks[k] ? chunks[k] : len, iterations / elapsed,
+				iterations * len / elapsed / 1048576., parsed);
+	}
+	free (buf);
+}
+
+int 
+main (int argc, char **argv)
+{
+	size_t len;
+	int symbols = SYMBOLS, iterations = ITERATIONS, mutations = MUTATIONS;
+	int check = 0, bad = 0, i, ch;
+	char *buf;
+
+	while ((ch = getopt (argc, argv, "fm:s:")) != -1) {
+		switch (ch) {
+			case 'f':
+				check = 1;
+				break;
+			case 'm':
+				mutations = atoi (optarg);
+				break;
+			case 's':
+				symbols = atoi (optarg);
+				break;
+			default:
+				fprintf (stderr, "usage: rspamd-bench [-s symbols] [iterations]\n"
+						"       rspamd-bench -f [-m mutations] reply...\n");
+				exit (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	srand (1);
+
+	if (check) {
+		for (i = 0; i < argc; i++) {
+			bad += check_file (argv[i], mutations);
+		}
+		printf ("%d files checked, %d failures\n", argc, bad);
+		return bad != 0;
+	}
+
+	if (argc > 0) {
+		iterations = atoi (argv[0]);
+	}
+	buf = generate_reply (symbols, &len);
+	bench ("RSPAMC", buf, len, iterations, 0);
+	buf = generate_http_reply (symbols, &len);
+	bench ("HTTP", buf, len, iterations, 1);
+
+	return 0;
+}
+
+#endif
+
+/* 
+ * vi:ts=4 
+ */
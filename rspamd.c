@@ -0,0 +1,1023 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parsers of RSPAMC protocol replies:
+ *
+ * RSPAMD/1.2 0 EX_OK
+ * Metric: default; True; 10.50 / 5.00 / 15.00
+ * Action: reject
+ * Symbol: R_SPF_FAIL(1.00); example.com
+ * Subject: ***SPAM*** original subject
+ * Message-ID: <id@example.com>
+ *
+ * and of HTTP replies to /checkv2 requests with JSON body:
+ *
+ * {"score": 10.5, "required_score": 15, "action": "add header",
+ *  "symbols": {"R_SPF_FAIL": {"name": "R_SPF_FAIL", "score": 1.0, ...}, ...},
+ *  "subject": "...", "message-id": "..."}
+ *
+ * Reply is fed in pieces as it arrives, complete lines are parsed in place
+ * and only the tail of the last incomplete line or JSON token is copied.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "rspamd.h"
+
+/* First arena block, next ones are twice larger up to the maximum */
+#define ARENA_BLOCK_MIN 4096
+#define ARENA_BLOCK_MAX 65536
+#define ARENA_ALIGN 8
+
+struct rspamd_arena {
+	struct rspamd_arena *next;
+	size_t size;
+	size_t used;
+};
+
+#define ARENA_HEADER ((sizeof (struct rspamd_arena) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+enum {
+	REPLY_STATUS = 0,
+	REPLY_METRIC,
+	REPLY_BODY,
+	REPLY_HTTP_STATUS,
+	REPLY_HTTP_HEADER,
+	REPLY_HTTP_BODY,
+	REPLY_HTTP_CHUNK_SIZE,
+	REPLY_HTTP_CHUNK,
+	REPLY_HTTP_CHUNK_END,
+	REPLY_HTTP_TRAILER,
+	REPLY_DONE,
+	REPLY_ERROR
+};
+
+#define KEYWORD(p, end, k) ((size_t)((end) - (p)) >= sizeof (k) - 1 && memcmp ((p), (k), sizeof (k) - 1) == 0)
+
+void
+rspamd_reply_init (struct rspamd_reply *reply)
+{
+	bzero (reply, sizeof (struct rspamd_reply));
+	TAILQ_INIT (&reply->metrics);
+	reply->state = REPLY_STATUS;
+}
+
+/* Release all results, reply can be used again */
+void
+rspamd_reply_free (struct rspamd_reply *reply)
+{
+	struct rspamd_arena *cur, *next;
+
+	for (cur = reply->arena; cur != NULL; cur = next) {
+		next = cur->next;
+		free (cur);
+	}
+	if (reply->line.data != NULL) {
+		free (reply->line.data);
+	}
+	if (reply->tok.data != NULL) {
+		free (reply->tok.data);
+	}
+	rspamd_reply_init (reply);
+}
+
+void *
+rspamd_reply_alloc (struct rspamd_reply *reply, size_t len)
+{
+	struct rspamd_arena *a = reply->arena;
+	size_t size;
+	void *p;
+
+	len = (len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (a == NULL || a->size - a->used < len) {
+		size = a == NULL ? ARENA_BLOCK_MIN : a->size * 2;
+		if (size > ARENA_BLOCK_MAX) {
+			size = ARENA_BLOCK_MAX;
+		}
+		if (size < len) {
+			size = len;
+		}
+		if ((a = malloc (ARENA_HEADER + size)) == NULL) {
+			return NULL;
+		}
+		a->size = size;
+		a->used = 0;
+		a->next = reply->arena;
+		reply->arena = a;
+	}
+	p = (char *)a + ARENA_HEADER + a->used;
+	a->used += len;
+
+	return p;
+}
+
+char *
+rspamd_reply_strdup (struct rspamd_reply *reply, const char *s, size_t len)
+{
+	char *p;
+
+	if ((p = rspamd_reply_alloc (reply, len + 1)) == NULL) {
+		return NULL;
+	}
+	memcpy (p, s, len);
+	p[len] = '\0';
+
+	return p;
+}
+
+static int
+reply_error (struct rspamd_reply *reply, const char *err)
+{
+	reply->state = REPLY_ERROR;
+	reply->err = err;
+
+	return -1;
+}
+
+static const char *
+skip_spaces (const char *p, const char *end)
+{
+	while (p < end && isspace ((unsigned char)*p)) {
+		p ++;
+	}
+
+	return p;
+}
+
+/* Score is copied as line is not terminated */
+static int
+parse_score (const char **pos, const char *end, double *res)
+{
+	char buf[64], *err;
+	const char *p = *pos;
+	size_t len = 0;
+
+	while (p + len < end && len < sizeof (buf) - 1 && p[len] != '\0'
+			&& strchr ("0123456789.eE+-", p[len]) != NULL) {
+		len ++;
+	}
+	memcpy (buf, p, len);
+	buf[len] = '\0';
+	*res = strtod (buf, &err);
+	if (err == buf) {
+		return -1;
+	}
+	*pos = p + (err - buf);
+
+	return 0;
+}
+
+/* name; result; score / required_score [/ reject_score] */
+static int
+parse_metric (struct rspamd_reply *reply, const char *p, const char *end)
+{
+	struct rspamd_metric_result *cur;
+	const char *c;
+
+	if ((cur = rspamd_reply_alloc (reply, sizeof (struct rspamd_metric_result))) == NULL) {
+		return reply_error (reply, "malloc failed");
+	}
+	bzero (cur, sizeof (struct rspamd_metric_result));
+	TAILQ_INIT (&cur->symbols);
+
+	if ((c = memchr (p, ';', end - p)) == NULL) {
+		return reply_error (reply, "no metric name");
+	}
+	if ((cur->metric_name = rspamd_reply_strdup (reply, p, c - p)) == NULL) {
+		return reply_error (reply, "malloc failed");
+	}
+	/* Skip result, scores tell the same */
+	p = c + 1;
+	if ((c = memchr (p, ';', end - p)) == NULL) {
+		return reply_error (reply, "no metric result");
+	}
+	p = skip_spaces (c + 1, end);
+
+	if (parse_score (&p, end, &cur->score) == -1 || p == end || (*p != ' ' && *p != '/')) {
+		return reply_error (reply, "invalid metric score");
+	}
+	while (p < end && (*p == ' ' || *p == '/')) {
+		p ++;
+	}
+	if (parse_score (&p, end, &cur->required_score) == 0) {
+		if (p < end && *p != ' ' && *p != '/') {
+			return reply_error (reply, "invalid required score");
+		}
+		while (p < end && (*p == ' ' || *p == '/')) {
+			p ++;
+		}
+		parse_score (&p, end, &cur->reject_score);
+	}
+
+	TAILQ_INSERT_HEAD (&reply->metrics, cur, entry);
+	reply->cur = cur;
+
+	return 0;
+}
+
+static int
+parse_symbol (struct rspamd_reply *reply, const char *p, const char *end)
+{
+	struct rspamd_symbol *sym;
+	const char *c;
+
+	if ((c = memchr (p, ';', end - p)) == NULL) {
+		c = end;
+	}
+	if (c == p) {
+		return reply_error (reply, "empty symbol name");
+	}
+	if ((sym = rspamd_reply_alloc (reply, sizeof (struct rspamd_symbol))) == NULL
+			|| (sym->symbol = rspamd_reply_strdup (reply, p, c - p)) == NULL) {
+		return reply_error (reply, "malloc failed");
+	}
+	sym->score = 0;
+	TAILQ_INSERT_HEAD (&reply->cur->symbols, sym, entry);
+
+	return 0;
+}
+
+static void
+parse_action (struct rspamd_reply *reply, const char *p, const char *end)
+{
+	if (KEYWORD (p, end, "reject")) {
+		reply->cur->action = METRIC_ACTION_REJECT;
+	}
+	else if (KEYWORD (p, end, "greylist")) {
+		reply->cur->action = METRIC_ACTION_GREYLIST;
+	}
+	else if (KEYWORD (p, end, "add header")) {
+		reply->cur->action = METRIC_ACTION_ADD_HEADER;
+	}
+	else if (KEYWORD (p, end, "rewrite subject")) {
+		reply->cur->action = METRIC_ACTION_REWRITE_SUBJECT;
+	}
+	else {
+		reply->cur->action = METRIC_ACTION_NOACTION;
+	}
+}
+
+static int
+parse_line (struct rspamd_reply *reply, const char *p, size_t len)
+{
+	const char *end, *c;
+
+	if (len > 0 && p[len - 1] == '\r') {
+		len --;
+	}
+	end = p + len;
+
+	if (reply->state == REPLY_STATUS) {
+		/* RSPAMD/{VERSION} {ERROR_CODE} {DESCR} */
+		if (!KEYWORD (p, end, "RSPAMD/") || (c = memchr (p, ' ', len)) == NULL) {
+			return reply_error (reply, "invalid status line");
+		}
+		c = skip_spaces (c, end);
+		if (c == end || *c != '0') {
+			reply->server_error = 1;
+			return reply_error (reply, "server returned error code");
+		}
+		reply->state = REPLY_METRIC;
+		return 0;
+	}
+
+	p = skip_spaces (p, end);
+	if (p == end) {
+		return 0;
+	}
+	if (KEYWORD (p, end, "Metric:")) {
+		reply->state = REPLY_BODY;
+		return parse_metric (reply, skip_spaces (p + sizeof ("Metric:") - 1, end), end);
+	}
+	if (reply->state == REPLY_METRIC) {
+		return reply_error (reply, "metric expected");
+	}
+	if (KEYWORD (p, end, "Symbol:")) {
+		return parse_symbol (reply, skip_spaces (p + sizeof ("Symbol:") - 1, end), end);
+	}
+	else if (KEYWORD (p, end, "Action:")) {
+		parse_action (reply, skip_spaces (p + sizeof ("Action:") - 1, end), end);
+	}
+	else if (KEYWORD (p, end, "Message-ID:")) {
+		p = skip_spaces (p + sizeof ("Message-ID:") - 1, end);
+		if ((reply->mid = rspamd_reply_strdup (reply, p, end - p)) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+	}
+	else if (KEYWORD (p, end, "Subject:")) {
+		p = skip_spaces (p + sizeof ("Subject:") - 1, end);
+		if ((reply->cur->subject = rspamd_reply_strdup (reply, p, end - p)) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+	}
+	/* Other lines are skipped */
+
+	return 0;
+}
+
+static int
+buf_append (struct rspamd_reply *reply, struct rspamd_buf *buf, const char *p, size_t len)
+{
+	size_t size;
+	char *tmp;
+
+	if (buf->len + len > RSPAMD_LINE_MAX) {
+		return reply_error (reply, "too long line or string");
+	}
+	if (buf->len + len > buf->allocated) {
+		size = buf->allocated ? buf->allocated : 256;
+		while (size < buf->len + len) {
+			size *= 2;
+		}
+		if ((tmp = realloc (buf->data, size)) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+		buf->data = tmp;
+		buf->allocated = size;
+	}
+	memcpy (buf->data + buf->len, p, len);
+	buf->len += len;
+
+	return 0;
+}
+
+/* Parse next piece of reply, returns -1 if reply is invalid */
+int
+rspamd_reply_feed (struct rspamd_reply *reply, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len, *eol;
+
+	while (reply->state != REPLY_ERROR && p < end) {
+		if ((eol = memchr (p, '\n', end - p)) == NULL) {
+			buf_append (reply, &reply->line, p, end - p);
+			break;
+		}
+		if (reply->line.len > 0) {
+			if (buf_append (reply, &reply->line, p, eol - p) == 0) {
+				parse_line (reply, reply->line.data, reply->line.len);
+			}
+			reply->line.len = 0;
+		}
+		else {
+			parse_line (reply, p, eol - p);
+		}
+		p = eol + 1;
+	}
+
+	return reply->state == REPLY_ERROR ? -1 : 0;
+}
+
+/* Parse the last line without newline, returns -1 if reply is invalid */
+int
+rspamd_reply_end (struct rspamd_reply *reply)
+{
+	if (reply->state != REPLY_ERROR && reply->line.len > 0) {
+		parse_line (reply, reply->line.data, reply->line.len);
+		reply->line.len = 0;
+	}
+	if (reply->state == REPLY_STATUS) {
+		reply_error (reply, "empty reply");
+	}
+
+	return reply->state == REPLY_ERROR ? -1 : 0;
+}
+
+/*
+ * JSON body of /checkv2 reply, result is put into metric "default"
+ */
+
+enum {
+	JSON_VALUE = 0,
+	JSON_KEY,
+	JSON_COLON,
+	JSON_AFTER_VALUE,
+	JSON_STRING,
+	JSON_ESCAPE,
+	JSON_UNICODE,
+	JSON_LITERAL,
+	JSON_DONE
+};
+
+/* Meaning of value or object by its place in reply */
+enum {
+	KEY_OTHER = 0,
+	KEY_ROOT,
+	KEY_SCORE,
+	KEY_REQUIRED_SCORE,
+	KEY_ACTION,
+	KEY_SUBJECT,
+	KEY_MID,
+	KEY_SYMBOLS,
+	KEY_SYMBOL,
+	KEY_SYMBOL_SCORE
+};
+
+/* Numbers, true, false and null */
+#define JSON_LITERAL_MAX 64
+
+#define JSON_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+#define JSON_LITERAL_CHAR(c) (isalnum ((unsigned char)(c)) || (c) == '.' || (c) == '+' || (c) == '-')
+#define JSON_IS(k, len, s) ((len) == sizeof (s) - 1 && memcmp ((k), (s), (len)) == 0)
+
+static void
+json_value_end (struct rspamd_reply *reply)
+{
+	reply->json_state = reply->depth == 0 ? JSON_DONE : JSON_AFTER_VALUE;
+	reply->key = KEY_OTHER;
+}
+
+static int
+json_key (struct rspamd_reply *reply)
+{
+	const char *k = reply->tok.data;
+	size_t len = reply->tok.len;
+
+	reply->key = KEY_OTHER;
+	switch (reply->ctx[reply->depth - 1]) {
+		case KEY_ROOT:
+			if (JSON_IS (k, len, "score")) {
+				reply->key = KEY_SCORE;
+			}
+			else if (JSON_IS (k, len, "required_score")) {
+				reply->key = KEY_REQUIRED_SCORE;
+			}
+			else if (JSON_IS (k, len, "action")) {
+				reply->key = KEY_ACTION;
+			}
+			else if (JSON_IS (k, len, "subject")) {
+				reply->key = KEY_SUBJECT;
+			}
+			else if (JSON_IS (k, len, "message-id")) {
+				reply->key = KEY_MID;
+			}
+			else if (JSON_IS (k, len, "symbols")) {
+				reply->key = KEY_SYMBOLS;
+			}
+			break;
+		case KEY_SYMBOLS:
+			reply->key = KEY_SYMBOL;
+			if ((reply->sym = rspamd_reply_alloc (reply, sizeof (struct rspamd_symbol))) == NULL
+					|| (reply->sym->symbol = rspamd_reply_strdup (reply, k, len)) == NULL) {
+				return reply_error (reply, "malloc failed");
+			}
+			reply->sym->score = 0;
+			break;
+		case KEY_SYMBOL:
+			if (JSON_IS (k, len, "score")) {
+				reply->key = KEY_SYMBOL_SCORE;
+			}
+			break;
+	}
+
+	return 0;
+}
+
+static int
+json_string (struct rspamd_reply *reply)
+{
+	const char *v = reply->tok.data;
+	size_t len = reply->tok.len;
+
+	switch (reply->key) {
+		case KEY_ACTION:
+			if (JSON_IS (v, len, "reject")) {
+				reply->cur->action = METRIC_ACTION_REJECT;
+			}
+			else if (JSON_IS (v, len, "greylist") || JSON_IS (v, len, "soft reject")) {
+				reply->cur->action = METRIC_ACTION_GREYLIST;
+			}
+			else if (JSON_IS (v, len, "add header")) {
+				reply->cur->action = METRIC_ACTION_ADD_HEADER;
+			}
+			else if (JSON_IS (v, len, "rewrite subject")) {
+				reply->cur->action = METRIC_ACTION_REWRITE_SUBJECT;
+			}
+			else {
+				reply->cur->action = METRIC_ACTION_NOACTION;
+			}
+			break;
+		case KEY_SUBJECT:
+			if ((reply->cur->subject = rspamd_reply_strdup (reply, v, len)) == NULL) {
+				return reply_error (reply, "malloc failed");
+			}
+			break;
+		case KEY_MID:
+			if ((reply->mid = rspamd_reply_strdup (reply, v, len)) == NULL) {
+				return reply_error (reply, "malloc failed");
+			}
+			break;
+	}
+	json_value_end (reply);
+
+	return 0;
+}
+
+static int
+json_literal (struct rspamd_reply *reply)
+{
+	char buf[JSON_LITERAL_MAX + 1], *err;
+	double val;
+
+	memcpy (buf, reply->tok.data, reply->tok.len);
+	buf[reply->tok.len] = '\0';
+	if (strcmp (buf, "true") != 0 && strcmp (buf, "false") != 0 && strcmp (buf, "null") != 0) {
+		val = strtod (buf, &err);
+		if (err == buf || *err != '\0') {
+			return reply_error (reply, "invalid JSON value");
+		}
+		if (reply->key == KEY_SCORE) {
+			reply->cur->score = val;
+		}
+		else if (reply->key == KEY_REQUIRED_SCORE) {
+			reply->cur->required_score = val;
+		}
+		else if (reply->key == KEY_SYMBOL_SCORE) {
+			reply->sym->score = val;
+		}
+	}
+	json_value_end (reply);
+
+	return 0;
+}
+
+static int
+json_open (struct rspamd_reply *reply, char c)
+{
+	struct rspamd_metric_result *cur;
+	int ctx = KEY_OTHER;
+
+	if (reply->depth == RSPAMD_JSON_DEPTH) {
+		return reply_error (reply, "JSON is nested too deeply");
+	}
+	if (reply->depth == 0) {
+		if (c != '{') {
+			return reply_error (reply, "JSON object expected");
+		}
+		if ((cur = rspamd_reply_alloc (reply, sizeof (struct rspamd_metric_result))) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+		bzero (cur, sizeof (struct rspamd_metric_result));
+		TAILQ_INIT (&cur->symbols);
+		if ((cur->metric_name = rspamd_reply_strdup (reply, "default", sizeof ("default") - 1)) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+		TAILQ_INSERT_HEAD (&reply->metrics, cur, entry);
+		reply->cur = cur;
+		ctx = KEY_ROOT;
+	}
+	else if (c == '{' && (reply->key == KEY_SYMBOLS || reply->key == KEY_SYMBOL)) {
+		ctx = reply->key;
+	}
+	reply->stack[reply->depth] = c;
+	reply->ctx[reply->depth] = ctx;
+	reply->depth ++;
+	reply->key = KEY_OTHER;
+	reply->json_state = c == '{' ? JSON_KEY : JSON_VALUE;
+
+	return 0;
+}
+
+static int
+json_close (struct rspamd_reply *reply, char c)
+{
+	struct rspamd_symbol *sym = reply->sym;
+	size_t len;
+	char *name;
+
+	if (reply->depth == 0 || reply->stack[reply->depth - 1] != (c == '}' ? '{' : '[')) {
+		return reply_error (reply, "unbalanced JSON");
+	}
+	reply->depth --;
+	if (reply->ctx[reply->depth] == KEY_SYMBOL && sym != NULL) {
+		/* Symbol is shown as NAME(score) like in RSPAMC replies */
+		len = strlen (sym->symbol) + 32;
+		if ((name = rspamd_reply_alloc (reply, len)) == NULL) {
+			return reply_error (reply, "malloc failed");
+		}
+		snprintf (name, len, "%s(%.2f)", sym->symbol, sym->score);
+		sym->symbol = name;
+		TAILQ_INSERT_HEAD (&reply->cur->symbols, sym, entry);
+		reply->sym = NULL;
+	}
+	json_value_end (reply);
+
+	return 0;
+}
+
+static void
+json_unicode (struct rspamd_reply *reply)
+{
+	unsigned int u = reply->unicode;
+	char out[3];
+	size_t n;
+
+	/* Surrogate pairs are not decoded */
+	if (u >= 0xd800 && u <= 0xdfff) {
+		u = '?';
+	}
+	if (u < 0x80) {
+		out[0] = u;
+		n = 1;
+	}
+	else if (u < 0x800) {
+		out[0] = 0xc0 | (u >> 6);
+		out[1] = 0x80 | (u & 0x3f);
+		n = 2;
+	}
+	else {
+		out[0] = 0xe0 | (u >> 12);
+		out[1] = 0x80 | ((u >> 6) & 0x3f);
+		out[2] = 0x80 | (u & 0x3f);
+		n = 3;
+	}
+	if (reply->save) {
+		buf_append (reply, &reply->tok, out, n);
+	}
+}
+
+static void
+json_feed (struct rspamd_reply *reply, const char *p, size_t len)
+{
+	const char *end = p + len, *c;
+	char ch, esc;
+
+	while (p < end && reply->state != REPLY_ERROR) {
+		ch = *p;
+		switch (reply->json_state) {
+			case JSON_VALUE:
+				if (JSON_SPACE (ch)) {
+					break;
+				}
+				if (ch == '{' || ch == '[') {
+					json_open (reply, ch);
+				}
+				else if (ch == ']' && reply->depth > 0) {
+					json_close (reply, ch);
+				}
+				else if (reply->depth == 0) {
+					reply_error (reply, "JSON object expected");
+				}
+				else if (ch == '"') {
+					reply->in_key = 0;
+					reply->save = reply->key == KEY_ACTION || reply->key == KEY_SUBJECT || reply->key == KEY_MID;
+					reply->tok.len = 0;
+					reply->json_state = JSON_STRING;
+				}
+				else {
+					reply->tok.len = 0;
+					reply->json_state = JSON_LITERAL;
+					continue;
+				}
+				break;
+			case JSON_KEY:
+				if (JSON_SPACE (ch)) {
+					break;
+				}
+				if (ch == '}') {
+					json_close (reply, ch);
+				}
+				else if (ch == '"') {
+					reply->in_key = 1;
+					reply->save = reply->ctx[reply->depth - 1] != KEY_OTHER;
+					reply->tok.len = 0;
+					reply->json_state = JSON_STRING;
+				}
+				else {
+					reply_error (reply, "JSON key expected");
+				}
+				break;
+			case JSON_COLON:
+				if (ch == ':') {
+					reply->json_state = JSON_VALUE;
+				}
+				else if (!JSON_SPACE (ch)) {
+					reply_error (reply, "JSON colon expected");
+				}
+				break;
+			case JSON_AFTER_VALUE:
+				if (ch == ',') {
+					reply->json_state = reply->stack[reply->depth - 1] == '{' ? JSON_KEY : JSON_VALUE;
+				}
+				else if (ch == '}' || ch == ']') {
+					json_close (reply, ch);
+				}
+				else if (!JSON_SPACE (ch)) {
+					reply_error (reply, "JSON comma expected");
+				}
+				break;
+			case JSON_STRING:
+				/* Copy run of plain characters at once */
+				for (c = p; c < end && *c != '"' && *c != '\\'; c++);
+				if (reply->save && c > p && buf_append (reply, &reply->tok, p, c - p) == -1) {
+					break;
+				}
+				p = c;
+				if (p == end) {
+					continue;
+				}
+				if (*p == '\\') {
+					reply->json_state = JSON_ESCAPE;
+				}
+				else if (reply->in_key) {
+					if (json_key (reply) == 0) {
+						reply->json_state = JSON_COLON;
+					}
+				}
+				else {
+					json_string (reply);
+				}
+				break;
+			case JSON_ESCAPE:
+				reply->json_state = JSON_STRING;
+				switch (ch) {
+					case 'b':
+						esc = '\b';
+						break;
+					case 'f':
+						esc = '\f';
+						break;
+					case 'n':
+						esc = '\n';
+						break;
+					case 'r':
+						esc = '\r';
+						break;
+					case 't':
+						esc = '\t';
+						break;
+					case 'u':
+						reply->unicode = 0;
+						reply->unicode_len = 0;
+						reply->json_state = JSON_UNICODE;
+						esc = '\0';
+						break;
+					default:
+						esc = ch;
+						break;
+				}
+				if (esc != '\0' && reply->save) {
+					buf_append (reply, &reply->tok, &esc, 1);
+				}
+				break;
+			case JSON_UNICODE:
+				if (!isxdigit ((unsigned char)ch)) {
+					reply_error (reply, "invalid JSON unicode escape");
+					break;
+				}
+				reply->unicode = reply->unicode * 16 + (isdigit ((unsigned char)ch) ? ch - '0' : tolower ((unsigned char)ch) - 'a' + 10);
+				if (++reply->unicode_len == 4) {
+					json_unicode (reply);
+					reply->json_state = JSON_STRING;
+				}
+				break;
+			case JSON_LITERAL:
+				for (c = p; c < end && JSON_LITERAL_CHAR (*c); c++);
+				if (reply->tok.len + (c - p) > JSON_LITERAL_MAX) {
+					reply_error (reply, "too long JSON value");
+					break;
+				}
+				if (c > p) {
+					buf_append (reply, &reply->tok, p, c - p);
+				}
+				p = c;
+				/* Character after literal is parsed in the next state */
+				if (p < end) {
+					json_literal (reply);
+				}
+				continue;
+			case JSON_DONE:
+				if (!JSON_SPACE (ch)) {
+					reply_error (reply, "garbage after JSON");
+				}
+				break;
+		}
+		p ++;
+	}
+}
+
+/*
+ * HTTP reply
+ */
+
+#define HEADER(p, end, h) ((size_t)((end) - (p)) >= sizeof (h) - 1 && strncasecmp ((p), (h), sizeof (h) - 1) == 0)
+
+/* Whole body is received */
+static int
+http_done (struct rspamd_reply *reply)
+{
+	if (reply->json_state != JSON_DONE) {
+		return reply_error (reply, "JSON is incomplete");
+	}
+	reply->state = REPLY_DONE;
+
+	return 0;
+}
+
+static int
+http_number (const char *p, const char *end, int base, size_t *res)
+{
+	size_t n = 0;
+	int d;
+	const char *start = p;
+
+	for (; p < end && isxdigit ((unsigned char)*p); p++) {
+		d = isdigit ((unsigned char)*p) ? *p - '0' : tolower ((unsigned char)*p) - 'a' + 10;
+		if (d >= base || n > (RSPAMD_BODY_MAX - d) / base) {
+			return -1;
+		}
+		n = n * base + d;
+	}
+	*res = n;
+
+	return p == start ? -1 : 0;
+}
+
+static int
+http_line (struct rspamd_reply *reply, const char *p, size_t len)
+{
+	const char *end, *c;
+
+	if (len > 0 && p[len - 1] == '\r') {
+		len --;
+	}
+	end = p + len;
+
+	switch (reply->state) {
+		case REPLY_HTTP_STATUS:
+			/* HTTP/1.1 200 OK */
+			if (!KEYWORD (p, end, "HTTP/1.") || len < sizeof ("HTTP/1.1 200") - 1) {
+				return reply_error (reply, "invalid HTTP status line");
+			}
+			reply->keepalive = p[7] == '1';
+			c = skip_spaces (p + 8, end);
+			if (!KEYWORD (c, end, "200")) {
+				reply->server_error = 1;
+				return reply_error (reply, "server returned HTTP error");
+			}
+			reply->state = REPLY_HTTP_HEADER;
+			break;
+		case REPLY_HTTP_HEADER:
+			if (len == 0) {
+				if (reply->chunked) {
+					reply->state = REPLY_HTTP_CHUNK_SIZE;
+				}
+				else if (!reply->length_known) {
+					/* Body ends when server closes connection */
+					reply->keepalive = 0;
+					reply->state = REPLY_HTTP_BODY;
+				}
+				else if (reply->body_left == 0) {
+					return http_done (reply);
+				}
+				else {
+					reply->state = REPLY_HTTP_BODY;
+				}
+			}
+			else if (HEADER (p, end, "Content-Length:")) {
+				if (http_number (skip_spaces (p + sizeof ("Content-Length:") - 1, end), end, 10,
+						&reply->body_left) == -1) {
+					return reply_error (reply, "invalid Content-Length");
+				}
+				reply->length_known = 1;
+			}
+			else if (HEADER (p, end, "Transfer-Encoding:")) {
+				c = skip_spaces (p + sizeof ("Transfer-Encoding:") - 1, end);
+				reply->chunked = HEADER (c, end, "chunked");
+			}
+			else if (HEADER (p, end, "Connection:")) {
+				c = skip_spaces (p + sizeof ("Connection:") - 1, end);
+				if (HEADER (c, end, "close")) {
+					reply->keepalive = 0;
+				}
+				else if (HEADER (c, end, "keep-alive")) {
+					reply->keepalive = 1;
+				}
+			}
+			break;
+		case REPLY_HTTP_CHUNK_SIZE:
+			if (http_number (p, end, 16, &reply->body_left) == -1) {
+				return reply_error (reply, "invalid chunk size");
+			}
+			reply->state = reply->body_left == 0 ? REPLY_HTTP_TRAILER : REPLY_HTTP_CHUNK;
+			break;
+		case REPLY_HTTP_CHUNK_END:
+			if (len != 0) {
+				return reply_error (reply, "invalid chunk");
+			}
+			reply->state = REPLY_HTTP_CHUNK_SIZE;
+			break;
+		case REPLY_HTTP_TRAILER:
+			if (len == 0) {
+				return http_done (reply);
+			}
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse next piece of HTTP reply, returns 1 when reply is complete and -1 if
+ * it is invalid
+ */
+int
+rspamd_http_feed (struct rspamd_reply *reply, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len, *eol;
+	size_t n;
+
+	if (reply->state == REPLY_STATUS) {
+		reply->state = REPLY_HTTP_STATUS;
+	}
+	while (p < end && reply->state != REPLY_ERROR && reply->state != REPLY_DONE) {
+		if (reply->state == REPLY_HTTP_BODY || reply->state == REPLY_HTTP_CHUNK) {
+			n = end - p;
+			if (reply->state == REPLY_HTTP_BODY && !reply->length_known) {
+				/* Body ends when server closes connection */
+				json_feed (reply, p, n);
+				p += n;
+				continue;
+			}
+			if (n > reply->body_left) {
+				n = reply->body_left;
+			}
+			json_feed (reply, p, n);
+			p += n;
+			reply->body_left -= n;
+			if (reply->body_left == 0 && reply->state == REPLY_HTTP_CHUNK) {
+				reply->state = REPLY_HTTP_CHUNK_END;
+			}
+			else if (reply->body_left == 0 && reply->state == REPLY_HTTP_BODY) {
+				http_done (reply);
+			}
+			continue;
+		}
+		/* Status line, headers and chunk sizes */
+		if ((eol = memchr (p, '\n', end - p)) == NULL) {
+			buf_append (reply, &reply->line, p, end - p);
+			break;
+		}
+		if (reply->line.len > 0) {
+			if (buf_append (reply, &reply->line, p, eol - p) == 0) {
+				http_line (reply, reply->line.data, reply->line.len);
+			}
+			reply->line.len = 0;
+		}
+		else {
+			http_line (reply, p, eol - p);
+		}
+		p = eol + 1;
+	}
+
+	if (reply->state == REPLY_ERROR) {
+		return -1;
+	}
+
+	return reply->state == REPLY_DONE ? 1 : 0;
+}
+
+/* Server closed connection, returns -1 if reply is not complete */
+int
+rspamd_http_end (struct rspamd_reply *reply)
+{
+	if (reply->state == REPLY_HTTP_BODY && !reply->length_known) {
+		http_done (reply);
+	}
+	if (reply->state != REPLY_DONE && reply->state != REPLY_ERROR) {
+		reply_error (reply, "reply is incomplete");
+	}
+
+	return reply->state == REPLY_DONE ? 0 : -1;
+}
+
+/* 
+ * vi:ts=4 
+ */
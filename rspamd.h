@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RSPAMD_H
+#define RSPAMD_H
+
+#include <sys/types.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+#ifndef OWN_QUEUE_H
+#include <sys/queue.h>
+#else
+#include "queue.h"
+#endif
+
+/* Longer reply lines are treated as broken reply */
+#define RSPAMD_LINE_MAX 65536
+
+/* Structure for rspamd results */
+enum rspamd_metric_action {
+	METRIC_ACTION_NOACTION = 0,
+	METRIC_ACTION_GREYLIST,
+	METRIC_ACTION_ADD_HEADER,
+	METRIC_ACTION_REWRITE_SUBJECT,
+	METRIC_ACTION_REJECT
+};
+
+struct rspamd_symbol {
+	char *symbol;
+	double score;
+	TAILQ_ENTRY(rspamd_symbol) entry;
+};
+
+struct rspamd_metric_result {
+	char *metric_name;
+	double score;
+	double required_score;
+	double reject_score;
+	enum rspamd_metric_action action;
+	char *subject;
+	TAILQ_HEAD (symbolq, rspamd_symbol) symbols;
+	TAILQ_ENTRY (rspamd_metric_result) entry;
+};
+
+typedef TAILQ_HEAD(metricsq, rspamd_metric_result) rspamd_result_t;
+
+/* Larger HTTP body is an error */
+#define RSPAMD_BODY_MAX 0x7fffffff
+
+/* Nesting of JSON reply deeper than this is an error */
+#define RSPAMD_JSON_DEPTH 32
+
+struct rspamd_arena;
+
+struct rspamd_buf {
+	char *data;
+	size_t len;
+	size_t allocated;
+};
+
+/*
+ * Reply of spamd server, parsed as it is read from socket; all results are
+ * allocated from arena and released by rspamd_reply_free
+ */
+struct rspamd_reply {
+	rspamd_result_t metrics;
+	char *mid;
+	/* Description of parse error */
+	const char *err;
+	/* Server has replied with error code */
+	int server_error;
+	/* HTTP connection can be reused */
+	int keepalive;
+
+	int state;
+	struct rspamd_metric_result *cur;
+	/* Incomplete line from the previous read */
+	struct rspamd_buf line;
+	struct rspamd_arena *arena;
+
+	/* HTTP body */
+	int chunked;
+	int length_known;
+	size_t body_left;
+
+	/* JSON parser */
+	int json_state;
+	int depth;
+	char stack[RSPAMD_JSON_DEPTH];
+	unsigned char ctx[RSPAMD_JSON_DEPTH];
+	int key;
+	int in_key;
+	int save;
+	unsigned int unicode;
+	int unicode_len;
+	struct rspamd_buf tok;
+	struct rspamd_symbol *sym;
+};
+
+void rspamd_reply_init (struct rspamd_reply *reply);
+int rspamd_reply_feed (struct rspamd_reply *reply, const char *buf, size_t len);
+int rspamd_reply_end (struct rspamd_reply *reply);
+void rspamd_reply_free (struct rspamd_reply *reply);
+void *rspamd_reply_alloc (struct rspamd_reply *reply, size_t len);
+char *rspamd_reply_strdup (struct rspamd_reply *reply, const char *s, size_t len);
+int rspamd_http_feed (struct rspamd_reply *reply, const char *buf, size_t len);
+int rspamd_http_end (struct rspamd_reply *reply);
+
+#endif
+/* 
+ * vi:ts=4 
+ */
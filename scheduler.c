@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "cfg_file.h"
+#include "rmilter.h"
+#include "scheduler.h"
+
+/* Statistic is logged after this number of scans */
+#define SCAN_STAT_EVERY 1000
+
+static const char *scan_class_names[SCAN_CLASS_MAX] = {
+	"auth", "reply", "normal", "suspicious"
+};
+
+static const int scan_class_weights[SCAN_CLASS_MAX] = {
+	SCAN_WEIGHT_AUTH, SCAN_WEIGHT_REPLY, SCAN_WEIGHT_NORMAL, SCAN_WEIGHT_SUSPICIOUS
+};
+
+scan_sched_t *
+scan_sched_init (const char *name, unsigned int limit, unsigned int timeout)
+{
+	scan_sched_t *new;
+	int i;
+
+	new = malloc (sizeof (scan_sched_t));
+	if (new == NULL) {
+		return NULL;
+	}
+	bzero (new, sizeof (scan_sched_t));
+	new->name = name;
+	new->limit = limit;
+	new->timeout = timeout;
+	for (i = 0; i < SCAN_CLASS_MAX; i ++) {
+		TAILQ_INIT (&new->queues[i]);
+	}
+	pthread_mutex_init (&new->mtx, NULL);
+
+	return new;
+}
+
+/*
+ * Authenticated senders and replies to our messages go first, clients
+ * without reverse DNS are served last
+ */
+enum scan_class
+scan_class_get (const struct mlfi_priv *priv)
+{
+	if (priv->priv_user[0] != '\0') {
+		return SCAN_CLASS_AUTH;
+	}
+	if (!priv->strict) {
+		return SCAN_CLASS_REPLY;
+	}
+	if (priv->priv_hostname[0] == '\0' || strcmp (priv->priv_hostname, "unknown") == 0) {
+		return SCAN_CLASS_SUSPICIOUS;
+	}
+
+	return SCAN_CLASS_NORMAL;
+}
+
+/* Give free slot to waiter, called with mutex locked */
+static void
+scan_sched_dispatch (scan_sched_t *sched)
+{
+	struct scan_waiter *w, *best = NULL;
+	int i, cls = 0;
+
+	if (sched->inflight >= sched->limit) {
+		return;
+	}
+	/* Waiter that finishes first in virtual time */
+	for (i = 0; i < SCAN_CLASS_MAX; i ++) {
+		w = TAILQ_FIRST (&sched->queues[i]);
+		if (w != NULL && (best == NULL || w->finish < best->finish)) {
+			best = w;
+			cls = i;
+		}
+	}
+	if (best != NULL) {
+		TAILQ_REMOVE (&sched->queues[cls], best, entry);
+		sched->inflight ++;
+		sched->vtime = best->finish;
+		best->granted = 1;
+		pthread_cond_signal (&best->cond);
+	}
+}
+
+/*
+ * Waiter leaves queue without scan, finish times of waiters behind it are
+ * computed again as if it has not come, called with mutex locked
+ */
+static void
+scan_sched_forget (scan_sched_t *sched, enum scan_class cls, struct scan_waiter *w)
+{
+	struct scan_waiter *n;
+	double last = w->prev, begin;
+
+	for (n = TAILQ_NEXT (w, entry); n != NULL; n = TAILQ_NEXT (n, entry)) {
+		n->prev = last;
+		begin = n->vtime > last ? n->vtime : last;
+		n->finish = begin + 1.0 / scan_class_weights[cls];
+		last = n->finish;
+	}
+	sched->last_finish[cls] = last;
+	TAILQ_REMOVE (&sched->queues[cls], w, entry);
+}
+
+/* Add wait time to statistic, start is NULL if scan has not waited, called with mutex locked */
+static void
+scan_sched_stat (scan_sched_t *sched, enum scan_class cls, struct timeval *start, int timeout)
+{
+	struct scan_class_stat *st = &sched->stat[cls];
+	struct timeval now;
+	unsigned int ms;
+	char buf[512];
+	int i, r = 0;
+
+	st->scans ++;
+	if (start != NULL) {
+		gettimeofday (&now, NULL);
+		ms = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+		st->queued ++;
+		st->wait_ms += ms;
+		if (ms > st->max_wait_ms) {
+			st->max_wait_ms = ms;
+		}
+		if (timeout) {
+			st->timeouts ++;
+		}
+	}
+	if (++ sched->total % SCAN_STAT_EVERY != 0) {
+		return;
+	}
+	for (i = 0; i < SCAN_CLASS_MAX; i ++) {
+		st = &sched->stat[i];
+		r += snprintf (buf + r, sizeof (buf) - r, "%s%s: %lu scans, %lu queued, %.1f ms avg wait, %u ms max wait, %lu timeouts",
+				i == 0 ? "" : "; ", scan_class_names[i], st->scans, st->queued,
+				st->queued != 0 ? (double)st->wait_ms / st->queued : 0.0, st->max_wait_ms, st->timeouts);
+	}
+	msg_info ("scan_sched: %s: %s", sched->name, buf);
+}
+
+/*
+ * scan_sched_enter() - wait for free slot to scan message of class cls
+ *
+ * returns 0 if scan can be started, -1 if queue timeout is exceeded
+ */
+int
+scan_sched_enter (scan_sched_t *sched, enum scan_class cls)
+{
+	struct scan_waiter w;
+	struct timeval start;
+	struct timespec deadline;
+	double begin;
+	int r = 0;
+
+	if (sched == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock (&sched->mtx);
+	w.vtime = sched->vtime;
+	w.prev = sched->last_finish[cls];
+	begin = w.vtime > w.prev ? w.vtime : w.prev;
+	w.finish = begin + 1.0 / scan_class_weights[cls];
+	sched->last_finish[cls] = w.finish;
+	if (sched->inflight < sched->limit) {
+		/* Queues are empty when there is free slot */
+		sched->inflight ++;
+		sched->vtime = w.finish;
+		scan_sched_stat (sched, cls, NULL, 0);
+		pthread_mutex_unlock (&sched->mtx);
+		return 0;
+	}
+
+	gettimeofday (&start, NULL);
+	deadline.tv_sec = start.tv_sec + sched->timeout / 1000;
+	deadline.tv_nsec = start.tv_usec * 1000 + (sched->timeout % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec ++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	w.granted = 0;
+	pthread_cond_init (&w.cond, NULL);
+	TAILQ_INSERT_TAIL (&sched->queues[cls], &w, entry);
+	while (!w.granted && r != ETIMEDOUT) {
+		r = pthread_cond_timedwait (&w.cond, &sched->mtx, &deadline);
+	}
+	if (!w.granted) {
+		scan_sched_forget (sched, cls, &w);
+	}
+	scan_sched_stat (sched, cls, &start, !w.granted);
+	pthread_mutex_unlock (&sched->mtx);
+	pthread_cond_destroy (&w.cond);
+
+	return w.granted ? 0 : -1;
+}
+
+/*
+ * scan_sched_leave() - scan is finished, its slot is given to the next waiter
+ */
+void
+scan_sched_leave (scan_sched_t *sched)
+{
+	if (sched == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock (&sched->mtx);
+	sched->inflight --;
+	scan_sched_dispatch (sched);
+	pthread_mutex_unlock (&sched->mtx);
+}
+
+void
+scan_sched_destroy (scan_sched_t *sched)
+{
+	pthread_mutex_destroy (&sched->mtx);
+	free (sched);
+}
+
+/*
+ * vi:ts=4
+ */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <sys/types.h>
+#include <pthread.h>
+#ifndef OWN_QUEUE_H
+#include <sys/queue.h>
+#else
+#include "queue.h"
+#endif
+
+/*
+ * Scan scheduler: number of scans running on one pool of servers is limited,
+ * other scans wait in queues of their classes served by weighted fair queuing
+ */
+enum scan_class {
+	SCAN_CLASS_AUTH = 0,
+	SCAN_CLASS_REPLY,
+	SCAN_CLASS_NORMAL,
+	SCAN_CLASS_SUSPICIOUS,
+	SCAN_CLASS_MAX
+};
+
+/* Share of scans of each class when all queues are busy */
+#define SCAN_WEIGHT_AUTH 8
+#define SCAN_WEIGHT_REPLY 4
+#define SCAN_WEIGHT_NORMAL 2
+#define SCAN_WEIGHT_SUSPICIOUS 1
+
+#define DEFAULT_SCAN_QUEUE_TIMEOUT 10000
+
+struct mlfi_priv;
+
+struct scan_waiter {
+	/* Virtual time when waiter came */
+	double vtime;
+	/* Finish time of previous scan of the same class */
+	double prev;
+	/* Virtual time when scan is finished */
+	double finish;
+	int granted;
+	pthread_cond_t cond;
+	TAILQ_ENTRY(scan_waiter) entry;
+};
+
+struct scan_class_stat {
+	unsigned long scans;
+	unsigned long queued;
+	unsigned long timeouts;
+	unsigned long long wait_ms;
+	unsigned int max_wait_ms;
+};
+
+typedef struct scan_sched_s {
+	const char *name;
+	/* Maximum number of scans in flight */
+	unsigned int limit;
+	unsigned int inflight;
+	/* Maximum time in queue in milliseconds */
+	unsigned int timeout;
+	double vtime;
+	double last_finish[SCAN_CLASS_MAX];
+	TAILQ_HEAD (scan_waitq, scan_waiter) queues[SCAN_CLASS_MAX];
+	struct scan_class_stat stat[SCAN_CLASS_MAX];
+	unsigned long total;
+	pthread_mutex_t mtx;
+} scan_sched_t;
+
+scan_sched_t * scan_sched_init (const char *name, unsigned int limit, unsigned int timeout);
+enum scan_class scan_class_get (const struct mlfi_priv *priv);
+int scan_sched_enter (scan_sched_t *sched, enum scan_class cls);
+void scan_sched_leave (scan_sched_t *sched);
+void scan_sched_destroy (scan_sched_t *sched);
+
+#endif
+/*
+ * vi:ts=4
+ */
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_PATH_MAX
+#include <limits.h>
+#endif
+#ifdef HAVE_MAXPATHLEN
+#include <sys/param.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "cfg_file.h"
+#include "rmilter.h"
+#include "libspamd.h"
+#include "shadow.h"
+
+struct shadow_job {
+	/* Copy of message data, file is a link to temp file */
+	struct mlfi_priv priv;
+	/* Result of primary scan */
+	int action;
+	TAILQ_ENTRY(shadow_job) entry;
+};
+
+extern struct config_file *cfg;
+
+static TAILQ_HEAD (shadowq, shadow_job) shadow_queue = TAILQ_HEAD_INITIALIZER (shadow_queue);
+static unsigned int shadow_len = 0;
+static unsigned long shadow_dropped = 0;
+static pthread_mutex_t shadow_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shadow_cond = PTHREAD_COND_INITIALIZER;
+
+static void
+shadow_job_free (struct shadow_job *job)
+{
+	struct rcpt *rcpt, *next;
+
+	unlink (job->priv.file);
+	rcpt = job->priv.rcpts.lh_first;
+	while (rcpt) {
+		next = rcpt->r_list.le_next;
+		free (rcpt);
+		rcpt = next;
+	}
+	free (job);
+}
+
+static void *
+shadow_thread (void *unused)
+{
+	struct shadow_job *job;
+	char *subject = NULL;
+	int r;
+
+	while (1) {
+		pthread_mutex_lock (&shadow_mtx);
+		while (TAILQ_EMPTY (&shadow_queue)) {
+			pthread_cond_wait (&shadow_cond, &shadow_mtx);
+		}
+		job = TAILQ_FIRST (&shadow_queue);
+		TAILQ_REMOVE (&shadow_queue, job, entry);
+		shadow_len --;
+		pthread_mutex_unlock (&shadow_mtx);
+
+		CFG_RLOCK();
+		if (cfg->extra_spamd_servers_num != 0) {
+			r = spamdscan (NULL, &job->priv, cfg, &subject, 1);
+			if (r < 0) {
+				msg_warn ("shadow_thread: %s: extra_spamdscan() failed, %d", job->priv.mlfi_id, r);
+			}
+			else if (r != job->action) {
+				msg_warn ("shadow_thread: %s: spamd_extra_scan returned %d and normal scan returned %d",
+						job->priv.mlfi_id, r, job->action);
+				shadow_diff (cfg, &job->priv, job->action, r);
+			}
+		}
+		CFG_UNLOCK();
+		if (subject != NULL) {
+			free (subject);
+			subject = NULL;
+		}
+		shadow_job_free (job);
+	}
+
+	return NULL;
+}
+
+int
+shadow_start (void)
+{
+	pthread_t thr;
+	int i;
+
+	for (i = 0; i < SHADOW_WORKERS; i++) {
+		if (pthread_create (&thr, NULL, shadow_thread, NULL) != 0) {
+			return -1;
+		}
+		pthread_detach (thr);
+	}
+
+	return 0;
+}
+
+/* Queue message for scan on extra servers, returns -1 if it is skipped */
+int
+shadow_add (struct mlfi_priv *priv, int action)
+{
+	struct shadow_job *job;
+	struct rcpt *rcpt, *copy, *last = NULL;
+	unsigned long dropped = 0;
+
+	pthread_mutex_lock (&shadow_mtx);
+	if (shadow_len >= SHADOW_QUEUE_MAX) {
+		dropped = ++shadow_dropped;
+	}
+	pthread_mutex_unlock (&shadow_mtx);
+	if (dropped != 0) {
+		if (dropped % SHADOW_QUEUE_MAX == 1) {
+			msg_warn ("shadow_add: %s: queue is full, %lu messages skipped", priv->mlfi_id, dropped);
+		}
+		return -1;
+	}
+	if ((job = malloc (sizeof (struct shadow_job))) == NULL) {
+		return -1;
+	}
+	memcpy (&job->priv, priv, sizeof (struct mlfi_priv));
+	/* Temp file of message is removed on cleanup so keep it by link */
+	if (snprintf (job->priv.file, sizeof (job->priv.file), "%s.shadow", priv->file) >= (int)sizeof (job->priv.file)) {
+		free (job);
+		return -1;
+	}
+	if (link (priv->file, job->priv.file) == -1) {
+		msg_warn ("shadow_add: %s: cannot link %s: %m", priv->mlfi_id, priv->file);
+		free (job);
+		return -1;
+	}
+	/* Only SMTP data is used by scan */
+	job->priv.fileh = NULL;
+	job->priv.priv_subject = NULL;
+	job->priv.body_match = NULL;
+	job->priv.mime = NULL;
+	job->priv.verdict = NULL;
+#ifdef ENABLE_DKIM
+	job->priv.dkim = NULL;
+#endif
+	LIST_INIT (&job->priv.rcpts);
+	LIST_FOREACH (rcpt, &priv->rcpts, r_list) {
+		if ((copy = malloc (sizeof (struct rcpt))) == NULL) {
+			shadow_job_free (job);
+			return -1;
+		}
+		memcpy (copy, rcpt, sizeof (struct rcpt));
+		/* Keep order of recipients */
+		if (last == NULL) {
+			LIST_INSERT_HEAD (&job->priv.rcpts, copy, r_list);
+		}
+		else {
+			LIST_INSERT_AFTER (last, copy, r_list);
+		}
+		last = copy;
+	}
+	job->action = action;
+
+	pthread_mutex_lock (&shadow_mtx);
+	TAILQ_INSERT_TAIL (&shadow_queue, job, entry);
+	shadow_len ++;
+	pthread_cond_signal (&shadow_cond);
+	pthread_mutex_unlock (&shadow_mtx);
+
+	return 0;
+}
+
+/* Save copy of message that has different results to diff_dir */
+void
+shadow_diff (struct config_file *cfg, struct mlfi_priv *priv, int action, int extra_action)
+{
+#ifdef HAVE_PATH_MAX
+	char path[PATH_MAX];
+#elif defined(HAVE_MAXPATHLEN)
+	char path[MAXPATHLEN];
+#else
+#error "neither PATH_MAX nor MAXPATHLEN defined"
+#endif
+	char buf[BUFSIZ];
+	int in, out;
+	ssize_t r;
+
+	if (cfg->diff_dir == NULL) {
+		return;
+	}
+	snprintf (path, sizeof (path), "%s/%s.%d.%d", cfg->diff_dir,
+			*priv->mlfi_id ? priv->mlfi_id : "NOQUEUE", action, extra_action);
+	if ((in = open (priv->file, O_RDONLY)) == -1) {
+		msg_warn ("shadow_diff: cannot open %s: %m", priv->file);
+		return;
+	}
+	if ((out = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		msg_warn ("shadow_diff: cannot open %s: %m", path);
+		close (in);
+		return;
+	}
+	while ((r = read (in, buf, sizeof (buf))) > 0) {
+		if (write (out, buf, r) != r) {
+			msg_warn ("shadow_diff: cannot write %s: %m", path);
+			break;
+		}
+	}
+	close (in);
+	close (out);
+}
+
+/* Remove links of messages that are not scanned yet */
+void
+shadow_destroy (void)
+{
+	struct shadow_job *job;
+
+	pthread_mutex_lock (&shadow_mtx);
+	while ((job = TAILQ_FIRST (&shadow_queue)) != NULL) {
+		TAILQ_REMOVE (&shadow_queue, job, entry);
+		shadow_job_free (job);
+	}
+	shadow_len = 0;
+	pthread_mutex_unlock (&shadow_mtx);
+}
+
+/*
+ * vi:ts=4
+ */
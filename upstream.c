@@ -29,7 +29,9 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/time.h>
 #include <time.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #ifdef HAVE_STDINT_H
@@ -63,6 +65,10 @@ pthread_rwlock_t upstream_mtx = PTHREAD_RWLOCK_INITIALIZER;
 
 #define MAX_TRIES 20
 
+/* Delays between rounds of retries in milliseconds */
+#define UPSTREAM_BACKOFF_MIN 100
+#define UPSTREAM_BACKOFF_MAX 1000
+
 /*
  * Poly: 0xedb88320
  * Init: 0x0
@@ -539,6 +545,97 @@ get_upstream_by_hash_ketama (void *ups, size_t members, size_t msize, time_t now
 	return nearest;
 }
 
+/*
+ * Retries of one request: every alive upstream is tried once before waiting,
+ * then next round starts after short random delay; all attempts share time
+ * budget
+ */
+void
+upstream_retry_init (struct upstream_retry *rt, unsigned int budget)
+{
+	gettimeofday (&rt->start, NULL);
+	rt->budget = budget;
+	rt->attempts = 0;
+	rt->rounds = 0;
+	rt->tried = 0;
+}
+
+/* Milliseconds spent since start of request */
+unsigned int
+upstream_retry_elapsed (struct upstream_retry *rt)
+{
+	struct timeval now;
+
+	gettimeofday (&now, NULL);
+
+	return (now.tv_sec - rt->start.tv_sec) * 1000 + (now.tv_usec - rt->start.tv_usec) / 1000;
+}
+
+/*
+ * Return upstream for next attempt: selected one if it was not tried in this
+ * round, otherwise any other alive upstream not tried yet; NULL when all alive
+ * upstreams are tried
+ */
+struct upstream *
+upstream_retry_select (struct upstream_retry *rt, struct upstream *up, void *ups, size_t members, size_t msize)
+{
+	size_t i, n, start;
+	struct upstream *cur;
+
+	n = ((u_char *)up - (u_char *)ups) / msize;
+	if (n < UPSTREAM_RETRY_MAX && (rt->tried & ((uint64_t)1 << n)) != 0) {
+		up = NULL;
+		start = rand () % members;
+		U_RLOCK ();
+		for (i = 0; i < members; i++) {
+			n = (start + i) % members;
+			cur = (struct upstream *)((u_char *)ups + n * msize);
+			if (!cur->dead && (n >= UPSTREAM_RETRY_MAX || (rt->tried & ((uint64_t)1 << n)) == 0)) {
+				up = cur;
+				break;
+			}
+		}
+		U_UNLOCK ();
+	}
+	if (up != NULL) {
+		if (n < UPSTREAM_RETRY_MAX) {
+			rt->tried |= (uint64_t)1 << n;
+		}
+		rt->attempts ++;
+	}
+
+	return up;
+}
+
+/*
+ * All upstreams failed: wait 100ms, 200ms... up to 1s with random jitter and
+ * start next round; returns -1 if budget is spent
+ */
+int
+upstream_retry_backoff (struct upstream_retry *rt)
+{
+	unsigned int delay, elapsed;
+	struct timespec ts;
+
+	delay = UPSTREAM_BACKOFF_MIN << (rt->rounds < 4 ? rt->rounds : 4);
+	if (delay > UPSTREAM_BACKOFF_MAX) {
+		delay = UPSTREAM_BACKOFF_MAX;
+	}
+	delay = delay / 2 + rand () % (delay / 2 + 1);
+	elapsed = upstream_retry_elapsed (rt);
+	if (elapsed + delay >= rt->budget) {
+		return -1;
+	}
+
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while (nanosleep (&ts, &ts) == -1 && errno == EINTR);
+	rt->rounds ++;
+	rt->tried = 0;
+
+	return 0;
+}
+
 #undef U_LOCK
 #undef U_UNLOCK
 #undef msg_debug
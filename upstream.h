@@ -28,7 +28,10 @@
 #define UPSTREAM_H
 
 #include <sys/types.h>
+#include <sys/time.h>
 
+/* Upstreams beyond this number are not remembered as tried */
+#define UPSTREAM_RETRY_MAX 64
 
 struct upstream {
 	unsigned int errors;
@@ -40,6 +43,15 @@ struct upstream {
 	size_t ketama_points_size;
 };
 
+/* Retries of one request within time budget in milliseconds */
+struct upstream_retry {
+	struct timeval start;
+	unsigned int budget;
+	unsigned int attempts;
+	unsigned int rounds;
+	uint64_t tried;
+};
+
 void upstream_fail (struct upstream *up, time_t now);
 void upstream_ok (struct upstream *up, time_t now);
 void revive_all_upstreams (void *ups, size_t members, size_t msize);
@@ -66,6 +78,12 @@ struct upstream* get_upstream_master_slave (void *ups, size_t members, size_t ms
 										time_t now, time_t error_timeout,
 										time_t revive_timeout, size_t max_errors);
 
+void upstream_retry_init (struct upstream_retry *rt, unsigned int budget);
+struct upstream* upstream_retry_select (struct upstream_retry *rt, struct upstream *up,
+										void *ups, size_t members, size_t msize);
+int upstream_retry_backoff (struct upstream_retry *rt);
+unsigned int upstream_retry_elapsed (struct upstream_retry *rt);
+
 #endif /* UPSTREAM_H */
 /* 
  * vi:ts=4 
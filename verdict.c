@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include "md5.h"
+
+#ifdef _THREAD_SAFE
+#include <pthread.h>
+#define V_LOCK(bucket, cache) do { pthread_mutex_lock (&(cache)->locks[(bucket) % VERDICT_LOCKS]); } while (0)
+#define V_UNLOCK(bucket, cache) do { pthread_mutex_unlock (&(cache)->locks[(bucket) % VERDICT_LOCKS]); } while (0)
+#else
+#define V_LOCK(bucket, cache) do {} while (0)
+#define V_UNLOCK(bucket, cache) do {} while (0)
+#endif
+
+#include "verdict.h"
+#include "rmilter.h"
+
+#define VERDICT_ITEM(cache, bucket, i) (&(cache)->items[(bucket) * VERDICT_WAYS + (i)])
+
+struct verdict_body {
+	MD5_CTX ctx;
+};
+
+static const struct {
+	const char *name;
+	int flag;
+} verdict_keys[] = {
+	{ "from", VERDICT_KEY_FROM },
+	{ "from_domain", VERDICT_KEY_FROM_DOMAIN },
+	{ "ip", VERDICT_KEY_IP },
+	{ "ip24", VERDICT_KEY_IP24 },
+	{ "helo", VERDICT_KEY_HELO },
+	{ "user", VERDICT_KEY_USER },
+	{ "rcpt", VERDICT_KEY_RCPT },
+	{ "subject", VERDICT_KEY_SUBJECT },
+	{ NULL, 0 }
+};
+
+verdict_cache_t *
+verdict_init (size_t size, int ttl, int key_flags)
+{
+	verdict_cache_t *result;
+	size_t buckets;
+#ifdef _THREAD_SAFE
+	int i;
+#endif
+
+	/* Cache memory is limited by size */
+	buckets = size / (sizeof (verdict_item_t) * VERDICT_WAYS);
+	if (buckets == 0) {
+		return NULL;
+	}
+
+	result = malloc (sizeof (verdict_cache_t));
+	if (result == NULL) {
+		return NULL;
+	}
+	bzero (result, sizeof (verdict_cache_t));
+
+	result->items = calloc (buckets * VERDICT_WAYS, sizeof (verdict_item_t));
+	if (result->items == NULL) {
+		free (result);
+		return NULL;
+	}
+	result->buckets = buckets;
+	result->ttl = ttl;
+	result->key_flags = key_flags;
+#ifdef _THREAD_SAFE
+	for (i = 0; i < VERDICT_LOCKS; i++) {
+		pthread_mutex_init (&result->locks[i], NULL);
+	}
+#endif
+
+	return result;
+}
+
+/*
+ * Parse list of key components like "from_domain, ip24",
+ * returns VERDICT_KEY_* flags or -1 for unknown component
+ */
+int
+verdict_parse_key (const char *str)
+{
+	const char *p = str, *end;
+	size_t len;
+	int flags = 0, i;
+
+	while (*p) {
+		while (*p == ',' || isspace ((u_char)*p)) {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		end = p;
+		while (*end && *end != ',' && !isspace ((u_char)*end)) {
+			end++;
+		}
+		len = end - p;
+		for (i = 0; verdict_keys[i].name != NULL; i++) {
+			if (strlen (verdict_keys[i].name) == len &&
+					strncasecmp (verdict_keys[i].name, p, len) == 0) {
+				flags |= verdict_keys[i].flag;
+				break;
+			}
+		}
+		if (verdict_keys[i].name == NULL) {
+			return -1;
+		}
+		p = end;
+	}
+
+	return flags;
+}
+
+struct verdict_body *
+verdict_body_new (void)
+{
+	struct verdict_body *body;
+
+	if ((body = malloc (sizeof (struct verdict_body))) == NULL) {
+		return NULL;
+	}
+	MD5Init (&body->ctx);
+
+	return body;
+}
+
+/* Line endings are normalized by skipping CR */
+void
+verdict_body_update (struct verdict_body *body, const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len, *cr;
+
+	while (p < end) {
+		cr = memchr (p, '\r', end - p);
+		if (cr == NULL) {
+			MD5Update (&body->ctx, p, end - p);
+			break;
+		}
+		if (cr > p) {
+			MD5Update (&body->ctx, p, cr - p);
+		}
+		p = cr + 1;
+	}
+}
+
+void
+verdict_body_free (struct verdict_body *body)
+{
+	free (body);
+}
+
+static void
+verdict_key_string (MD5_CTX *ctx, const char *str)
+{
+	/* Include terminating zero to separate components */
+	MD5Update (ctx, str, strlen (str) + 1);
+}
+
+/*
+ * Make key from body digest and components of message selected by config,
+ * returns 0 if body of message was not hashed
+ */
+int
+verdict_make_key (verdict_cache_t *cache, struct mlfi_priv *priv, verdict_key_t *key)
+{
+	MD5_CTX ctx, body_ctx;
+	u_char final[16], addr[16];
+	struct rcpt *rcpt;
+	const char *domain;
+	int i;
+
+	if (priv->verdict == NULL) {
+		return 0;
+	}
+	/* Body may be fed further so finalize copy of its context */
+	memcpy (&body_ctx, &priv->verdict->ctx, sizeof (MD5_CTX));
+	MD5Final (final, &body_ctx);
+
+	MD5Init (&ctx);
+	MD5Update (&ctx, final, sizeof (final));
+	MD5Update (&ctx, &cache->key_flags, sizeof (cache->key_flags));
+	if (cache->key_flags & VERDICT_KEY_FROM) {
+		verdict_key_string (&ctx, priv->priv_from);
+	}
+	if (cache->key_flags & VERDICT_KEY_FROM_DOMAIN) {
+		domain = strchr (priv->priv_from, '@');
+		verdict_key_string (&ctx, domain != NULL ? domain + 1 : "");
+	}
+	if (cache->key_flags & (VERDICT_KEY_IP | VERDICT_KEY_IP24)) {
+		bzero (addr, sizeof (addr));
+		if (priv->priv_addr.family == AF_INET) {
+			memcpy (addr, &priv->priv_addr.addr.sa4.sin_addr, 4);
+			if (!(cache->key_flags & VERDICT_KEY_IP)) {
+				/* Network /24 */
+				addr[3] = 0;
+			}
+		}
+		else if (priv->priv_addr.family == AF_INET6) {
+			memcpy (addr, &priv->priv_addr.addr.sa6.sin6_addr, 16);
+			if (!(cache->key_flags & VERDICT_KEY_IP)) {
+				/* Network /64 */
+				bzero (addr + 8, 8);
+			}
+		}
+		MD5Update (&ctx, &priv->priv_addr.family, sizeof (priv->priv_addr.family));
+		MD5Update (&ctx, addr, sizeof (addr));
+	}
+	if (cache->key_flags & VERDICT_KEY_HELO) {
+		verdict_key_string (&ctx, priv->priv_helo);
+	}
+	if (cache->key_flags & VERDICT_KEY_USER) {
+		verdict_key_string (&ctx, priv->priv_user);
+	}
+	if (cache->key_flags & VERDICT_KEY_RCPT) {
+		LIST_FOREACH (rcpt, &priv->rcpts, r_list) {
+			verdict_key_string (&ctx, rcpt->r_addr);
+		}
+	}
+	if (cache->key_flags & VERDICT_KEY_SUBJECT) {
+		verdict_key_string (&ctx, priv->priv_subject != NULL ? priv->priv_subject : "");
+	}
+	MD5Final (final, &ctx);
+
+	key->hi = 0;
+	key->lo = 0;
+	for (i = 0; i < 8; i++) {
+		key->hi = (key->hi << 8) | final[i];
+		key->lo = (key->lo << 8) | final[i + 8];
+	}
+
+	return 1;
+}
+
+int
+verdict_lookup (verdict_cache_t *cache, const verdict_key_t *key, time_t tm, struct verdict *v)
+{
+	size_t bucket = key->lo % cache->buckets;
+	verdict_item_t *cur;
+	int i;
+
+	__sync_fetch_and_add (&cache->lookups, 1);
+	V_LOCK (bucket, cache);
+	for (i = 0; i < VERDICT_WAYS; i++) {
+		cur = VERDICT_ITEM (cache, bucket, i);
+		if (cur->time != 0 && cur->key.hi == key->hi && cur->key.lo == key->lo) {
+			if (tm - cur->time > cache->ttl) {
+				/* Expired */
+				cur->time = 0;
+				break;
+			}
+			v->action = cur->action;
+			v->score = cur->score;
+			v->required_score = cur->required_score;
+			V_UNLOCK (bucket, cache);
+			__sync_fetch_and_add (&cache->hits, 1);
+			return 1;
+		}
+	}
+	V_UNLOCK (bucket, cache);
+
+	return 0;
+}
+
+void
+verdict_add (verdict_cache_t *cache, const verdict_key_t *key, time_t tm, const struct verdict *v)
+{
+	size_t bucket = key->lo % cache->buckets;
+	verdict_item_t *cur, *new = NULL, *expired = NULL, *eldest = NULL;
+	int i;
+
+	V_LOCK (bucket, cache);
+	for (i = 0; i < VERDICT_WAYS; i++) {
+		cur = VERDICT_ITEM (cache, bucket, i);
+		if (cur->key.hi == key->hi && cur->key.lo == key->lo) {
+			new = cur;
+			break;
+		}
+		if (cur->time == 0 || tm - cur->time > cache->ttl) {
+			/* Free or expired item */
+			if (expired == NULL) {
+				expired = cur;
+			}
+		}
+		else if (eldest == NULL || cur->time < eldest->time) {
+			eldest = cur;
+		}
+	}
+	if (new == NULL) {
+		new = expired != NULL ? expired : eldest;
+	}
+	new->key = *key;
+	new->time = tm;
+	new->action = v->action;
+	new->score = v->score;
+	new->required_score = v->required_score;
+	V_UNLOCK (bucket, cache);
+}
+
+/* Percent of lookups that were answered from cache */
+double
+verdict_avoided (verdict_cache_t *cache)
+{
+	unsigned long lookups = cache->lookups;
+
+	if (lookups == 0) {
+		return 0.0;
+	}
+
+	return (double)cache->hits * 100.0 / lookups;
+}
+
+void
+verdict_destroy (verdict_cache_t *cache)
+{
+#ifdef _THREAD_SAFE
+	int i;
+
+	for (i = 0; i < VERDICT_LOCKS; i++) {
+		pthread_mutex_destroy (&cache->locks[i]);
+	}
+#endif
+	free (cache->items);
+	free (cache);
+}
+
+/*
+ * vi:ts=4
+ */
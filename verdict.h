@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2007-2012, Vsevolod Stakhov
+ * All rights reserved.
+
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer. Redistributions in binary form
+ * must reproduce the above copyright notice, this list of conditions and the
+ * following disclaimer in the documentation and/or other materials provided with
+ * the distribution. Neither the name of the author nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef VERDICT_H
+#define VERDICT_H
+
+#include <sys/types.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#ifdef HAVE_INTTYPES_H
+#include <inttypes.h>
+#endif
+
+#ifdef _THREAD_SAFE
+#include <pthread.h>
+#endif
+
+/* Number of items in one bucket */
+#define VERDICT_WAYS 4
+#define VERDICT_LOCKS 64
+
+/* Message data that is added to body hash to make key */
+#define VERDICT_KEY_FROM 0x1
+#define VERDICT_KEY_FROM_DOMAIN 0x2
+#define VERDICT_KEY_IP 0x4
+#define VERDICT_KEY_IP24 0x8
+#define VERDICT_KEY_HELO 0x10
+#define VERDICT_KEY_USER 0x20
+#define VERDICT_KEY_RCPT 0x40
+#define VERDICT_KEY_SUBJECT 0x80
+
+#define DEFAULT_VERDICT_KEY (VERDICT_KEY_FROM_DOMAIN | VERDICT_KEY_IP24 | VERDICT_KEY_SUBJECT)
+#define DEFAULT_VERDICT_TTL 60
+
+struct mlfi_priv;
+
+typedef struct verdict_key_s {
+	uint64_t hi;
+	uint64_t lo;
+} verdict_key_t;
+
+/* Result of scan that is reused for messages with the same key */
+struct verdict {
+	int action;
+	double score;
+	double required_score;
+};
+
+typedef struct verdict_item_s {
+	verdict_key_t key;
+	time_t time;
+	float score;
+	float required_score;
+	int action;
+} verdict_item_t;
+
+typedef struct verdict_cache_s {
+	verdict_item_t *items;
+	size_t buckets;
+	/* Live time of verdict */
+	int ttl;
+	/* VERDICT_KEY_* flags */
+	int key_flags;
+	/* Statistics */
+	unsigned long lookups;
+	unsigned long hits;
+#ifdef _THREAD_SAFE
+	pthread_mutex_t locks[VERDICT_LOCKS];
+#endif
+} verdict_cache_t;
+
+/* Body digest of one message */
+struct verdict_body;
+
+verdict_cache_t * verdict_init (size_t size, int ttl, int key_flags);
+int verdict_parse_key (const char *str);
+int verdict_make_key (verdict_cache_t *cache, struct mlfi_priv *priv, verdict_key_t *key);
+int verdict_lookup (verdict_cache_t *cache, const verdict_key_t *key, time_t tm, struct verdict *v);
+void verdict_add (verdict_cache_t *cache, const verdict_key_t *key, time_t tm, const struct verdict *v);
+double verdict_avoided (verdict_cache_t *cache);
+void verdict_destroy (verdict_cache_t *cache);
+
+struct verdict_body * verdict_body_new (void);
+void verdict_body_update (struct verdict_body *body, const char *buf, size_t len);
+void verdict_body_free (struct verdict_body *body);
+
+#endif
+/*
+ * vi:ts=4
+ */